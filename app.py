@@ -3,6 +3,7 @@ import subprocess
 import os
 import json
 import tempfile
+import threading
 import time
 
 app = Flask(__name__)
@@ -13,13 +14,71 @@ order_book_data = {
     "trade_history": {}
 }
 
-# Store command history for persistence between requests
-command_history = []
-
-# Initialize with stock-specific price bands
-command_history.append("setStockPriceBand RELIANCE 2000.0 5.0")
-command_history.append("setStockPriceBand INFY 1500.0 10.0")
-command_history.append("setStockPriceBand TATASTEEL 800.0 20.0")
+# Engine state persists between requests in a snapshot file: each request starts the
+# engine from it and saves it back, instead of replaying every command since startup
+SNAPSHOT_PATH = os.path.join(tempfile.gettempdir(), 'orderbook_session.snap')
+
+# One engine run at a time: each run reads the snapshot the previous one saved
+engine_lock = threading.Lock()
+
+# Instrument configuration for a fresh session
+INITIAL_CONFIG = [
+    "set_price_band RELIANCE 2000.0 5.0",
+    "set_price_band INFY 1500.0 10.0",
+    "set_price_band TATASTEEL 800.0 20.0",
+    # The market index the circuit breaker watches: free-float shares (crore) at the same prices
+    "set_index_constituent RELIANCE 338 2000.0",
+    "set_index_constituent INFY 414 1500.0",
+    "set_index_constituent TATASTEEL 1222 800.0"
+]
+
+
+def run_engine(commands, save=False, fresh=False):
+    """Run the engine on the session snapshot (or an empty book when fresh) with the given
+    commands and return its output. With save, the new state replaces the snapshot only once
+    the run has succeeded; a failed run raises and leaves the session as it was."""
+    saved_path = SNAPSHOT_PATH + '.tmp'
+    with engine_lock:
+        with tempfile.NamedTemporaryFile(mode='w+', delete=False) as tmp:
+            for cmd in commands:
+                tmp.write(cmd + "\n")
+            if save:
+                tmp.write("save_snapshot " + saved_path + "\n")
+            tmp.write("exit\n")
+            tmp_filename = tmp.name
+
+        args = ['./cpp_src/orderbook']
+        if not fresh and os.path.exists(SNAPSHOT_PATH):
+            args += ['--snapshot', SNAPSHOT_PATH]
+
+        try:
+            if os.path.exists(saved_path):
+                os.unlink(saved_path)
+            result = subprocess.run(args + [tmp_filename], capture_output=True, text=True)
+        finally:
+            os.unlink(tmp_filename)
+
+        if result.returncode != 0:
+            raise RuntimeError(f"engine exited with status {result.returncode}: {last_message(result)}")
+        if save:
+            if not os.path.exists(saved_path):
+                raise RuntimeError(f"engine did not save the session: {last_message(result)}")
+            os.replace(saved_path, SNAPSHOT_PATH)
+        return result.stdout
+
+
+def last_message(result):
+    """The engine's last error line, or its last output line when it wrote no errors."""
+    lines = (result.stderr.strip() or result.stdout.strip()).splitlines()
+    return lines[-1] if lines else "no output"
+
+
+def reset_session():
+    """Start a new session: an empty book with only the instrument configuration."""
+    run_engine(INITIAL_CONFIG, save=True, fresh=True)
+
+
+reset_session()
 
 
 @app.route('/')
@@ -31,39 +90,30 @@ def index():
 def place_order():
     # Get order details from form
     order_type = request.form['order_type']  # BUY or SELL
-    order_variant = request.form['order_variant']  # LIMIT, MARKET, IOC, FOK
+    order_variant = request.form['order_variant']  # LIMIT, MARKET, IOC, FOK, STOP, STOP_LIMIT, ICEBERG
     price = request.form['price'] if 'price' in request.form and request.form['price'] else "0.0"
     quantity = request.form['quantity']
     symbol = request.form['symbol']
+    stop_price = request.form.get('stop_price', '')
+    peak = request.form.get('peak', '')
 
     # Add this order to the command history
-    command_history.append(f"place_order {order_type} {order_variant} {price} {quantity} {symbol}")
-
-    # Create a temporary file to store commands for the C++ program
-    with tempfile.NamedTemporaryFile(mode='w+', delete=False) as tmp:
-        # Write all previous commands to rebuild the state
-        for cmd in command_history:
-            tmp.write(cmd + "\n")
-
-        # Write commands to view the results
-        tmp.write("print_orderbook " + symbol + "\n")
-        tmp.write("print_trades " + symbol + "\n")
-        tmp.write("exit\n")
-
-        tmp_filename = tmp.name
+    command = f"place_order {order_type} {order_variant} {price} {quantity} {symbol}"
+    if order_variant == 'STOP_LIMIT' and stop_price:
+        command += f" stop={stop_price}"
+    if order_variant == 'ICEBERG' and peak:
+        command += f" peak={peak}"
 
     try:
-        # Run the C++ executable with the command file
-        result = subprocess.run(
-            ['./cpp_src/orderbook', tmp_filename],
-            capture_output=True, text=True
-        )
+        # Place the order on the saved session, view the results and save the new state
+        output = run_engine([
+            command,
+            "query_book " + symbol + " orders json",
+            "query_trades " + symbol + " json"
+        ], save=True)
 
         # Parse the output
-        parse_orderbook_output(result.stdout)
-
-        # Clean up the temporary file
-        os.unlink(tmp_filename)
+        parse_query_output(output)
 
         # Redirect to the results page
         return redirect(url_for('results', symbol=symbol))
@@ -77,31 +127,15 @@ def view_orderbook():
     if not symbol:
         return redirect(url_for('index'))
 
-    # Create a temporary file with commands
-    with tempfile.NamedTemporaryFile(mode='w+', delete=False) as tmp:
-        # Write all previous commands to rebuild the state
-        for cmd in command_history:
-            tmp.write(cmd + "\n")
-
-        # Write commands to view the results
-        tmp.write("print_orderbook " + symbol + "\n")
-        tmp.write("print_trades " + symbol + "\n")
-        tmp.write("exit\n")
-
-        tmp_filename = tmp.name
-
     try:
-        # Run the C++ executable with the command file
-        result = subprocess.run(
-            ['./cpp_src/orderbook', tmp_filename],
-            capture_output=True, text=True
-        )
+        # Query the saved session without changing it
+        output = run_engine([
+            "query_book " + symbol + " orders json",
+            "query_trades " + symbol + " json"
+        ])
 
         # Parse the output
-        parse_orderbook_output(result.stdout)
-
-        # Clean up the temporary file
-        os.unlink(tmp_filename)
+        parse_query_output(output)
 
         # Redirect to the results page
         return redirect(url_for('results', symbol=symbol))
@@ -111,13 +145,11 @@ def view_orderbook():
 
 @app.route('/reset_orderbook', methods=['POST'])
 def reset_orderbook():
-    # Reset command history to only include price bands
-    global command_history
-    command_history = [
-        "setStockPriceBand RELIANCE 2000.0 5.0",
-        "setStockPriceBand INFY 1500.0 10.0",
-        "setStockPriceBand TATASTEEL 800.0 20.0"
-    ]
+    # Start over from the instrument configuration
+    try:
+        reset_session()
+    except Exception as e:
+        return f"Error: {str(e)}"
 
     # Clear stored data
     order_book_data["order_book"] = {}
@@ -165,86 +197,21 @@ def api_symbols():
     return jsonify(list(symbols))
 
 
-def parse_orderbook_output(output):
-    """Parse the output from the C++ program and store it in the global order_book_data."""
-    lines = output.split('\n')
-
-    current_section = None
-    current_symbol = None
-
-    buy_orders = []
-    sell_orders = []
-    trades = []
-
-    for line in lines:
-        line = line.strip()
-
-        if not line:
+def parse_query_output(output):
+    """Store the JSON documents emitted by the engine's query_* commands in order_book_data."""
+    for line in output.split('\n'):
+        # Engine log lines never start with '{'; every query result is one JSON line
+        if not line.startswith('{'):
             continue
 
-        if line.startswith("Order Book for "):
-            current_section = "orderbook"
-            current_symbol = line.split("Order Book for ")[1].strip(":")
-            buy_orders = []
-            sell_orders = []
-            order_book_data["order_book"][current_symbol] = {
-                "buy_orders": buy_orders,
-                "sell_orders": sell_orders
+        document = json.loads(line)
+        if document["type"] == "book":
+            order_book_data["order_book"][document["symbol"]] = {
+                "buy_orders": document["buy_orders"],
+                "sell_orders": document["sell_orders"]
             }
-
-        elif line.startswith("Trade History for "):
-            current_section = "trades"
-            current_symbol = line.split("Trade History for ")[1].strip(":")
-            trades = []
-            order_book_data["trade_history"][current_symbol] = trades
-
-        elif current_section == "orderbook" and line.startswith("Price: $"):
-            # Parse order book line
-            parts = line.split(", ")
-            order = {}
-            for part in parts:
-                if part.startswith("Price: $"):
-                    order["price"] = float(part.split("Price: $")[1])
-                elif part.startswith("Qty: "):
-                    order["quantity"] = int(part.split("Qty: ")[1])
-                elif part.startswith("ID: "):
-                    order["id"] = int(part.split("ID: ")[1])
-                elif part.startswith("Type: "):
-                    order["type"] = part.split("Type: ")[1]
-                elif part.startswith("Status: "):
-                    order["status"] = part.split("Status: ")[1]
-                elif part.startswith("Time: "):
-                    order["timestamp"] = part.split("Time: ")[1]
-
-            # Add to the appropriate list based on whether it's in Buy Orders or Sell Orders section
-            if "Buy Orders" in output and "Sell Orders" in output:
-                buy_sell_split = output.split("Buy Orders")[1].split("Sell Orders")
-                if len(buy_sell_split) > 0 and line in buy_sell_split[0]:
-                    buy_orders.append(order)
-                else:
-                    sell_orders.append(order)
-            else:
-                # Fallback if we can't determine which section it belongs to
-                if current_symbol in order_book_data["order_book"]:
-                    order_book_data["order_book"][current_symbol]["buy_orders"].append(order)
-
-        elif current_section == "trades" and line.startswith("Time: "):
-            # Parse trade history line
-            parts = line.split(", ")
-            trade = {}
-            for part in parts:
-                if part.startswith("Time: "):
-                    trade["timestamp"] = part.split("Time: ")[1]
-                elif part.startswith("Qty: "):
-                    trade["quantity"] = int(part.split("Qty: ")[1])
-                elif part.startswith("Price: $"):
-                    trade["price"] = float(part.split("Price: $")[1])
-                elif part.startswith("Buy ID: "):
-                    trade["buy_order_id"] = int(part.split("Buy ID: ")[1])
-                elif part.startswith("Sell ID: "):
-                    trade["sell_order_id"] = int(part.split("Sell ID: ")[1])
-
-            trades.append(trade)
+        elif document["type"] == "trades":
+            order_book_data["trade_history"][document["symbol"]] = document["trades"]
 
 
 if __name__ == '__main__':
@@ -14,14 +14,147 @@
 #include <algorithm>
 #include <fstream>
 #include <sstream>
+#include <charconv>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <set>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <csignal>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 enum OrderType { BUY, SELL };
 enum OrderStatus { ACTIVE, FILLED, PARTIALLY_FILLED, CANCELLED };
-enum OrderVariant { LIMIT, MARKET, IOC, FOK }; // Added order variants
+enum OrderVariant { LIMIT, MARKET, IOC, FOK, STOP, STOP_LIMIT, ICEBERG }; // Added order variants
 enum MarketStatus { NORMAL_TRADING, CIRCUIT_HALT, PRE_OPEN_AUCTION, CLOSED };
 enum CircuitLevel { NONE, LEVEL_1, LEVEL_2, LEVEL_3 };
+enum QueryFormat { JSON_FORMAT, BINARY_FORMAT };
+enum BookView { LEVEL_VIEW, ORDER_VIEW };
+
+// Binary query frames: magic, frame type, reserved byte, payload length, payload
+const uint16_t FRAME_MAGIC = 0x4653;  // "SF"
+enum FrameType : uint8_t { FRAME_BOOK_LEVELS = 1, FRAME_BOOK_ORDERS = 2, FRAME_TRADES = 3, FRAME_STATUS = 4,
+                           FRAME_ORDER_STATUS = 5 };
+
+string getMarketStatusString(MarketStatus status) {
+    switch(status) {
+        case NORMAL_TRADING: return "NORMAL_TRADING";
+        case CIRCUIT_HALT: return "CIRCUIT_HALT";
+        case PRE_OPEN_AUCTION: return "PRE_OPEN_AUCTION";
+        case CLOSED: return "CLOSED";
+        default: return "UNKNOWN";
+    }
+}
+
+// Session clock for order and trade event times. Readings come from steady_clock in
+// nanoseconds, so they are monotonic and cheap; the wall clock is sampled once when the
+// session starts so event times still map onto calendar time for display.
+class EngineClock {
+private:
+    int64_t wallAnchorNs;
+    chrono::steady_clock::time_point steadyAnchor;
+    bool logical;
+    atomic<int64_t> logicalNs;
+
+public:
+    EngineClock()
+        : wallAnchorNs(chrono::duration_cast<chrono::nanoseconds>(
+              chrono::system_clock::now().time_since_epoch()).count()),
+          steadyAnchor(chrono::steady_clock::now()),
+          logical(false),
+          logicalNs(0) {}
+
+    // Replay mode: time only moves when the driver advances it, once per input event,
+    // so the same input produces the same timestamps however often the engine reads them
+    void setLogical(int64_t startNs) {
+        logical = true;
+        logicalNs = startNs;
+    }
+
+    void advance(int64_t ns) {
+        logicalNs += ns;
+    }
+
+    // Logical time restarts at the epoch; never let it run behind restored events, whose
+    // order decides which side of a cross arrived last
+    void catchUp(int64_t ns) {
+        if (logical && logicalNs < ns) {
+            logicalNs = ns;
+        }
+    }
+
+    // Nanoseconds since the epoch
+    int64_t now() const {
+        if (logical) {
+            return logicalNs.load(memory_order_relaxed);
+        }
+        return wallAnchorNs + chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - steadyAnchor).count();
+    }
+
+    time_t nowSeconds() const {
+        return static_cast<time_t>(now() / 1000000000);
+    }
+};
+
+// Formats event times as "%Y-%m-%d %H:%M:%S". localtime_r runs once per hour (hour
+// boundaries are where DST shifts happen) and minutes/seconds are filled in arithmetically,
+// so printing a large book barely touches libc time code. The returned buffer is per
+// thread and valid until the next call on that thread.
+const char* formatEventTime(int64_t eventNs) {
+    thread_local time_t cachedSecond = -1;
+    thread_local time_t hourStart = 0;
+    thread_local char buffer[20];
+
+    time_t second = static_cast<time_t>(eventNs / 1000000000);
+    if (second == cachedSecond) {
+        return buffer;
+    }
+
+    if (cachedSecond < 0 || second < hourStart || second >= hourStart + 3600) {
+        struct tm local;
+        localtime_r(&second, &local);
+        hourStart = second - (local.tm_min * 60 + local.tm_sec);
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &local);
+    } else {
+        int secondOfHour = static_cast<int>(second - hourStart);
+        int minute = secondOfHour / 60;
+        int sec = secondOfHour % 60;
+        buffer[14] = static_cast<char>('0' + minute / 10);
+        buffer[15] = static_cast<char>('0' + minute % 10);
+        buffer[17] = static_cast<char>('0' + sec / 10);
+        buffer[18] = static_cast<char>('0' + sec % 10);
+    }
+
+    cachedSecond = second;
+    return buffer;
+}
 
 // Forward declaration
 class OrderBook;
@@ -35,14 +168,23 @@ public:
     int quantity;
     int filled_quantity;
     OrderStatus status;
-    time_t timestamp;
+    int64_t timestamp;  // Event time in ns since the epoch (EngineClock)
     string symbol;
     time_t expiry;  // For GTD orders
+    double stopPrice;  // Trigger price for STOP / STOP_LIMIT orders
+    int peakSize;  // Visible slice for ICEBERG orders (0 = fully displayed)
+    int displayedQuantity;  // What is left of the current iceberg slice
+    bool resting;  // Entered a price level of the book
+    int linkGroup;  // OCO or bracket group this order belongs to (0 = not linked)
+    bool spreadLeg;  // Leg child of a spread order, trading under the spread order's ID
+    string account;  // Owning account, empty if none was given
 
     Order() : id(0), type(BUY), variant(LIMIT), price(0), quantity(0), filled_quantity(0),
-             status(ACTIVE), timestamp(time(0)), expiry(0) {}
+             status(ACTIVE), timestamp(0), expiry(0), stopPrice(0), peakSize(0), displayedQuantity(0),
+             resting(false), linkGroup(0), spreadLeg(false) {}
 
-    Order(int id, OrderType type, OrderVariant variant, double price, int quantity, string sym, time_t exp = 0)
+    Order(int id, OrderType type, OrderVariant variant, double price, int quantity, string sym,
+          int64_t ts = 0, time_t exp = 0)
         : id(id),
           type(type),
           variant(variant),
@@ -50,18 +192,38 @@ public:
           quantity(quantity),
           filled_quantity(0),
           status(ACTIVE),
-          timestamp(time(0)),
+          timestamp(ts),
           symbol(sym),
-          expiry(exp) {}
+          expiry(exp),
+          stopPrice(0),
+          peakSize(0),
+          displayedQuantity(0),
+          resting(false),
+          linkGroup(0),
+          spreadLeg(false) {}
 
     int getRemainingQuantity() const {
         return quantity - filled_quantity;
     }
 
-    string getTimestamp() const {
-        char buffer[26];
-        strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", localtime(&timestamp));
-        return string(buffer);
+    // Quantity visible to the market; an iceberg only shows its current slice
+    int getDisplayedQuantity() const {
+        if (peakSize <= 0) {
+            return getRemainingQuantity();
+        }
+        return min(displayedQuantity, getRemainingQuantity());
+    }
+
+    bool needsReplenish() const {
+        return peakSize > 0 && displayedQuantity <= 0 && getRemainingQuantity() > 0;
+    }
+
+    void replenish() {
+        displayedQuantity = min(peakSize, getRemainingQuantity());
+    }
+
+    const char* getTimestamp() const {
+        return formatEventTime(timestamp);
     }
 
     string getStatusString() const {
@@ -80,6 +242,9 @@ public:
             case MARKET: return "MARKET";
             case IOC: return "IOC";
             case FOK: return "FOK";
+            case STOP: return "STOP";
+            case STOP_LIMIT: return "STOP_LIMIT";
+            case ICEBERG: return "ICEBERG";
             default: return "UNKNOWN";
         }
     }
@@ -93,16 +258,17 @@ public:
     string symbol;
     double price;
     int quantity;
-    time_t timestamp;
+    int64_t timestamp;  // Event time in ns since the epoch (EngineClock)
+    string buyAccount;  // Accounts of the two orders, empty if none was given
+    string sellAccount;
 
-    Trade(int buyId, int sellId, const string& sym, double p, int qty)
+    Trade(int buyId, int sellId, const string& sym, double p, int qty, int64_t ts,
+          const string& buyAcct = "", const string& sellAcct = "")
         : buyOrderId(buyId), sellOrderId(sellId), symbol(sym),
-          price(p), quantity(qty), timestamp(time(0)) {}
+          price(p), quantity(qty), timestamp(ts), buyAccount(buyAcct), sellAccount(sellAcct) {}
 
-    string getTimestamp() const {
-        char buffer[26];
-        strftime(buffer, 26, "%Y-%m-%d %H:%M:%S", localtime(&timestamp));
-        return string(buffer);
+    const char* getTimestamp() const {
+        return formatEventTime(timestamp);
     }
 };
 
@@ -163,15 +329,42 @@ public:
         return haltEndTime;
     }
 
+    double getCurrentValue() const {
+        return currentValue;
+    }
+
+    double getReferenceValue() const {
+        return referenceValue;
+    }
+
+    // New reference level (e.g. the previous close); clears any halt in progress
+    void setReferenceValue(double refValue) {
+        referenceValue = refValue;
+        currentValue = refValue;
+        currentLevel = NONE;
+        status = NORMAL_TRADING;
+        haltStartTime = haltEndTime = 0;
+    }
+
+    // Reinstate saved state from an engine snapshot
+    void restore(double refValue, double value, MarketStatus savedStatus, time_t savedHaltEnd) {
+        setReferenceValue(refValue);
+        currentValue = value;
+        status = savedStatus;
+        haltEndTime = savedHaltEnd;
+    }
+
 private:
     void triggerCircuitBreaker(CircuitLevel level, time_t currentTime) {
         currentLevel = level;
         status = CIRCUIT_HALT;
         haltStartTime = currentTime;
 
-        struct tm* timeinfo = localtime(&currentTime);
-        int hour = timeinfo->tm_hour;
-        int minute = timeinfo->tm_min;
+        // Backtest workers run books in parallel; localtime's shared buffer is not theirs to use
+        struct tm timeinfo;
+        localtime_r(&currentTime, &timeinfo);
+        int hour = timeinfo.tm_hour;
+        int minute = timeinfo.tm_min;
 
         // Convert to minutes since market open for easier comparison (assuming 9:00 AM open)
         int minutesSinceOpen = (hour - 9) * 60 + minute;
@@ -208,971 +401,7623 @@ private:
     }
 };
 
-class OrderBook {
-private:
-    // Price -> deque of Order pointers (for time priority)
-    // Using map for price levels (automatically sorted)
-    unordered_map<string, map<double, deque<shared_ptr<Order>>, greater<double>>> buyOrders;  // Descending for buys
-    unordered_map<string, map<double, deque<shared_ptr<Order>>, less<double>>> sellOrders;    // Ascending for sells
+// Market index computed from constituent last prices, relative to the breaker reference:
+// value = reference * sum(weight * last) / sum(weight * base). Weights are index shares
+// (free-float shares, or plain weights with base 1). A fill only moves the running sum by
+// its own constituent's weight * price change, so it costs O(1) however large the index.
+class EngineIndex {
+public:
+    struct Constituent {
+        double weight;
+        double basePrice;
+        double lastPrice;
+    };
 
-    // All orders by ID for quick lookup
-    unordered_map<int, shared_ptr<Order>> orderMap;
+private:
+    // Incremental updates between full re-sums, which bound floating-point drift
+    static const uint32_t RESUM_INTERVAL = 4096;
+
+    unordered_map<string, Constituent> constituents;
+    double weightedBase;
+    double weightedLast;
+    uint32_t updatesSinceResum;
+    bool dirty;
+    int64_t intervalNs;
+    int64_t lastEvaluationNs;
+    mutex lock;  // Fills on different symbols may update the index concurrently
+
+    void resum() {
+        weightedBase = weightedLast = 0.0;
+        for (const auto& entry : constituents) {
+            weightedBase += entry.second.weight * entry.second.basePrice;
+            weightedLast += entry.second.weight * entry.second.lastPrice;
+        }
+        updatesSinceResum = 0;
+    }
 
-    // Symbol-level locks for better concurrency
-    unordered_map<string, shared_mutex> symbolMutexes;
-    mutex orderIdMutex;
+public:
+    EngineIndex()
+        : weightedBase(0.0), weightedLast(0.0), updatesSinceResum(0), dirty(false),
+          intervalNs(1000000000LL), lastEvaluationNs(INT64_MIN) {}
+
+    // Weight 0 removes the constituent; the last price restarts at the base price.
+    // Configuring the index is not a move: only trades mark it for evaluation.
+    void setConstituent(const string& symbol, double weight, double basePrice, double lastPrice = 0.0) {
+        lock_guard<mutex> guard(lock);
+        if (weight > 0 && basePrice > 0) {
+            constituents[symbol] = { weight, basePrice, lastPrice > 0 ? lastPrice : basePrice };
+        } else {
+            constituents.erase(symbol);
+        }
+        resum();
+        if (constituents.empty()) {
+            dirty = false;
+        }
+    }
 
-    // Circuit breaker for market-wide halts
-    MarketCircuitBreaker circuitBreaker;
+    // Minimum event time between breaker evaluations (0 = after every match that moved it)
+    void setInterval(int64_t ns) {
+        lock_guard<mutex> guard(lock);
+        intervalNs = max<int64_t>(ns, 0);
+    }
 
-    // Individual stock price bands (dynamic circuit breakers)
-    unordered_map<string, double> referencePrices;
-    unordered_map<string, double> priceBandPercentages;
+    int64_t interval() {
+        lock_guard<mutex> guard(lock);
+        return intervalNs;
+    }
 
-    int nextOrderId;
-    vector<shared_ptr<Trade>> tradeHistory;
+    bool empty() {
+        lock_guard<mutex> guard(lock);
+        return constituents.empty();
+    }
 
-public:
-    OrderBook() : nextOrderId(1), circuitBreaker(17500.0) {
-        // Initialize with default reference index value (e.g., Nifty50 at 17500)
+    void onTrade(const string& symbol, double price) {
+        lock_guard<mutex> guard(lock);
+        auto it = constituents.find(symbol);
+        if (it == constituents.end() || it->second.lastPrice == price) {
+            return;
+        }
+        weightedLast += it->second.weight * (price - it->second.lastPrice);
+        it->second.lastPrice = price;
+        dirty = true;
+        if (++updatesSinceResum >= RESUM_INTERVAL) {
+            resum();
+        }
     }
 
-    void setStockPriceBand(const string& symbol, double referencePrice, double bandPercentage) {
-        referencePrices[symbol] = referencePrice;
-        priceBandPercentages[symbol] = bandPercentage;
+    double value(double reference) {
+        lock_guard<mutex> guard(lock);
+        return weightedBase > 0 ? reference * weightedLast / weightedBase : reference;
     }
 
-    void updateIndexValue(double newValue, time_t currentTime) {
-        bool circuitTriggered = circuitBreaker.updateMarketValue(newValue, currentTime);
-        if (circuitTriggered) {
-            cout << "MARKET CIRCUIT BREAKER TRIGGERED!" << endl;
-            MarketStatus status = circuitBreaker.getStatus();
-            if (status == CIRCUIT_HALT) {
-                time_t endTime = circuitBreaker.getHaltEndTime();
-                char buffer[26];
-                strftime(buffer, 26, "%H:%M:%S", localtime(&endTime));
-                cout << "Trading halted until: " << buffer << endl;
-            } else if (status == CLOSED) {
-                cout << "Trading halted for the remainder of the day." << endl;
-            }
+    // True (with the value) once the index has moved and the interval has passed since
+    // the last evaluation
+    bool due(int64_t now, double reference, double& indexValue) {
+        lock_guard<mutex> guard(lock);
+        if (!dirty || weightedBase <= 0 ||
+            (lastEvaluationNs != INT64_MIN && now - lastEvaluationNs < intervalNs)) {
+            return false;
         }
+        dirty = false;
+        lastEvaluationNs = now;
+        indexValue = reference * weightedLast / weightedBase;
+        return true;
     }
 
-    // Market Order - executes immediately at best available price
-    int placeMarketOrder(OrderType type, int quantity, const string& symbol) {
-        // Check market status
-        MarketStatus marketStatus = circuitBreaker.getStatus();
-        if (marketStatus != NORMAL_TRADING) {
-            cout << "Market order rejected: Market is not in normal trading mode." << endl;
-            return -1;
+    // Trailing evaluation: take a move the interval is still holding back
+    bool settle(int64_t now, double reference, double& indexValue) {
+        lock_guard<mutex> guard(lock);
+        if (!dirty || weightedBase <= 0) {
+            return false;
         }
+        dirty = false;
+        lastEvaluationNs = now;
+        indexValue = reference * weightedLast / weightedBase;
+        return true;
+    }
 
-        // Generate unique order ID
-        lock_guard<mutex> idLock(orderIdMutex);
-        int orderId = nextOrderId++;
+    // Whether due() would fire now, without taking the evaluation
+    bool pending(int64_t now) {
+        lock_guard<mutex> guard(lock);
+        return dirty && weightedBase > 0 &&
+               (lastEvaluationNs == INT64_MIN || now - lastEvaluationNs >= intervalNs);
+    }
 
-        // For market orders, price is set to 0 initially (placeholder)
-        auto newOrder = make_shared<Order>(orderId, type, MARKET, 0.0, quantity, symbol);
+    // Evaluation state saved in snapshots, so a move the interval held back is still
+    // evaluated after a restart
+    bool movePending() {
+        lock_guard<mutex> guard(lock);
+        return dirty;
+    }
 
-        // Store in ID map
-        orderMap[orderId] = newOrder;
+    int64_t lastEvaluation() {
+        lock_guard<mutex> guard(lock);
+        return lastEvaluationNs;
+    }
 
-        cout << "Market Order Placed: " << (type == BUY ? "BUY" : "SELL")
-             << " " << quantity << " " << symbol << " at MARKET"
-             << " (ID: " << orderId << ")" << endl;
+    void restoreEvaluation(bool pendingMove, int64_t lastEvaluationTime) {
+        lock_guard<mutex> guard(lock);
+        dirty = pendingMove && weightedBase > 0;
+        lastEvaluationNs = lastEvaluationTime;
+    }
 
-        // Execute market order immediately
-        executeMarketOrder(newOrder);
+    vector<pair<string, Constituent>> list() {
+        lock_guard<mutex> guard(lock);
+        vector<pair<string, Constituent>> result(constituents.begin(), constituents.end());
+        sort(result.begin(), result.end(),
+             [](const pair<string, Constituent>& a, const pair<string, Constituent>& b) { return a.first < b.first; });
+        return result;
+    }
 
-        return orderId;
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        constituents.clear();
+        resum();
+        dirty = false;
+        lastEvaluationNs = INT64_MIN;
     }
+};
 
-    // IOC (Immediate or Cancel) Order
-    int placeIOCOrder(OrderType type, double price, int quantity, const string& symbol) {
-        // Check market status
-        MarketStatus marketStatus = circuitBreaker.getStatus();
-        if (marketStatus != NORMAL_TRADING) {
-            cout << "IOC order rejected: Market is not in normal trading mode." << endl;
-            return -1;
+// Append-only output buffer for the structured query commands. Storage is allocated once
+// and reused between queries, numbers are written with to_chars, and the finished JSON
+// document or binary frame goes out in a single write - no iostream formatting per field.
+class BufferWriter {
+private:
+    vector<char> buffer;
+    size_t used;
+
+    char* reserve(size_t n) {
+        if (used + n > buffer.size()) {
+            buffer.resize(max(buffer.size() * 2, used + n));
         }
+        return buffer.data() + used;
+    }
 
-        // Generate unique order ID
-        lock_guard<mutex> idLock(orderIdMutex);
-        int orderId = nextOrderId++;
+public:
+    explicit BufferWriter(size_t capacity = 64 * 1024) : buffer(capacity), used(0) {}
 
-        auto newOrder = make_shared<Order>(orderId, type, IOC, price, quantity, symbol);
+    void clear() { used = 0; }
+    const char* data() const { return buffer.data(); }
+    size_t size() const { return used; }
 
-        // Store in ID map
-        orderMap[orderId] = newOrder;
+    void put(char c) {
+        *reserve(1) = c;
+        used += 1;
+    }
 
-        cout << "IOC Order Placed: " << (type == BUY ? "BUY" : "SELL")
-             << " " << quantity << " " << symbol << " at $" << fixed << setprecision(2)
-             << price << " (ID: " << orderId << ")" << endl;
+    void put(const char* s, size_t n) {
+        memcpy(reserve(n), s, n);
+        used += n;
+    }
 
-        // Execute IOC order immediately
-        executeIOCOrder(newOrder);
+    void put(const char* s) { put(s, strlen(s)); }
+    void put(const string& s) { put(s.data(), s.size()); }
 
-        return orderId;
+    template <typename T>
+    void putNumber(T value) {
+        char* begin = reserve(32);
+        auto result = to_chars(begin, begin + 32, value);
+        used += result.ptr - begin;
     }
 
-    // FOK (Fill or Kill) Order
-    int placeFOKOrder(OrderType type, double price, int quantity, const string& symbol) {
-        // Check market status
-        MarketStatus marketStatus = circuitBreaker.getStatus();
-        if (marketStatus != NORMAL_TRADING) {
-            cout << "FOK order rejected: Market is not in normal trading mode." << endl;
-            return -1;
-        }
+    // JSON string; symbols and enum names never need escaping beyond quotes/backslashes
+    void putString(const string& s) { putString(s.data(), s.size()); }
+    void putString(const char* s) { putString(s, strlen(s)); }
 
-        // Generate unique order ID
-        lock_guard<mutex> idLock(orderIdMutex);
-        int orderId = nextOrderId++;
+    void putString(const char* s, size_t n) {
+        put('"');
+        for (size_t i = 0; i < n; ++i) {
+            char c = s[i];
+            if (c == '"' || c == '\\') put('\\');
+            put(c);
+        }
+        put('"');
+    }
 
-        auto newOrder = make_shared<Order>(orderId, type, FOK, price, quantity, symbol);
+    // Binary fields are little-endian native layout
+    template <typename T>
+    void putRaw(const T& value) {
+        memcpy(reserve(sizeof(T)), &value, sizeof(T));
+        used += sizeof(T);
+    }
 
-        // Store in ID map
-        orderMap[orderId] = newOrder;
+    template <typename T>
+    void patchRaw(size_t offset, const T& value) {
+        memcpy(buffer.data() + offset, &value, sizeof(T));
+    }
 
-        cout << "FOK Order Placed: " << (type == BUY ? "BUY" : "SELL")
-             << " " << quantity << " " << symbol << " at $" << fixed << setprecision(2)
-             << price << " (ID: " << orderId << ")" << endl;
+    void putShortString(const string& s) {
+        uint8_t len = static_cast<uint8_t>(min<size_t>(s.size(), 255));
+        putRaw(len);
+        put(s.data(), len);
+    }
 
-        // Execute FOK order
-        if (!executeFOKOrder(newOrder)) {
-            // If not fully executed, cancel the order
-            newOrder->status = CANCELLED;
-            cout << "FOK Order " << orderId << " cancelled: Could not fill completely." << endl;
+    // LEB128: 7 bits per byte, high bit set on all but the last
+    void putVarint(uint64_t value) {
+        char* out = reserve(10);
+        size_t n = 0;
+        while (value >= 0x80) {
+            out[n++] = static_cast<char>((value & 0x7F) | 0x80);
+            value >>= 7;
         }
+        out[n++] = static_cast<char>(value);
+        used += n;
+    }
 
-        return orderId;
+    // Signed values zigzag-mapped first, so small negative deltas stay short
+    void putZigzag(int64_t value) {
+        putVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
     }
+};
 
-    // Regular limit order (enhanced version to include OrderVariant)
-    int placeOrder(OrderType type, double price, int quantity, const string& symbol) {
-        return placeOrder(type, LIMIT, price, quantity, symbol);
+// Reads what BufferWriter's binary fields wrote. Reading past the end clears ok() and
+// yields zeros, so callers check once at the end instead of after every field.
+class BufferReader {
+private:
+    const char* cursor;
+    const char* end;
+    bool valid;
+
+public:
+    BufferReader(const char* data, size_t size) : cursor(data), end(data + size), valid(true) {}
+
+    bool ok() const { return valid; }
+    bool atEnd() const { return cursor == end; }
+
+    template <typename T>
+    T getRaw() {
+        T value{};
+        if (static_cast<size_t>(end - cursor) < sizeof(T)) {
+            valid = false;
+            cursor = end;
+            return value;
+        }
+        memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+        return value;
     }
 
-    // General order placement function that handles all order types
-    int placeOrder(OrderType type, OrderVariant variant, double price, int quantity, const string& symbol) {
-        // For market orders, delegate to dedicated function
-        if (variant == MARKET) {
-            return placeMarketOrder(type, quantity, symbol);
+    // A one-byte enum, rejected unless within [first, last]
+    template <typename E>
+    E getEnum(uint8_t first, uint8_t last) {
+        uint8_t value = getRaw<uint8_t>();
+        if (value < first || value > last) {
+            valid = false;
+            cursor = end;
+            return static_cast<E>(first);
         }
-        // For IOC orders, delegate to dedicated function
-        else if (variant == IOC) {
-            return placeIOCOrder(type, price, quantity, symbol);
+        return static_cast<E>(value);
+    }
+
+    // Element count of a following array, rejected if the records cannot possibly fit
+    uint32_t getCount(size_t minRecordSize) {
+        uint32_t count = getRaw<uint32_t>();
+        if (static_cast<uint64_t>(count) * minRecordSize > static_cast<uint64_t>(end - cursor)) {
+            valid = false;
+            cursor = end;
+            return 0;
         }
-        // For FOK orders, delegate to dedicated function
-        else if (variant == FOK) {
-            return placeFOKOrder(type, price, quantity, symbol);
+        return count;
+    }
+
+    string getShortString() {
+        uint8_t len = getRaw<uint8_t>();
+        if (static_cast<size_t>(end - cursor) < len) {
+            valid = false;
+            cursor = end;
+            return string();
         }
+        string value(cursor, len);
+        cursor += len;
+        return value;
+    }
 
-        // Regular limit order processing
-        // Check if market is halted due to circuit breaker
-        MarketStatus marketStatus = circuitBreaker.getStatus();
-        if (marketStatus == CIRCUIT_HALT || marketStatus == CLOSED) {
-            cout << "Order rejected: Market is currently halted due to circuit breaker." << endl;
-            return -1;
+    uint64_t getVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (cursor == end) break;
+            uint8_t byte = static_cast<uint8_t>(*cursor++);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
         }
+        valid = false;
+        cursor = end;
+        return 0;
+    }
 
-        // Check if pre-open auction is in progress (would have different order matching)
-        if (marketStatus == PRE_OPEN_AUCTION) {
-            cout << "Order queued for pre-open auction session." << endl;
-            // In a real system, this would queue the order for the auction matching
-            // For simplicity, we'll just reject it
-            return -1;
+    int64_t getZigzag() {
+        uint64_t value = getVarint();
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    // The next n bytes as a sub-reader
+    BufferReader getSlice(size_t n) {
+        if (static_cast<size_t>(end - cursor) < n) {
+            valid = false;
+            cursor = end;
+            return BufferReader(end, 0);
         }
+        BufferReader slice(cursor, n);
+        cursor += n;
+        return slice;
+    }
+};
 
-        // Check stock-specific price bands
-        if (referencePrices.find(symbol) != referencePrices.end()) {
-            double refPrice = referencePrices[symbol];
-            double bandPct = priceBandPercentages[symbol];
-            double upperLimit = refPrice * (1 + bandPct/100.0);
-            double lowerLimit = refPrice * (1 - bandPct/100.0);
-
-            if (price > upperLimit || price < lowerLimit) {
-                cout << "Order rejected: Price " << price << " is outside the allowed band of "
-                     << lowerLimit << " to " << upperLimit << " for " << symbol << endl;
-                return -1;
-            }
+// CRC-32 (IEEE 802.3), for archive block checksums
+uint32_t crc32(const char* data, size_t size) {
+    static const vector<uint32_t> table = [] {
+        vector<uint32_t> entries(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[i] = c;
         }
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
 
-        // Generate unique order ID
-        {
-            lock_guard<mutex> idLock(orderIdMutex);
-            int orderId = nextOrderId++;
+// Aggregated price level as served to depth queries
+struct DepthLevel {
+    double price;
+    int64_t quantity;
+    uint32_t orders;
+};
 
-            auto newOrder = make_shared<Order>(orderId, type, variant, price, quantity, symbol);
+// Cached top levels of one book. Writers invalidate a side under the symbol's unique
+// lock; readers under the shared lock rebuild and copy it under rebuildMutex.
+const size_t DEPTH_CACHE_LEVELS = 10;
 
-            // Store in ID map (needs to happen before we release the lock)
-            orderMap[orderId] = newOrder;
+struct DepthCache {
+    mutex rebuildMutex;
+    bool bidsValid = false;
+    bool asksValid = false;
+    vector<DepthLevel> bids;
+    vector<DepthLevel> asks;
+};
 
-            // Lock the specific symbol
-            {
-                unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(symbol));
+// Shared-memory book snapshots for local reader processes (UI, risk, TCA). The engine
+// publishes top-of-book levels, the last trade and market status into a POSIX shm region;
+// each symbol slot is guarded by its own seqlock, so readers copy a consistent snapshot
+// without taking any engine lock and the matcher never waits on a reader.
+const int SNAPSHOT_DEPTH = 10;
+const int SNAPSHOT_MAX_SYMBOLS = 256;
+const uint32_t SNAPSHOT_MAGIC = 0x50414e53;  // "SNAP"
+const uint32_t SNAPSHOT_VERSION = 1;
 
-                // Add to the appropriate price level
-                if (type == BUY) {
-                    buyOrders[symbol][price].push_back(newOrder);
-                } else {
-                    sellOrders[symbol][price].push_back(newOrder);
-                }
-            }
+struct SnapshotLevel {
+    double price;
+    int64_t quantity;
+};
 
-            cout << "Order Placed: " << (type == BUY ? "BUY" : "SELL")
-                 << " " << quantity << " " << symbol << " at $" << fixed << setprecision(2)
-                 << price << " (" << newOrder->getVariantString() << ", ID: " << orderId << ")" << endl;
+struct SymbolSnapshot {
+    char symbol[16];
+    uint32_t bidCount;
+    uint32_t askCount;
+    SnapshotLevel bids[SNAPSHOT_DEPTH];
+    SnapshotLevel asks[SNAPSHOT_DEPTH];
+    double lastTradePrice;
+    int32_t lastTradeQuantity;
+    int64_t lastTradeTime;
+    int64_t updateTime;
+};
 
-            // Match orders after placing a new one - this will acquire its own lock
-            matchOrders(symbol);
+struct MarketSnapshot {
+    int32_t marketStatus;
+    double indexValue;
+};
 
-            return orderId;
-        }
-    }
+// A seqlock word followed by the plain data it guards
+template <typename T>
+struct SeqlockSlot {
+    atomic<uint64_t> sequence;  // Odd while the writer is mid-update
+    T data;
+};
 
-    void matchOrders(const string& symbol) {
-        // Create a new lock - don't assume the calling function has locked
-        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+struct SnapshotRegion {
+    uint32_t magic;
+    uint32_t version;
+    atomic<uint32_t> symbolCount;
+    SeqlockSlot<MarketSnapshot> market;
+    SeqlockSlot<SymbolSnapshot> symbols[SNAPSHOT_MAX_SYMBOLS];
+};
 
-        auto& buyBook = buyOrders[symbol];
-        auto& sellBook = sellOrders[symbol];
+static_assert(atomic<uint64_t>::is_always_lock_free, "seqlock needs lock-free 64-bit atomics");
 
-        bool matchFound;
-        do {
-            matchFound = false;
+// Seqlock read: retry until the copy was taken between two equal, even sequence values.
+// Gives up after a bounded number of attempts so a writer that died mid-update (leaving
+// the sequence odd) cannot hang the reader.
+const int SEQLOCK_READ_ATTEMPTS = 100000;
 
-            // Check if we have any buy and sell orders
-            if (!buyBook.empty() && !sellBook.empty()) {
-                // Get best buy price (highest) and best sell price (lowest)
-                auto bestBuyIt = buyBook.begin();
-                auto bestSellIt = sellBook.begin();
+template <typename T>
+bool readSeqlocked(const SeqlockSlot<T>& slot, T& copy) {
+    for (int attempt = 0; attempt < SEQLOCK_READ_ATTEMPTS; ++attempt) {
+        uint64_t before = slot.sequence.load(memory_order_acquire);
+        if (before & 1) {
+            this_thread::yield();
+            continue;
+        }
+        memcpy(static_cast<void*>(&copy), static_cast<const void*>(&slot.data), sizeof(T));
+        atomic_thread_fence(memory_order_acquire);
+        if (slot.sequence.load(memory_order_relaxed) == before) {
+            return true;
+        }
+    }
+    return false;
+}
 
-                // If the best buy price >= best sell price, we have a match
-                if (bestBuyIt->first >= bestSellIt->first &&
-                    !bestBuyIt->second.empty() && !bestSellIt->second.empty()) {
+// The matcher only stages snapshots (latest wins per symbol); a writer thread copies them
+// into the region, so no seqlock write happens under an engine lock and every slot has a
+// single writer.
+class SnapshotPublisher {
+private:
+    SnapshotRegion* region;
+    unordered_map<string, int> slots;  // Writer thread only
+
+    unordered_map<string, SymbolSnapshot> pendingBooks;
+    MarketSnapshot pendingMarket;
+    bool marketPending;
+    bool stopping;
+    set<string> rejectedSymbols;
+    mutex stageMutex;
+    condition_variable staged;
+    thread writer;
+
+    void beginWrite(atomic<uint64_t>& sequence) {
+        sequence.store(sequence.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
 
-                    // Get the oldest orders at these price levels
-                    auto buyOrder = bestBuyIt->second.front();
-                    auto sellOrder = bestSellIt->second.front();
+    void endWrite(atomic<uint64_t>& sequence) {
+        sequence.store(sequence.load(memory_order_relaxed) + 1, memory_order_release);
+    }
 
-                    // Continue only if both orders are active
-                    if (buyOrder->status != CANCELLED && sellOrder->status != CANCELLED) {
-                        // Determine match quantity and execute the trade
-                        int matchQuantity = min(buyOrder->getRemainingQuantity(), sellOrder->getRemainingQuantity());
-                        double tradePrice = sellOrder->price; // Match at sell price (taker pays)
+    SeqlockSlot<SymbolSnapshot>* slotFor(const string& symbol) {
+        auto it = slots.find(symbol);
+        if (it != slots.end()) {
+            return &region->symbols[it->second];
+        }
 
-                        // Record the trade
-                        auto trade = make_shared<Trade>(buyOrder->id, sellOrder->id, symbol, tradePrice, matchQuantity);
-                        tradeHistory.push_back(trade);
+        uint32_t index = region->symbolCount.load(memory_order_relaxed);
+        if (index >= SNAPSHOT_MAX_SYMBOLS) {
+            return nullptr;
+        }
 
-                        // Update order quantities
-                        buyOrder->filled_quantity += matchQuantity;
-                        sellOrder->filled_quantity += matchQuantity;
+        SeqlockSlot<SymbolSnapshot>* slot = &region->symbols[index];
+        beginWrite(slot->sequence);
+        memcpy(slot->data.symbol, symbol.c_str(), symbol.size() + 1);
+        endWrite(slot->sequence);
 
-                        // Update order status
-                        updateOrderStatus(buyOrder);
-                        updateOrderStatus(sellOrder);
+        slots[symbol] = index;
+        region->symbolCount.store(index + 1, memory_order_release);
+        return slot;
+    }
 
-                        cout << "\nTrade Executed: " << matchQuantity << " " << symbol
-                             << " at $" << fixed << setprecision(2) << tradePrice
-                             << " (Buy: " << buyOrder->id << ", Sell: " << sellOrder->id << ")" << endl;
+    void writeBook(const string& symbol, const SymbolSnapshot& snapshot) {
+        SeqlockSlot<SymbolSnapshot>* slot = slotFor(symbol);
+        if (!slot) {
+            return;
+        }
 
-                        // Clean up fully filled or cancelled orders
-                        if (buyOrder->status == FILLED || buyOrder->status == CANCELLED) {
-                            bestBuyIt->second.pop_front();
-                            if (bestBuyIt->second.empty()) {
-                                buyBook.erase(bestBuyIt);
-                            }
-                        }
+        SymbolSnapshot& data = slot->data;
+        beginWrite(slot->sequence);
+        data.bidCount = snapshot.bidCount;
+        data.askCount = snapshot.askCount;
+        memcpy(data.bids, snapshot.bids, sizeof(data.bids));
+        memcpy(data.asks, snapshot.asks, sizeof(data.asks));
+        data.lastTradePrice = snapshot.lastTradePrice;
+        data.lastTradeQuantity = snapshot.lastTradeQuantity;
+        data.lastTradeTime = snapshot.lastTradeTime;
+        data.updateTime = snapshot.updateTime;
+        endWrite(slot->sequence);
+    }
 
-                        if (sellOrder->status == FILLED || sellOrder->status == CANCELLED) {
-                            bestSellIt->second.pop_front();
-                            if (bestSellIt->second.empty()) {
-                                sellBook.erase(bestSellIt);
-                            }
-                        }
+    void run() {
+        unique_lock<mutex> lock(stageMutex);
+        while (true) {
+            staged.wait(lock, [this] { return stopping || marketPending || !pendingBooks.empty(); });
+            unordered_map<string, SymbolSnapshot> books;
+            books.swap(pendingBooks);
+            bool market = marketPending;
+            MarketSnapshot marketCopy = pendingMarket;
+            marketPending = false;
+            if (books.empty() && !market) {
+                return;  // Stopping with nothing left to write
+            }
+            lock.unlock();
 
-                        matchFound = true;
-                    } else {
-                        // Remove cancelled orders
-                        if (buyOrder->status == CANCELLED) {
-                            bestBuyIt->second.pop_front();
-                            if (bestBuyIt->second.empty()) {
-                                buyBook.erase(bestBuyIt);
-                            }
-                        }
+            if (market) {
+                beginWrite(region->market.sequence);
+                region->market.data = marketCopy;
+                endWrite(region->market.sequence);
+            }
+            for (const auto& [symbol, snapshot] : books) {
+                writeBook(symbol, snapshot);
+            }
+            lock.lock();
+        }
+    }
 
-                        if (sellOrder->status == CANCELLED) {
-                            bestSellIt->second.pop_front();
-                            if (bestSellIt->second.empty()) {
-                                sellBook.erase(bestSellIt);
-                            }
-                        }
+public:
+    SnapshotPublisher() : region(nullptr), pendingMarket{}, marketPending(false), stopping(false) {}
 
-                        matchFound = true; // Continue checking after removing cancelled orders
-                    }
-                }
+    ~SnapshotPublisher() {
+        if (writer.joinable()) {
+            {
+                lock_guard<mutex> lock(stageMutex);
+                stopping = true;
             }
-        } while (matchFound);
+            staged.notify_one();
+            writer.join();
+        }
+        if (region) {
+            munmap(region, sizeof(SnapshotRegion));
+        }
     }
 
-    bool cancelOrder(int orderId) {
-        // Find the order first
-        auto it = orderMap.find(orderId);
-        if (it == orderMap.end()) {
-            cout << "Order not found: " << orderId << endl;
+    bool open(const string& name) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+            cerr << "Failed to open shared memory " << name << ": " << strerror(errno) << endl;
             return false;
         }
-
-        auto order = it->second;
-
-        // Lock the specific symbol
-        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
-
-        if (order->status == FILLED) {
-            cout << "Cannot cancel filled order: " << orderId << endl;
+        if (ftruncate(fd, sizeof(SnapshotRegion)) != 0) {
+            cerr << "Failed to size shared memory " << name << ": " << strerror(errno) << endl;
+            close(fd);
             return false;
         }
 
-        // Mark as cancelled
-        order->status = CANCELLED;
+        void* mapped = mmap(nullptr, sizeof(SnapshotRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            cerr << "Failed to map shared memory " << name << ": " << strerror(errno) << endl;
+            return false;
+        }
 
-        cout << "Order cancelled: " << orderId << endl;
+        // Start every session from an empty region
+        memset(mapped, 0, sizeof(SnapshotRegion));
+        region = static_cast<SnapshotRegion*>(mapped);
+        region->version = SNAPSHOT_VERSION;
+        region->magic = SNAPSHOT_MAGIC;
+        writer = thread(&SnapshotPublisher::run, this);
         return true;
     }
 
-    void printOrderBook(const string& symbol) {
-        // Read-only lock for the symbol
-        shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
-
-        cout << "\nOrder Book for " << symbol << ":" << endl;
-        cout << "-------------------" << endl;
+    bool isOpen() const { return region != nullptr; }
 
-        cout << "Buy Orders (highest first):" << endl;
-        if (buyOrders.find(symbol) != buyOrders.end()) {
-            for (const auto& priceLevelPair : buyOrders[symbol]) {
-                double price = priceLevelPair.first;
-                const auto& orders = priceLevelPair.second;
-
-                for (const auto& order : orders) {
-                    if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
-                        cout << "Price: $" << fixed << setprecision(2) << price
-                             << ", Qty: " << order->getRemainingQuantity()
-                             << ", ID: " << order->id
-                             << ", Type: " << order->getVariantString()
-                             << ", Status: " << order->getStatusString()
-                             << ", Time: " << order->getTimestamp() << endl;
-                    }
-                }
-            }
+    // Called by the matcher with the symbol lock held: only copies into the staging area.
+    // Symbols too long for the fixed-size slot name are refused rather than truncated.
+    void publishBook(const string& symbol, const vector<DepthLevel>& bids, const vector<DepthLevel>& asks,
+                     const Trade* lastTrade, int64_t now) {
+        if (!region) {
+            return;
         }
 
-        cout << "\nSell Orders (lowest first):" << endl;
-        if (sellOrders.find(symbol) != sellOrders.end()) {
-            for (const auto& priceLevelPair : sellOrders[symbol]) {
-                double price = priceLevelPair.first;
-                const auto& orders = priceLevelPair.second;
+        SymbolSnapshot snapshot{};
+        snapshot.bidCount = copyLevels(bids, snapshot.bids);
+        snapshot.askCount = copyLevels(asks, snapshot.asks);
+        if (lastTrade) {
+            snapshot.lastTradePrice = lastTrade->price;
+            snapshot.lastTradeQuantity = lastTrade->quantity;
+            snapshot.lastTradeTime = lastTrade->timestamp;
+        }
+        snapshot.updateTime = now;
 
-                for (const auto& order : orders) {
-                    if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
-                        cout << "Price: $" << fixed << setprecision(2) << price
-                             << ", Qty: " << order->getRemainingQuantity()
-                             << ", ID: " << order->id
-                             << ", Type: " << order->getVariantString()
-                             << ", Status: " << order->getStatusString()
-                             << ", Time: " << order->getTimestamp() << endl;
-                    }
+        {
+            lock_guard<mutex> lock(stageMutex);
+            if (symbol.size() >= sizeof(snapshot.symbol)) {
+                if (rejectedSymbols.insert(symbol).second) {
+                    cerr << "Not publishing snapshots for " << symbol << ": symbol longer than "
+                         << sizeof(snapshot.symbol) - 1 << " characters" << endl;
                 }
+                return;
             }
+            pendingBooks[symbol] = snapshot;
         }
+        staged.notify_one();
     }
 
-    void printTradeHistory(const string& symbol) {
-        cout << "\nTrade History for " << symbol << ":" << endl;
-        cout << "------------------------" << endl;
-
-        for (const auto& trade : tradeHistory) {
-            if (trade->symbol == symbol) {
-                cout << "Time: " << trade->getTimestamp()
-                     << ", Qty: " << trade->quantity
-                     << ", Price: $" << fixed << setprecision(2) << trade->price
-                     << ", Buy ID: " << trade->buyOrderId
-                     << ", Sell ID: " << trade->sellOrderId << endl;
-            }
+    void publishMarket(MarketStatus status, double indexValue) {
+        if (!region) {
+            return;
         }
+        {
+            lock_guard<mutex> lock(stageMutex);
+            pendingMarket.marketStatus = status;
+            pendingMarket.indexValue = indexValue;
+            marketPending = true;
+        }
+        staged.notify_one();
     }
 
 private:
-    // Execute market order (immediately match with best available prices)
-    void executeMarketOrder(shared_ptr<Order>& order) {
-    unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
-
-    // Determine which side of the book to match against
-    if (order->type == BUY) {
-        auto& sellBook = sellOrders[order->symbol];
-        int remainingQty = order->quantity;
-
-        // Go through sell orders from lowest to highest price
-        while (remainingQty > 0 && !sellBook.empty()) {
-            // Use a copy of the iterator, not a reference
-            auto bestPriceIt = sellBook.begin();
-            double matchPrice = bestPriceIt->first;
-            auto& ordersAtPrice = bestPriceIt->second;
-
-            while (remainingQty > 0 && !ordersAtPrice.empty()) {
-                auto& sellOrder = ordersAtPrice.front();
-
-                // Skip cancelled orders
-                if (sellOrder->status == CANCELLED) {
-                    ordersAtPrice.pop_front();
-                    continue;
-                }
-
-                // Determine match quantity
-                int matchQty = min(remainingQty, sellOrder->getRemainingQuantity());
-
-                // Execute the trade
-                auto trade = make_shared<Trade>(order->id, sellOrder->id, order->symbol, matchPrice, matchQty);
-                tradeHistory.push_back(trade);
-
-                // Update quantities
-                remainingQty -= matchQty;
-                order->filled_quantity += matchQty;
-                sellOrder->filled_quantity += matchQty;
+    static uint32_t copyLevels(const vector<DepthLevel>& depth, SnapshotLevel* levels) {
+        uint32_t count = min<uint32_t>(depth.size(), SNAPSHOT_DEPTH);
+        for (uint32_t i = 0; i < count; ++i) {
+            levels[i].price = depth[i].price;
+            levels[i].quantity = depth[i].quantity;
+        }
+        return count;
+    }
+};
 
-                // Update order status
-                updateOrderStatus(sellOrder);
+// Reader side: map the region read-only and print each symbol's snapshot as a JSON line
+int readSnapshot(const string& name, const string& symbolFilter) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        cerr << "Failed to open shared memory " << name << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    void* mapped = mmap(nullptr, sizeof(SnapshotRegion), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        cerr << "Failed to map shared memory " << name << ": " << strerror(errno) << endl;
+        return 1;
+    }
 
-                cout << "\nTrade Executed: " << matchQty << " " << order->symbol
-                     << " at $" << fixed << setprecision(2) << matchPrice
-                     << " (Buy: " << order->id << " [MARKET], Sell: " << sellOrder->id << ")" << endl;
+    const SnapshotRegion* region = static_cast<const SnapshotRegion*>(mapped);
+    if (region->magic != SNAPSHOT_MAGIC || region->version != SNAPSHOT_VERSION) {
+        cerr << "Shared memory " << name << " does not hold a book snapshot" << endl;
+        munmap(mapped, sizeof(SnapshotRegion));
+        return 1;
+    }
 
-                // Remove filled sell orders
-                if (sellOrder->status == FILLED) {
-                    ordersAtPrice.pop_front();
-                } else {
-                    break; // Partially filled but no more quantity available for this market order
-                }
-            }
+    MarketSnapshot market;
+    if (!readSeqlocked(region->market, market)) {
+        cerr << "Shared memory " << name << " is stuck mid-update; the writer may have died" << endl;
+        munmap(mapped, sizeof(SnapshotRegion));
+        return 1;
+    }
 
-            // Clean up empty price levels
-            if (ordersAtPrice.empty()) {
-                sellBook.erase(bestPriceIt);
-            }
+    BufferWriter w;
+    w.put("{\"type\":\"market\",\"market_status\":");
+    w.putString(getMarketStatusString(static_cast<MarketStatus>(market.marketStatus)));
+    w.put(",\"index_value\":");
+    w.putNumber(market.indexValue);
+    w.put("}\n");
+
+    uint32_t count = region->symbolCount.load(memory_order_acquire);
+    for (uint32_t i = 0; i < count; ++i) {
+        SymbolSnapshot copy;
+        if (!readSeqlocked(region->symbols[i], copy)) {
+            cerr << "Skipping snapshot slot " << i << ": stuck mid-update" << endl;
+            continue;
+        }
+        if (!symbolFilter.empty() && symbolFilter != copy.symbol) {
+            continue;
         }
 
-        // Update market order status
-        updateOrderStatus(order);
-
-        // If market order couldn't be completely filled
-        if (order->status != FILLED) {
-            cout << "Market Buy Order " << order->id << " partially filled: "
-                 << order->filled_quantity << " of " << order->quantity
-                 << " shares. Remaining quantity cancelled." << endl;
-
-            // Market orders can't rest in the book
-            order->status = PARTIALLY_FILLED;
+        w.put("{\"type\":\"snapshot\",\"symbol\":");
+        w.putString(copy.symbol);
+        w.put(",\"bids\":[");
+        for (uint32_t j = 0; j < copy.bidCount; ++j) {
+            if (j > 0) w.put(',');
+            w.put("{\"price\":");
+            w.putNumber(copy.bids[j].price);
+            w.put(",\"quantity\":");
+            w.putNumber(copy.bids[j].quantity);
+            w.put('}');
         }
-    } else { // SELL market order
-        auto& buyBook = buyOrders[order->symbol];
-        int remainingQty = order->quantity;
+        w.put("],\"asks\":[");
+        for (uint32_t j = 0; j < copy.askCount; ++j) {
+            if (j > 0) w.put(',');
+            w.put("{\"price\":");
+            w.putNumber(copy.asks[j].price);
+            w.put(",\"quantity\":");
+            w.putNumber(copy.asks[j].quantity);
+            w.put('}');
+        }
+        w.put("],\"last_price\":");
+        w.putNumber(copy.lastTradePrice);
+        w.put(",\"last_quantity\":");
+        w.putNumber(copy.lastTradeQuantity);
+        w.put(",\"update_time\":");
+        w.putNumber(copy.updateTime);
+        w.put("}\n");
+    }
 
-        // Go through buy orders from highest to lowest price
-        while (remainingQty > 0 && !buyBook.empty()) {
-            auto bestPriceIt = buyBook.begin();
-            double matchPrice = bestPriceIt->first;
-            auto& ordersAtPrice = bestPriceIt->second;
+    cout.write(w.data(), w.size());
+    munmap(mapped, sizeof(SnapshotRegion));
+    return 0;
+}
 
-            while (remainingQty > 0 && !ordersAtPrice.empty()) {
-                auto& buyOrder = ordersAtPrice.front();
+// Best displayed bid and ask of an outright book, tracked for spread legs
+struct TopOfBook {
+    bool hasBid = false;
+    bool hasAsk = false;
+    double bid = 0;
+    double ask = 0;
+    int bidQty = 0;
+    int askQty = 0;
+};
 
-                // Skip cancelled orders
-                if (buyOrder->status == CANCELLED) {
-                    ordersAtPrice.pop_front();
-                    continue;
-                }
+// One leg of a spread: buying one spread unit trades `ratio` lots of `symbol` on `side`
+struct SpreadLeg {
+    string symbol;
+    OrderType side;
+    int ratio;
+    // This leg's current terms in the implied sums, in price micros
+    bool hasBidTerm = false;
+    bool hasAskTerm = false;
+    int64_t bidTerm = 0;
+    int64_t askTerm = 0;
+};
 
-                // Determine match quantity
-                int matchQty = min(remainingQty, buyOrder->getRemainingQuantity());
+// Implied-in prices of a spread, kept as running sums over its legs so that a change at
+// one leg's top of book is patched in O(1) instead of re-adding every leg:
+//   implied ask = sum(BUY legs: ratio * ask) - sum(SELL legs: ratio * bid)
+//   implied bid = sum(BUY legs: ratio * bid) - sum(SELL legs: ratio * ask)
+// Sums are in integer price micros so repeated patching doesn't drift.
+struct SpreadInstrument {
+    string name;
+    vector<SpreadLeg> legs;
+    int64_t impliedBidSum = 0;
+    int64_t impliedAskSum = 0;
+    int missingBidTerms = 0;  // Legs whose needed side is empty; implied price invalid if > 0
+    int missingAskTerms = 0;
+
+    bool hasImpliedBid() const { return missingBidTerms == 0; }
+    bool hasImpliedAsk() const { return missingAskTerms == 0; }
+};
 
-                // Execute the trade
-                auto trade = make_shared<Trade>(buyOrder->id, order->id, order->symbol, matchPrice, matchQty);
-                tradeHistory.push_back(trade);
+inline int64_t toPriceMicros(double price) {
+    return llround(price * 1000000.0);
+}
 
-                // Update quantities
-                remainingQty -= matchQty;
-                order->filled_quantity += matchQty;
-                buyOrder->filled_quantity += matchQty;
+inline double fromPriceMicros(int64_t micros) {
+    return micros / 1000000.0;
+}
 
-                // Update order status
-                updateOrderStatus(buyOrder);
+// Level-scanning kernels over a flat array of per-tick quantities, best price first.
+// Each has a scalar version and an AVX2 version picked once at startup.
+size_t firstNonEmptyLevelScalar(const int64_t* levels, size_t from, size_t to) {
+    while (from < to && levels[from] == 0) ++from;
+    return from;
+}
 
-                cout << "\nTrade Executed: " << matchQty << " " << order->symbol
-                     << " at $" << fixed << setprecision(2) << matchPrice
-                     << " (Buy: " << buyOrder->id << ", Sell: " << order->id << " [MARKET])" << endl;
+// Sums levels until the running total reaches target; only the comparison with target is
+// meaningful once it has been reached
+int64_t cumulativeQuantityScalar(const int64_t* levels, size_t from, size_t to, int64_t target) {
+    int64_t total = 0;
+    for (size_t i = from; i < to && total < target; ++i) total += levels[i];
+    return total;
+}
 
-                // Remove filled buy orders
-                if (buyOrder->status == FILLED) {
-                    ordersAtPrice.pop_front();
-                } else {
-                    break; // Partially filled but no more quantity available for this market order
-                }
-            }
+size_t countLevelsInBandScalar(const int64_t* levels, size_t from, size_t to) {
+    size_t count = 0;
+    for (size_t i = from; i < to; ++i) count += levels[i] != 0;
+    return count;
+}
 
-            // Clean up empty price levels
-            if (ordersAtPrice.empty()) {
-                buyBook.erase(bestPriceIt);
-            }
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+size_t firstNonEmptyLevelAvx2(const int64_t* levels, size_t from, size_t to) {
+    const __m256i zero = _mm256_setzero_si256();
+    for (; from + 4 <= to; from += 4) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(levels + from));
+        int empty = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(chunk, zero)));
+        if (empty != 0xF) {
+            return from + __builtin_ctz(~empty);
         }
+    }
+    return firstNonEmptyLevelScalar(levels, from, to);
+}
 
-        // Update market order status
-        updateOrderStatus(order);
-
-        // If market order couldn't be completely filled
-        if (order->status != FILLED) {
-            cout << "Market Sell Order " << order->id << " partially filled: "
-                 << order->filled_quantity << " of " << order->quantity
-                 << " shares. Remaining quantity cancelled." << endl;
+__attribute__((target("avx2")))
+int64_t cumulativeQuantityAvx2(const int64_t* levels, size_t from, size_t to, int64_t target) {
+    int64_t total = 0;
+    // Check the target every 16 levels rather than every level
+    while (from + 16 <= to && total < target) {
+        __m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(levels + from));
+        sum = _mm256_add_epi64(sum, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(levels + from + 4)));
+        sum = _mm256_add_epi64(sum, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(levels + from + 8)));
+        sum = _mm256_add_epi64(sum, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(levels + from + 12)));
+        alignas(32) int64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sum);
+        total += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        from += 16;
+    }
+    if (total >= target) {
+        return total;
+    }
+    return total + cumulativeQuantityScalar(levels, from, to, target - total);
+}
 
-            // Market orders can't rest in the book
-            order->status = PARTIALLY_FILLED;
-        }
+__attribute__((target("avx2")))
+size_t countLevelsInBandAvx2(const int64_t* levels, size_t from, size_t to) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    for (; from + 4 <= to; from += 4) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(levels + from));
+        int empty = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(chunk, zero)));
+        count += 4 - __builtin_popcount(empty);
     }
+    return count + countLevelsInBandScalar(levels, from, to);
 }
+#endif
 
-   // Execute IOC (Immediate or Cancel) order - continuation
-    void executeIOCOrder(shared_ptr<Order>& order) {
-        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
+struct LevelKernels {
+    size_t (*firstNonEmpty)(const int64_t*, size_t, size_t);
+    int64_t (*cumulative)(const int64_t*, size_t, size_t, int64_t);
+    size_t (*countInBand)(const int64_t*, size_t, size_t);
 
-        // Try to match as much as possible immediately
-        if (order->type == BUY) {
-            auto& sellBook = sellOrders[order->symbol];
-            int remainingQty = order->quantity;
+    static const LevelKernels& get() {
+        static const LevelKernels kernels = select();
+        return kernels;
+    }
 
-            // Go through sell orders with price <= order price
-            for (auto sellIt = sellBook.begin();
-                 sellIt != sellBook.end() && remainingQty > 0 && sellIt->first <= order->price;
-                 /* increment in loop */) {
+private:
+    static LevelKernels select() {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) {
+            return { firstNonEmptyLevelAvx2, cumulativeQuantityAvx2, countLevelsInBandAvx2 };
+        }
+#endif
+        return { firstNonEmptyLevelScalar, cumulativeQuantityScalar, countLevelsInBandScalar };
+    }
+};
 
-                double matchPrice = sellIt->first;
-                auto& ordersAtPrice = sellIt->second;
+// Remaining quantity (hidden iceberg reserve included) of live resting orders per price
+// tick for one side of a book. Index 0 is the most aggressive tick seen so far and
+// indices move away from the touch, so the kernels scan best-first for either side.
+// A price off the tick grid, or a range too wide to keep flat, retires the ladder for
+// that side and callers fall back to walking the book.
+const double LADDER_TICK = 0.01;
+const double PRICE_EPSILON = 1e-6;  // Tolerance when comparing prices or placing them on a grid
+const size_t LADDER_MAX_LEVELS = 1 << 20;
 
-                for (auto orderIt = ordersAtPrice.begin();
-                     orderIt != ordersAtPrice.end() && remainingQty > 0;
-                     /* increment in loop */) {
+class LevelLadder {
+private:
+    vector<int64_t> levels;
+    int64_t originTick = 0;  // Tick at index 0
+    int direction;           // +1 for asks (prices rise with index), -1 for bids
+    bool usable = true;
 
-                    auto& sellOrder = *orderIt;
+public:
+    explicit LevelLadder(OrderType side = SELL) : direction(side == BUY ? -1 : 1) {}
 
-                    // Skip cancelled orders
-                    if (sellOrder->status == CANCELLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                        continue;
-                    }
+    bool isUsable() const { return usable; }
 
-                    // Determine match quantity
-                    int matchQty = min(remainingQty, sellOrder->getRemainingQuantity());
+    void add(double price, int64_t delta) {
+        if (!usable) {
+            return;
+        }
+        double scaled = price / LADDER_TICK;
+        int64_t tick = llround(scaled);
+        if (fabs(scaled - tick) > PRICE_EPSILON) {
+            retire();
+            return;
+        }
 
-                    // Execute the trade
-                    auto trade = make_shared<Trade>(order->id, sellOrder->id, order->symbol, matchPrice, matchQty);
-                    tradeHistory.push_back(trade);
+        if (levels.empty()) {
+            originTick = tick;
+        }
+        int64_t index = (tick - originTick) * direction;
+        if (index < 0) {
+            // Better than anything seen: grow towards the touch with some slack
+            size_t shift = -index + levels.size() / 2;
+            if (levels.size() + shift > LADDER_MAX_LEVELS) {
+                retire();
+                return;
+            }
+            levels.insert(levels.begin(), shift, 0);
+            originTick -= static_cast<int64_t>(shift) * direction;
+            index = (tick - originTick) * direction;
+        } else if (static_cast<size_t>(index) >= levels.size()) {
+            if (static_cast<size_t>(index) >= LADDER_MAX_LEVELS) {
+                retire();
+                return;
+            }
+            levels.resize(index + 1, 0);
+        }
+        levels[index] += delta;
+    }
 
-                    // Update quantities
-                    remainingQty -= matchQty;
-                    order->filled_quantity += matchQty;
-                    sellOrder->filled_quantity += matchQty;
+    // Index range [0, end) of ticks at or better than limit
+    size_t endIndexFor(double limit) const {
+        double scaled = limit / LADDER_TICK;
+        int64_t tick = direction > 0 ? static_cast<int64_t>(floor(scaled + PRICE_EPSILON))
+                                     : static_cast<int64_t>(ceil(scaled - PRICE_EPSILON));
+        int64_t end = (tick - originTick) * direction + 1;
+        return static_cast<size_t>(max<int64_t>(0, min<int64_t>(end, levels.size())));
+    }
 
-                    // Update order status
-                    updateOrderStatus(sellOrder);
+    size_t size() const { return levels.size(); }
+    const int64_t* data() const { return levels.data(); }
+    double priceAt(size_t index) const { return (originTick + static_cast<int64_t>(index) * direction) * LADDER_TICK; }
 
-                    cout << "\nTrade Executed: " << matchQty << " " << order->symbol
-                         << " at $" << fixed << setprecision(2) << matchPrice
-                         << " (Buy: " << order->id << " [IOC], Sell: " << sellOrder->id << ")" << endl;
+private:
+    void retire() {
+        usable = false;
+        vector<int64_t>().swap(levels);
+    }
+};
 
-                    // Remove filled sell orders
-                    if (sellOrder->status == FILLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                    } else {
-                        ++orderIt;
-                    }
-                }
+// How a thread waits on an empty (or full) input queue: burn the core for the lowest
+// wake-up latency, or spin briefly and then sleep on a futex
+enum WaitStrategy { BUSY_SPIN, SPIN_THEN_FUTEX };
 
-                // Clean up empty price levels
-                if (ordersAtPrice.empty()) {
-                    sellIt = sellBook.erase(sellIt);
-                } else {
-                    ++sellIt;
-                }
-            }
+const int WAIT_SPIN_LIMIT = 2000;
 
-            // Update IOC order status
-            updateOrderStatus(order);
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    this_thread::yield();
+#endif
+}
 
-            // If IOC order couldn't be completely filled, cancel the remainder
-            if (order->status != FILLED) {
-                cout << "IOC Buy Order " << order->id << " partially filled: "
-                     << order->filled_quantity << " of " << order->quantity
-                     << " shares. Remaining quantity cancelled." << endl;
+// One side of a queue handshake. Waiters register before sleeping so notify() only pays
+// for the futex syscall when somebody is actually asleep.
+class WaitPoint {
+private:
+    atomic<uint32_t> epoch{0};
+    atomic<uint32_t> sleepers{0};
 
-                // IOC orders that aren't fully filled are cancelled
-                if (order->status == PARTIALLY_FILLED) {
-                    order->status = CANCELLED;
-                }
+public:
+    template <typename Ready>
+    void waitUntil(Ready ready, WaitStrategy strategy) {
+        for (int spins = 0; !ready(); ++spins) {
+            if (strategy == BUSY_SPIN || spins < WAIT_SPIN_LIMIT) {
+                cpuRelax();
+                continue;
             }
-        } else { // SELL IOC order
-            auto& buyBook = buyOrders[order->symbol];
-            int remainingQty = order->quantity;
-
-            // Go through buy orders with price >= order price
-            for (auto buyIt = buyBook.begin();
-                 buyIt != buyBook.end() && remainingQty > 0 && buyIt->first >= order->price;
-                 /* increment in loop */) {
-
-                double matchPrice = buyIt->first;
-                auto& ordersAtPrice = buyIt->second;
-
-                for (auto orderIt = ordersAtPrice.begin();
-                     orderIt != ordersAtPrice.end() && remainingQty > 0;
-                     /* increment in loop */) {
+            uint32_t seen = epoch.load();
+            sleepers.fetch_add(1);
+            if (!ready()) {
+                syscall(SYS_futex, &epoch, FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+            }
+            sleepers.fetch_sub(1);
+        }
+    }
 
-                    auto& buyOrder = *orderIt;
+    void notify() {
+        epoch.fetch_add(1);
+        if (sleepers.load() > 0) {
+            syscall(SYS_futex, &epoch, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+        }
+    }
+};
 
-                    // Skip cancelled orders
-                    if (buyOrder->status == CANCELLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                        continue;
-                    }
+// Bounded single-producer/single-consumer ring between the IO thread and the matching
+// thread. The producer blocks (per the wait strategy) when the ring is full.
+template <typename T>
+class SpscQueue {
+private:
+    vector<T> slots;
+    size_t mask;
+    WaitStrategy strategy;
+    alignas(64) atomic<size_t> head{0};  // next slot to pop, written by the consumer
+    alignas(64) atomic<size_t> tail{0};  // next slot to push, written by the producer
+    WaitPoint notEmpty;
+    WaitPoint notFull;
 
-                    // Determine match quantity
-                    int matchQty = min(remainingQty, buyOrder->getRemainingQuantity());
+public:
+    SpscQueue(size_t capacity, WaitStrategy waitStrategy) : strategy(waitStrategy) {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
 
-                    // Execute the trade
-                    auto trade = make_shared<Trade>(buyOrder->id, order->id, order->symbol, matchPrice, matchQty);
-                    tradeHistory.push_back(trade);
+    void push(T value) {
+        size_t t = tail.load(memory_order_relaxed);
+        notFull.waitUntil([&]() { return t - head.load() < slots.size(); }, strategy);
+        slots[t & mask] = move(value);
+        tail.store(t + 1);
+        notEmpty.notify();
+    }
 
-                    // Update quantities
-                    remainingQty -= matchQty;
-                    order->filled_quantity += matchQty;
-                    buyOrder->filled_quantity += matchQty;
+    // Consumer side only
+    bool empty() const {
+        return tail.load() == head.load(memory_order_relaxed);
+    }
 
-                    // Update order status
-                    updateOrderStatus(buyOrder);
+    T pop() {
+        size_t h = head.load(memory_order_relaxed);
+        notEmpty.waitUntil([&]() { return tail.load() != h; }, strategy);
+        T value = move(slots[h & mask]);
+        head.store(h + 1);
+        notFull.notify();
+        return value;
+    }
+};
 
-                    cout << "\nTrade Executed: " << matchQty << " " << order->symbol
-                         << " at $" << fixed << setprecision(2) << matchPrice
-                         << " (Buy: " << buyOrder->id << ", Sell: " << order->id << " [IOC])" << endl;
+// Bounded multi-producer/single-consumer ring with a sequence number per slot. A producer
+// claims a slot with one CAS on the tail and publishes it by advancing the slot's sequence,
+// so producers on different symbols never share a lock. A full ring makes the producer
+// wait (per the wait strategy) rather than lose an entry.
+template <typename T>
+class MpscQueue {
+private:
+    struct Slot {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Slot[]> slots;
+    size_t capacity;
+    size_t mask;
+    WaitStrategy strategy;
+    alignas(64) atomic<size_t> tail{0};  // next slot to claim, shared by the producers
+    alignas(64) size_t head = 0;         // next slot to pop, consumer only
+    WaitPoint notEmpty;
+    WaitPoint notFull;
+
+    bool headReady() const {
+        return slots[head & mask].sequence.load(memory_order_acquire) == head + 1;
+    }
 
-                    // Remove filled buy orders
-                    if (buyOrder->status == FILLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                    } else {
-                        ++orderIt;
-                    }
-                }
+public:
+    MpscQueue(size_t requested, WaitStrategy waitStrategy) : capacity(1), strategy(waitStrategy) {
+        while (capacity < requested) capacity <<= 1;
+        slots.reset(new Slot[capacity]);
+        mask = capacity - 1;
+        for (size_t i = 0; i < capacity; ++i) {
+            slots[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
 
-                // Clean up empty price levels
-                if (ordersAtPrice.empty()) {
-                    buyIt = buyBook.erase(buyIt);
-                } else {
-                    ++buyIt;
-                }
+    void push(T value) {
+        size_t position = tail.load(memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[position & mask];
+            size_t sequence = slot->sequence.load(memory_order_acquire);
+            if (sequence == position) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) break;
+            } else if (sequence < position) {
+                // Full: the consumer has not freed this slot from the previous lap yet
+                notFull.waitUntil([&]() { return slot->sequence.load(memory_order_acquire) >= position; },
+                                  strategy);
+                position = tail.load(memory_order_relaxed);
+            } else {
+                position = tail.load(memory_order_relaxed);
             }
+        }
+        slot->value = move(value);
+        slot->sequence.store(position + 1, memory_order_release);
+        notEmpty.notify();
+    }
 
-            // Update IOC order status
-            updateOrderStatus(order);
+    // Entries claimed by producers so far
+    size_t claimed() const {
+        return tail.load();
+    }
 
-            // If IOC order couldn't be completely filled, cancel the remainder
-            if (order->status != FILLED) {
-                cout << "IOC Sell Order " << order->id << " partially filled: "
-                     << order->filled_quantity << " of " << order->quantity
-                     << " shares. Remaining quantity cancelled." << endl;
+    // Consumer side only
+    void waitForEntry() {
+        notEmpty.waitUntil([&]() { return headReady(); }, strategy);
+    }
 
-                // IOC orders that aren't fully filled are cancelled
-                if (order->status == PARTIALLY_FILLED) {
-                    order->status = CANCELLED;
-                }
-            }
+    bool tryPop(T& value) {
+        if (!headReady()) {
+            return false;
         }
+        Slot& slot = slots[head & mask];
+        value = move(slot.value);
+        slot.sequence.store(head + capacity, memory_order_release);
+        ++head;
+        notFull.notify();
+        return true;
     }
+};
 
-    // Execute FOK (Fill or Kill) order - must be filled completely or cancelled
-    bool executeFOKOrder(shared_ptr<Order>& order) {
-        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
-
-        // First check if the order can be filled completely
-        bool canFillCompletely = false;
-        int availableQty = 0;
+// What a client sees of one order, published by the matching side and read without any
+// book lock. Traded quantity and value come from the order's trades, for the average price.
+struct OrderStatusView {
+    OrderStatus status = ACTIVE;
+    int quantity = 0;
+    int filled = 0;
+    int traded = 0;
+    double tradedValue = 0.0;
+
+    double averagePrice() const {
+        return traded > 0 ? tradedValue / traded : 0.0;
+    }
+};
 
-        if (order->type == BUY) {
-            auto& sellBook = sellOrders[order->symbol];
+// Order status records indexed by order ID in chunks that are allocated once and never
+// move, so a reader finds a record with two loads and no lock. Each record is a seqlock:
+// its one writer (whoever holds the order's symbol lock, or creates the order) makes the
+// sequence odd while it writes, and a reader retries until it sees the same even sequence
+// before and after copying the fields. Fields are relaxed atomics so a torn read is only
+// ever discarded, never undefined.
+class OrderStatusTable {
+private:
+    struct Record {
+        atomic<uint32_t> sequence{0};  // 0 = no order with this ID
+        atomic<uint8_t> status{ACTIVE};
+        atomic<int32_t> quantity{0};
+        atomic<int32_t> filled{0};
+        atomic<int32_t> traded{0};
+        atomic<double> tradedValue{0.0};
+    };
+
+    static const size_t CHUNK_BITS = 16;
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+    static const size_t MAX_CHUNKS = size_t(1) << 15;  // 2^31 IDs
+
+    unique_ptr<atomic<Record*>[]> chunks;
+    mutex growMutex;
+    atomic<int> highestId{0};
+
+    Record* find(int id) const {
+        if (id <= 0 || static_cast<size_t>(id) >= CHUNK_SIZE * MAX_CHUNKS) return nullptr;
+        Record* chunk = chunks[id >> CHUNK_BITS].load(memory_order_acquire);
+        return chunk ? &chunk[id & (CHUNK_SIZE - 1)] : nullptr;
+    }
 
-            // Check available quantity at acceptable prices
-            for (auto sellIt = sellBook.begin();
-                 sellIt != sellBook.end() && sellIt->first <= order->price;
-                 ++sellIt) {
+    Record* findOrCreate(int id) {
+        Record* record = find(id);
+        if (record || id <= 0 || static_cast<size_t>(id) >= CHUNK_SIZE * MAX_CHUNKS) return record;
+        lock_guard<mutex> lock(growMutex);
+        auto& slot = chunks[id >> CHUNK_BITS];
+        Record* chunk = slot.load(memory_order_relaxed);
+        if (!chunk) {
+            chunk = new Record[CHUNK_SIZE];
+            slot.store(chunk, memory_order_release);
+        }
+        return &chunk[id & (CHUNK_SIZE - 1)];
+    }
 
-                for (auto& sellOrder : sellIt->second) {
-                    if (sellOrder->status != CANCELLED) {
-                        availableQty += sellOrder->getRemainingQuantity();
-                    }
-                }
+    template <typename Write>
+    static void write(Record& record, Write&& fields) {
+        uint32_t sequence = record.sequence.load(memory_order_relaxed);
+        record.sequence.store(sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        fields();
+        record.sequence.store(sequence + 2, memory_order_release);
+    }
 
-                if (availableQty >= order->quantity) {
-                    canFillCompletely = true;
-                    break;
-                }
-            }
+public:
+    OrderStatusTable() : chunks(new atomic<Record*>[MAX_CHUNKS]) {
+        for (size_t i = 0; i < MAX_CHUNKS; ++i) chunks[i].store(nullptr, memory_order_relaxed);
+    }
 
-        } else { // SELL FOK order
-            auto& buyBook = buyOrders[order->symbol];
+    ~OrderStatusTable() {
+        for (size_t i = 0; i < MAX_CHUNKS; ++i) delete[] chunks[i].load(memory_order_relaxed);
+    }
 
-            // Check available quantity at acceptable prices
-            for (auto buyIt = buyBook.begin();
-                 buyIt != buyBook.end() && buyIt->first >= order->price;
-                 ++buyIt) {
+    OrderStatusTable(const OrderStatusTable&) = delete;
+    OrderStatusTable& operator=(const OrderStatusTable&) = delete;
+
+    // The order's current status and size; its trades are added separately
+    void publish(int id, OrderStatus status, int quantity, int filled) {
+        Record* record = findOrCreate(id);
+        if (!record) return;
+        write(*record, [&]() {
+            record->status.store(status, memory_order_relaxed);
+            record->quantity.store(quantity, memory_order_relaxed);
+            record->filled.store(filled, memory_order_relaxed);
+        });
+        int highest = highestId.load(memory_order_relaxed);
+        while (highest < id && !highestId.compare_exchange_weak(highest, id, memory_order_relaxed)) {}
+    }
 
-                for (auto& buyOrder : buyIt->second) {
-                    if (buyOrder->status != CANCELLED) {
-                        availableQty += buyOrder->getRemainingQuantity();
-                    }
-                }
+    void addFill(int id, int quantity, double price) {
+        Record* record = find(id);
+        if (!record || record->sequence.load(memory_order_relaxed) == 0) return;
+        write(*record, [&]() {
+            record->traded.store(record->traded.load(memory_order_relaxed) + quantity, memory_order_relaxed);
+            record->tradedValue.store(record->tradedValue.load(memory_order_relaxed) + quantity * price,
+                                      memory_order_relaxed);
+        });
+    }
 
-                if (availableQty >= order->quantity) {
-                    canFillCompletely = true;
-                    break;
-                }
+    // Lock-free read; false if no order with this ID has been published
+    bool read(int id, OrderStatusView& view) const {
+        const Record* record = find(id);
+        if (!record) return false;
+        for (;;) {
+            uint32_t before = record->sequence.load(memory_order_acquire);
+            if (before & 1) continue;
+            view.status = static_cast<OrderStatus>(record->status.load(memory_order_relaxed));
+            view.quantity = record->quantity.load(memory_order_relaxed);
+            view.filled = record->filled.load(memory_order_relaxed);
+            view.traded = record->traded.load(memory_order_relaxed);
+            view.tradedValue = record->tradedValue.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (record->sequence.load(memory_order_relaxed) == before) {
+                return before != 0 && view.quantity > 0;
             }
         }
+    }
 
-        // If can't fill completely, return false
-        if (!canFillCompletely) {
-            return false;
+    // Forget every order, e.g. before a snapshot replaces the engine state. Records are
+    // rewritten rather than freed so concurrent readers never see reused memory.
+    void clear() {
+        int highest = highestId.exchange(0, memory_order_relaxed);
+        for (int id = 1; id <= highest; ++id) {
+            Record* record = find(id);
+            if (!record || record->sequence.load(memory_order_relaxed) == 0) continue;
+            write(*record, [&]() {
+                record->quantity.store(0, memory_order_relaxed);
+                record->filled.store(0, memory_order_relaxed);
+                record->traded.store(0, memory_order_relaxed);
+                record->tradedValue.store(0.0, memory_order_relaxed);
+            });
         }
+    }
+};
 
-        // If we can fill completely, execute the trades
-        if (order->type == BUY) {
-            auto& sellBook = sellOrders[order->symbol];
-            int remainingQty = order->quantity;
-
-            // Go through sell orders from lowest to highest price
-            for (auto sellIt = sellBook.begin();
-                 sellIt != sellBook.end() && remainingQty > 0 && sellIt->first <= order->price;
-                 /* increment in loop */) {
+// Pin the calling thread to one CPU; placement is best effort, so failures only warn
+bool pinCurrentThread(int cpu, const char* role) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rc != 0) {
+        cerr << "Could not pin " << role << " thread to CPU " << cpu << ": " << strerror(rc) << endl;
+        return false;
+    }
+    return true;
+}
+
+// Prefer the NUMA node of the CPU we're running on for this thread's future allocations.
+// Pages are placed on first touch, so whatever the thread builds afterwards stays local.
+void bindMemoryToLocalNode() {
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) != 0 && errno != ENOSYS) {
+        cerr << "Could not set local NUMA memory policy: " << strerror(errno) << endl;
+    }
+}
+
+// Engine stages the profiler attributes counts to, per order variant
+enum ProfileStage { STAGE_PARSE, STAGE_RISK, STAGE_INSERT, STAGE_SWEEP, STAGE_REPORT, STAGE_POST_MATCH,
+                    STAGE_COUNT };
+const char* const PROFILE_STAGE_NAMES[STAGE_COUNT] = { "parse", "risk", "insert", "sweep", "report",
+                                                       "post_match" };
+const int VARIANT_COUNT = ICEBERG + 1;
+
+// Opt-in hardware counter profile of the order path. One perf_event_open group (cycles,
+// instructions, L1D read misses, LLC misses, branch misses; user mode only) counts the
+// thread that enabled it, and each stage reads the group once at its boundaries. Counters
+// the kernel or the machine won't provide are left out; with none at all (no PMU, a strict
+// perf_event_paranoid) the profile still has call counts and wall time per stage.
+// Only the outermost stage is counted: work nested inside it, such as stops triggered
+// from post-match, is charged to the stage that caused it.
+class StageProfiler {
+public:
+    enum Counter { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, COUNTER_COUNT };
+
+    struct Sample {
+        int64_t ns = 0;
+        uint64_t counters[COUNTER_COUNT] = {};
+    };
+
+private:
+    struct Totals {
+        uint64_t calls = 0;
+        uint64_t ns = 0;
+        uint64_t counters[COUNTER_COUNT] = {};
+    };
+
+    int groupFd;
+    vector<int> memberFds;
+    int slots[COUNTER_COUNT];  // Position of each counter in a group read, -1 if missing
+    int opened;
+    string unavailable;  // Why some or all counters are missing
+    uint64_t timeEnabled;
+    uint64_t timeRunning;
+    int depth;
+    Totals totals[VARIANT_COUNT][STAGE_COUNT];
+
+public:
+    StageProfiler() : groupFd(-1), opened(0), timeEnabled(0), timeRunning(0), depth(0) {
+        fill(begin(slots), end(slots), -1);
+        static const pair<uint32_t, uint64_t> events[COUNTER_COUNT] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        };
+
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = events[counter].first;
+            attr.config = events[counter].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // perf_event_open has no glibc wrapper
+            int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+            if (fd < 0) {
+                if (unavailable.empty()) unavailable = strerror(errno);
+                continue;
+            }
+            if (groupFd < 0) {
+                groupFd = fd;
+            } else {
+                memberFds.push_back(fd);
+            }
+            slots[counter] = opened++;
+        }
+    }
+
+    ~StageProfiler() {
+        for (int fd : memberFds) close(fd);
+        if (groupFd >= 0) close(groupFd);
+    }
+
+    StageProfiler(const StageProfiler&) = delete;
+    StageProfiler& operator=(const StageProfiler&) = delete;
+
+    // Stages only count when no other stage is open on this profiler
+    bool enter(Sample& start) {
+        if (depth++ > 0) {
+            return false;
+        }
+        sample(start);
+        return true;
+    }
+
+    // Close a stage; `next` (if given) opens the following one from the same reading
+    void leave(bool counted, OrderVariant variant, ProfileStage stage, const Sample& start,
+               Sample* next = nullptr) {
+        if (!counted) {
+            --depth;
+            return;
+        }
+        Sample end;
+        sample(end);
+        Totals& total = totals[variant][stage];
+        ++total.calls;
+        total.ns += end.ns - start.ns;
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            total.counters[counter] += end.counters[counter] - start.counters[counter];
+        }
+        if (next) {
+            *next = end;
+        } else {
+            --depth;
+        }
+    }
+
+    void print(ostream& os) const {
+        static const char* const variantNames[VARIANT_COUNT] = { "LIMIT", "MARKET", "IOC", "FOK", "STOP",
+                                                                 "STOP_LIMIT", "ICEBERG" };
+        static const char* const counterNames[COUNTER_COUNT] = { "cycles", "instr", "l1d_miss", "llc_miss",
+                                                                 "br_miss" };
+        os << "\nStage Profile (per order, user-mode counters):" << endl;
+        if (opened < COUNTER_COUNT) {
+            os << "(" << (opened == 0 ? "no" : "some") << " hardware counters available: " << unavailable
+               << "; missing ones show n/a)" << endl;
+        }
+        if (timeRunning < timeEnabled) {
+            os << "(counters were multiplexed, running " << fixed << setprecision(0)
+               << 100.0 * timeRunning / timeEnabled << "% of the time)" << endl;
+        }
+
+        os << left << setw(11) << "variant" << setw(11) << "stage" << right << setw(9) << "orders" << setw(10)
+           << "ns";
+        for (const char* name : counterNames) os << setw(10) << name;
+        os << setw(7) << "IPC" << endl;
+
+        os << fixed << setprecision(1);
+        for (int variant = 0; variant < VARIANT_COUNT; ++variant) {
+            // Every profiled order starts with its risk stage
+            uint64_t orders = totals[variant][STAGE_RISK].calls;
+            if (orders == 0) continue;
+            double perOrder = 1.0 / orders;
+            for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+                const Totals& total = totals[variant][stage];
+                if (total.calls == 0) continue;
+                os << left << setw(11) << variantNames[variant] << setw(11) << PROFILE_STAGE_NAMES[stage] << right
+                   << setw(9) << orders << setw(10) << total.ns * perOrder;
+                for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+                    if (slots[counter] < 0) os << setw(10) << "n/a";
+                    else os << setw(10) << total.counters[counter] * perOrder;
+                }
+                if (slots[CYCLES] >= 0 && slots[INSTRUCTIONS] >= 0 && total.counters[CYCLES] > 0) {
+                    os << setw(7) << setprecision(2)
+                       << static_cast<double>(total.counters[INSTRUCTIONS]) / total.counters[CYCLES]
+                       << setprecision(1);
+                } else {
+                    os << setw(7) << "n/a";
+                }
+                os << endl;
+            }
+        }
+        os << left;
+    }
+
+private:
+    void sample(Sample& reading) {
+        reading.ns = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+        if (groupFd < 0) {
+            return;
+        }
+        // { nr, time_enabled, time_running, value[nr] }
+        uint64_t buffer[3 + COUNTER_COUNT];
+        if (read(groupFd, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(uint64_t))) {
+            return;
+        }
+        timeEnabled = buffer[1];
+        timeRunning = buffer[2];
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            if (slots[counter] >= 0) reading.counters[counter] = buffer[3 + slots[counter]];
+        }
+    }
+};
+
+// Times one order's way through the stages: next() closes the current stage and opens the
+// following one, and the last closes with the scope. Free when profiling is off.
+class StageScope {
+private:
+    StageProfiler* profiler;
+    OrderVariant variant;
+    ProfileStage stage;
+    bool counted;
+    StageProfiler::Sample start;
+
+public:
+    StageScope(StageProfiler* stageProfiler, OrderVariant orderVariant, ProfileStage firstStage)
+        : profiler(stageProfiler), variant(orderVariant), stage(firstStage), counted(false) {
+        if (profiler) counted = profiler->enter(start);
+    }
+
+    ~StageScope() {
+        finish();
+    }
+
+    void next(ProfileStage nextStage) {
+        if (profiler && counted) {
+            profiler->leave(true, variant, stage, start, &start);
+        }
+        stage = nextStage;
+    }
+
+    void setVariant(OrderVariant orderVariant) {
+        variant = orderVariant;
+    }
+
+    // Close early; keep = false drops the stage, e.g. for a line that failed to parse
+    void finish(bool keep = true) {
+        if (profiler) {
+            profiler->leave(counted && keep, variant, stage, start);
+            profiler = nullptr;
+        }
+    }
+};
+
+// A parsed place_order command, as queued for batched placement
+struct OrderRequest {
+    OrderType type = BUY;
+    OrderVariant variant = LIMIT;
+    double price = 0.0;
+    int quantity = 0;
+    string symbol;
+    double stopPrice = 0.0;
+    int peakSize = 0;
+    string account;
+    int64_t timestamp = 0;  // Event time to stamp on the order; 0 stamps it when placed
+};
+
+// Selects the orders a mass cancel pulls; empty or default fields match everything
+struct MassCancelFilter {
+    string symbol;
+    bool anySide = true;
+    OrderType side = BUY;
+    string account;
+    double minPrice = 0.0;
+    double maxPrice = numeric_limits<double>::max();
+
+    bool matchesOrder(const Order& order) const {
+        return (anySide || order.type == side) && (account.empty() || order.account == account);
+    }
+
+    bool coversAllPrices() const {
+        return minPrice <= 0.0 && maxPrice == numeric_limits<double>::max();
+    }
+};
+
+// One symbol's entry in a mass quote; a zero quantity pulls that side
+struct QuoteRequest {
+    string symbol;
+    double bidPrice = 0.0;
+    int bidQuantity = 0;
+    double askPrice = 0.0;
+    int askQuantity = 0;
+};
+
+// A market maker's standing quote in one symbol: the order behind each side, if any
+struct QuoteSlot {
+    shared_ptr<Order> bid;
+    shared_ptr<Order> ask;
+};
+
+enum LinkType : uint8_t { LINK_OCO = 1, LINK_BRACKET = 2 };
+
+// Orders tied together in one symbol: the legs of a one-cancels-other group, or the exits
+// of a bracket, held until the entry order is done and then worked as an OCO group. All
+// of them sit under the same symbol lock, so a fill adjusts the rest in the same hold.
+struct LinkGroup {
+    LinkType type = LINK_OCO;
+    shared_ptr<Order> entry;            // Bracket entry until its exits are released
+    vector<shared_ptr<Order>> members;  // OCO legs or bracket exits
+    bool working = false;               // Members are in the book or the stop index
+};
+
+enum AllocationPolicy : uint8_t { ALLOC_FIFO, ALLOC_PRO_RATA, ALLOC_LMM };
+const char* const ALLOCATION_POLICY_NAMES[] = { "FIFO", "PRO_RATA", "LMM" };
+
+// How one instrument shares an incoming quantity among the orders of a price level; for
+// LMM, the lead market maker's account and its guaranteed percentage of each allocation
+struct AllocationRule {
+    AllocationPolicy policy = ALLOC_FIFO;
+    string lmmAccount;
+    int lmmPercent = 0;
+};
+
+// What an order at a level can trade right now
+inline int liveDisplayed(const shared_ptr<Order>& order) {
+    bool live = order->status == ACTIVE || order->status == PARTIALLY_FILLED;
+    return live ? order->getDisplayedQuantity() : 0;
+}
+
+// Allocation policies are template parameters of the sweep kernels, so a FIFO instrument
+// runs the plain front-of-queue loop with no per-fill dispatch. A level-at-once policy
+// fills in fills[i] for each order of a level in one pass, given an incoming quantity of at
+// most the level's displayed total.
+struct FifoAllocation {
+    static const bool LEVEL_AT_ONCE = false;
+};
+
+struct ProRataAllocation {
+    static const bool LEVEL_AT_ONCE = true;
+
+    // In proportion to displayed size, rounded down; each order loses less than one lot to
+    // rounding, so one more pass in time priority places the lots left over
+    static void allocate(const deque<shared_ptr<Order>>& level, int quantity, int levelDisplayed,
+                         const AllocationRule&, vector<int>& fills) {
+        int allocated = 0;
+        for (size_t i = 0; i < level.size(); ++i) {
+            fills[i] = static_cast<int>(static_cast<long long>(liveDisplayed(level[i])) * quantity / levelDisplayed);
+            allocated += fills[i];
+        }
+        for (size_t i = 0; i < level.size() && allocated < quantity; ++i) {
+            if (fills[i] < liveDisplayed(level[i])) {
+                ++fills[i];
+                ++allocated;
+            }
+        }
+    }
+};
+
+struct LmmAllocation {
+    static const bool LEVEL_AT_ONCE = true;
+
+    // The lead market maker's orders take up to its percentage first, in time priority among
+    // themselves; the rest goes FIFO across the whole level
+    static void allocate(const deque<shared_ptr<Order>>& level, int quantity, int,
+                         const AllocationRule& rule, vector<int>& fills) {
+        int lmmShare = static_cast<int>(static_cast<long long>(quantity) * rule.lmmPercent / 100);
+        int remaining = quantity;
+        for (size_t i = 0; i < level.size(); ++i) {
+            fills[i] = 0;
+            if (lmmShare > 0 && level[i]->account == rule.lmmAccount) {
+                fills[i] = min(lmmShare, liveDisplayed(level[i]));
+                lmmShare -= fills[i];
+                remaining -= fills[i];
+            }
+        }
+        for (size_t i = 0; i < level.size() && remaining > 0; ++i) {
+            int take = min(remaining, liveDisplayed(level[i]) - fills[i]);
+            fills[i] += take;
+            remaining -= take;
+        }
+    }
+};
+
+// Link groups of one symbol by group ID (the bracket entry's or the first leg's ID), and
+// the brackets whose exits are due to start working. Guarded by the symbol lock.
+struct SymbolLinks {
+    unordered_map<int, LinkGroup> groups;
+    vector<int> releases;
+};
+
+// Fill totals for one symbol
+struct TradeStats {
+    size_t trades = 0;
+    long long volume = 0;
+    double notional = 0.0;
+
+    void add(const TradeStats& other) {
+        trades += other.trades;
+        volume += other.volume;
+        notional += other.notional;
+    }
+
+    double vwap() const {
+        return volume > 0 ? notional / volume : 0.0;
+    }
+};
+
+// One account's position in one symbol, as kept by the post-trade stage
+struct Position {
+    long long net = 0;           // Open quantity, long positive
+    double averagePrice = 0.0;   // Of the open quantity
+    double realizedPnl = 0.0;
+    long long bought = 0;
+    long long sold = 0;
+    double netCash = 0.0;        // Session settlement cash: sales minus purchases
+
+    // Apply a fill of signed quantity (buys positive). Fills against the open side close it
+    // at the average price, and any excess opens the other side at the fill price.
+    void apply(long long quantity, double price) {
+        (quantity > 0 ? bought : sold) += llabs(quantity);
+        netCash -= quantity * price;
+        if (net == 0 || (net > 0) == (quantity > 0)) {
+            averagePrice = (averagePrice * llabs(net) + price * llabs(quantity)) / (llabs(net) + llabs(quantity));
+            net += quantity;
+            return;
+        }
+        long long closing = min(llabs(net), llabs(quantity));
+        realizedPnl += (price - averagePrice) * closing * (net > 0 ? 1 : -1);
+        net += quantity;
+        if (net == 0) {
+            averagePrice = 0.0;
+        } else if ((net > 0) == (quantity > 0)) {
+            averagePrice = price;
+        }
+    }
+};
+
+// Post-trade stage on its own thread. The fill path hands each trade over with one queue
+// push; this thread keeps per-account positions, average prices, realized P&L and netted
+// settlement obligations, and writes the drop-copy feed for clearing one batch (one write
+// and flush) at a time.
+class PostTradeProcessor {
+private:
+    static const size_t QUEUE_CAPACITY = 16384;
+    static const size_t BATCH_LIMIT = 256;
+
+    struct Fill {
+        shared_ptr<Trade> trade;  // nullptr stops the thread
+        bool replayed;            // Restored from a snapshot: positions only, no drop copy
+    };
+
+    MpscQueue<Fill> queue;
+
+    // Everything below is written by the worker thread; stateMutex covers the positions
+    // and counters for readers on other threads
+    unique_ptr<ofstream> dropCopy;
+    string dropCopyBatch;
+    unsigned long long dropCopySequence;
+    unsigned long long dropCopyBatches;
+    unsigned long long fillsApplied;
+    unordered_map<string, unordered_map<string, Position>> positions;
+    mutex stateMutex;
+    atomic<size_t> consumed{0};
+    WaitPoint drained;
+    thread worker;
+
+    void apply(const Trade& trade) {
+        ++fillsApplied;
+        // An implied spread execution has no counterparty order; it is booked on its legs
+        if (trade.buyOrderId == 0 || trade.sellOrderId == 0) {
+            return;
+        }
+        if (!trade.buyAccount.empty()) {
+            positions[trade.buyAccount][trade.symbol].apply(trade.quantity, trade.price);
+        }
+        if (!trade.sellAccount.empty()) {
+            positions[trade.sellAccount][trade.symbol].apply(-static_cast<long long>(trade.quantity), trade.price);
+        }
+    }
+
+    void appendDropCopy(const Trade& trade) {
+        char row[256];
+        int length = snprintf(row, sizeof(row), "%llu,%s,%s,%.4f,%d,%d,%s,%d,%s\n", ++dropCopySequence,
+                              formatEventTime(trade.timestamp), trade.symbol.c_str(), trade.price, trade.quantity,
+                              trade.buyOrderId, trade.buyAccount.c_str(), trade.sellOrderId,
+                              trade.sellAccount.c_str());
+        dropCopyBatch.append(row, min<size_t>(length, sizeof(row) - 1));
+    }
+
+    void run() {
+        Fill fill;
+        for (bool running = true; running;) {
+            queue.waitForEntry();
+            size_t taken = 0;
+            {
+                lock_guard<mutex> lock(stateMutex);
+                while (taken < BATCH_LIMIT && queue.tryPop(fill)) {
+                    ++taken;
+                    if (!fill.trade) {
+                        running = false;
+                        break;
+                    }
+                    apply(*fill.trade);
+                    if (dropCopy && !fill.replayed) {
+                        appendDropCopy(*fill.trade);
+                    }
+                }
+            }
+            if (!dropCopyBatch.empty()) {
+                dropCopy->write(dropCopyBatch.data(), dropCopyBatch.size());
+                dropCopy->flush();
+                dropCopyBatch.clear();
+                ++dropCopyBatches;
+            }
+            consumed.fetch_add(taken);
+            drained.notify();
+        }
+    }
+
+public:
+    explicit PostTradeProcessor(unique_ptr<ofstream> dropCopyFile)
+        : queue(QUEUE_CAPACITY, SPIN_THEN_FUTEX), dropCopy(move(dropCopyFile)), dropCopySequence(0),
+          dropCopyBatches(0), fillsApplied(0) {
+        if (dropCopy) {
+            *dropCopy << "seq,time,symbol,price,quantity,buy_id,buy_account,sell_id,sell_account\n";
+        }
+        worker = thread(&PostTradeProcessor::run, this);
+    }
+
+    ~PostTradeProcessor() {
+        queue.push(Fill{ nullptr, false });
+        worker.join();
+    }
+
+    // Fill path: the only post-trade work done inside the matching critical section
+    void enqueue(const shared_ptr<Trade>& trade, bool replayed = false) {
+        queue.push(Fill{ trade, replayed });
+    }
+
+    // Wait until every fill enqueued so far has been applied
+    void sync() {
+        size_t target = queue.claimed();
+        drained.waitUntil([&]() { return consumed.load() >= target; }, SPIN_THEN_FUTEX);
+    }
+
+    // Positions per account and symbol, then each account's net settlement: the shares it
+    // receives or delivers per symbol and the cash it pays or receives overall
+    void print(ostream& out, const string& accountFilter) {
+        sync();
+        lock_guard<mutex> lock(stateMutex);
+        vector<string> accounts;
+        for (const auto& entry : positions) {
+            if (accountFilter.empty() || entry.first == accountFilter) accounts.push_back(entry.first);
+        }
+        sort(accounts.begin(), accounts.end());
+
+        out << "Positions after " << fillsApplied << " fills";
+        if (dropCopy) {
+            out << " (" << dropCopySequence << " drop-copy records in " << dropCopyBatches << " batches)";
+        }
+        out << ":" << endl << fixed << setprecision(2);
+        for (const auto& account : accounts) {
+            const auto& bySymbol = positions[account];
+            map<string, Position> sorted(bySymbol.begin(), bySymbol.end());
+            double cash = 0.0;
+            double realized = 0.0;
+            for (const auto& entry : sorted) {
+                const Position& position = entry.second;
+                out << "  " << account << " " << entry.first << " net " << position.net << " avg "
+                    << position.averagePrice << " bought " << position.bought << " sold " << position.sold
+                    << " realized " << position.realizedPnl << endl;
+                cash += position.netCash;
+                realized += position.realizedPnl;
+            }
+            out << "  " << account << " settlement:";
+            for (const auto& entry : sorted) {
+                if (entry.second.net > 0) out << " receive " << entry.second.net << " " << entry.first << ",";
+                if (entry.second.net < 0) out << " deliver " << -entry.second.net << " " << entry.first << ",";
+            }
+            out << (cash < 0 ? " pay " : " receive ") << fabs(cash) << " cash, realized P&L " << realized << endl;
+        }
+    }
+
+    // Drop all positions, e.g. before a snapshot replaces the engine state
+    void clear() {
+        sync();
+        lock_guard<mutex> lock(stateMutex);
+        positions.clear();
+        fillsApplied = 0;
+    }
+};
+
+// Engine snapshot file header ("OBSN" little-endian) and format version
+const uint32_t ENGINE_SNAPSHOT_MAGIC = 0x4E53424F;
+const uint16_t ENGINE_SNAPSHOT_VERSION = 1;
+
+// End-of-day archive file ("OBAR" little-endian). Rows are grouped per symbol into blocks
+// of up to ARCHIVE_BLOCK_ROWS, stored column by column: IDs and timestamps as deltas,
+// prices as deltas in units of the block's price tick (the GCD of its prices), the rest as
+// varints. A footer holds the name dictionary and the block directory with a CRC per
+// block, so a reader fetches and decodes only the blocks of the symbol it wants.
+const uint32_t ARCHIVE_MAGIC = 0x5241424F;
+const uint16_t ARCHIVE_VERSION = 1;
+const size_t ARCHIVE_BLOCK_ROWS = 4096;
+const double ARCHIVE_PRICE_SCALE = 10000.0;  // Prices are kept to 4 decimals, as in the canonical state
+enum ArchiveBlockKind : uint8_t { ARCHIVE_TRADES = 1, ARCHIVE_ORDERS = 2 };
+enum ArchiveTradeColumn { TRADE_TIME, TRADE_BUY_ID, TRADE_SELL_ID, TRADE_PRICE, TRADE_QUANTITY, TRADE_COLUMNS };
+enum ArchiveOrderColumn { ORDER_ID, ORDER_TIME, ORDER_FLAGS, ORDER_PRICE, ORDER_QUANTITY, ORDER_FILLED, ORDER_STOP,
+                          ORDER_PEAK, ORDER_ACCOUNT, ORDER_COLUMNS };
+
+// Entry-time fields of an order, kept compactly so the archive can still list orders
+// that compaction has retired from the engine. Names are interned.
+struct OrderRecord {
+    int id;
+    OrderType type;
+    OrderVariant variant;
+    double price;
+    int quantity;
+    double stopPrice;
+    int peakSize;
+    int64_t timestamp;
+    uint32_t symbol;
+    uint32_t account;  // 0 = no account
+};
+
+// An archived order: its entry, and how it ended up
+struct ArchivedOrder {
+    OrderRecord entry;
+    OrderStatus status;
+    int filled;
+};
+
+int64_t archivePriceUnits(double price) {
+    return llround(price * ARCHIVE_PRICE_SCALE);
+}
+
+// Columns are built separately; a block is its row count, price tick, column sizes and
+// then the columns back to back
+class ArchiveBlockWriter {
+private:
+    vector<BufferWriter> columns;
+
+public:
+    explicit ArchiveBlockWriter(size_t columnCount) : columns(columnCount, BufferWriter(4096)) {}
+
+    BufferWriter& operator[](size_t column) {
+        return columns[column];
+    }
+
+    void finish(BufferWriter& out, size_t rows, int64_t priceTick) {
+        out.putVarint(rows);
+        out.putVarint(priceTick);
+        out.putVarint(columns.size());
+        for (const auto& column : columns) out.putVarint(column.size());
+        for (const auto& column : columns) out.put(column.data(), column.size());
+    }
+};
+
+// Decodes one block's header and hands out a reader per column
+struct ArchiveBlockReader {
+    size_t rows = 0;
+    int64_t priceTick = 1;
+    vector<BufferReader> columns;
+    bool valid = false;
+
+    ArchiveBlockReader(const char* data, size_t size, size_t expectedColumns) {
+        BufferReader r(data, size);
+        rows = r.getVarint();
+        priceTick = static_cast<int64_t>(r.getVarint());
+        size_t count = r.getVarint();
+        if (!r.ok() || count != expectedColumns || priceTick <= 0) return;
+        vector<size_t> sizes(count);
+        for (auto& columnSize : sizes) columnSize = r.getVarint();
+        for (size_t columnSize : sizes) columns.push_back(r.getSlice(columnSize));
+        valid = r.ok() && r.atEnd();
+    }
+
+    bool ok() const {
+        if (!valid) return false;
+        for (const auto& column : columns) {
+            if (!column.ok() || !column.atEnd()) return false;
+        }
+        return true;
+    }
+};
+
+// Reader side: print the rows of one symbol (or all) from an archive. Blocks of other
+// symbols are neither read nor decoded.
+int readArchive(const string& path, const string& symbolFilter) {
+    static const char* const variantNames[] = { "LIMIT", "MARKET", "IOC", "FOK", "STOP", "STOP_LIMIT", "ICEBERG" };
+    static const char* const statusNames[] = { "ACTIVE", "FILLED", "PARTIALLY_FILLED", "CANCELLED" };
+    auto started = chrono::steady_clock::now();
+
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file.is_open()) {
+        cerr << "Cannot open archive " << path << endl;
+        return 1;
+    }
+    size_t fileSize = static_cast<size_t>(file.tellg());
+    const size_t trailerSize = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    char trailer[trailerSize];
+    if (fileSize < 6 + trailerSize || !file.seekg(fileSize - trailerSize) || !file.read(trailer, trailerSize)) {
+        cerr << "Not an archive: " << path << endl;
+        return 1;
+    }
+    BufferReader t(trailer, trailerSize);
+    uint64_t footerOffset = t.getRaw<uint64_t>();
+    uint32_t footerCrc = t.getRaw<uint32_t>();
+    if (t.getRaw<uint32_t>() != ARCHIVE_MAGIC || footerOffset < 6 || footerOffset > fileSize - trailerSize) {
+        cerr << "Not an archive: " << path << endl;
+        return 1;
+    }
+    vector<char> footer(fileSize - trailerSize - footerOffset);
+    file.seekg(footerOffset);
+    file.read(footer.data(), footer.size());
+    if (!file || crc32(footer.data(), footer.size()) != footerCrc) {
+        cerr << "Archive footer is corrupt: " << path << endl;
+        return 1;
+    }
+
+    BufferReader f(footer.data(), footer.size());
+    vector<string> names(f.getCount(1));
+    for (auto& name : names) {
+        name = f.getShortString();
+    }
+    struct BlockEntry {
+        uint64_t symbol, rows, offset, length;
+        uint8_t kind;
+        uint32_t crc;
+    };
+    vector<BlockEntry> blocks(f.getCount(8));
+    for (auto& block : blocks) {
+        block.symbol = f.getVarint();
+        block.kind = f.getRaw<uint8_t>();
+        block.rows = f.getVarint();
+        block.offset = f.getVarint();
+        block.length = f.getVarint();
+        block.crc = f.getRaw<uint32_t>();
+        if (!f.ok() || block.symbol >= names.size() || block.offset + block.length > footerOffset) {
+            cerr << "Archive block directory is corrupt: " << path << endl;
+            return 1;
+        }
+    }
+
+    auto nameOf = [&](uint64_t id) -> const string& {
+        static const string unknown = "?";
+        return id < names.size() ? names[id] : unknown;
+    };
+
+    cout << fixed << setprecision(4);
+    size_t blocksRead = 0, bytesRead = 0, rowsRead = 0;
+    vector<char> data;
+    for (const auto& block : blocks) {
+        const string& symbol = names[block.symbol];
+        if (!symbolFilter.empty() && symbol != symbolFilter) continue;
+
+        data.resize(block.length);
+        file.seekg(block.offset);
+        file.read(data.data(), data.size());
+        if (!file || crc32(data.data(), data.size()) != block.crc) {
+            cerr << "Archive block at " << block.offset << " failed its checksum" << endl;
+            return 1;
+        }
+        ++blocksRead;
+        bytesRead += block.length;
+
+        ArchiveBlockReader reader(data.data(), data.size(),
+                                  block.kind == ARCHIVE_TRADES ? size_t(TRADE_COLUMNS) : size_t(ORDER_COLUMNS));
+        if (!reader.valid || reader.rows != block.rows) {
+            cerr << "Archive block at " << block.offset << " is malformed" << endl;
+            return 1;
+        }
+        auto& c = reader.columns;
+        int64_t time = 0, id = 0, buyId = 0, sellId = 0, ticks = 0;
+        auto printTime = [](int64_t ns) {
+            cout << formatEventTime(ns) << '.' << setw(3) << setfill('0') << (ns / 1000000) % 1000 << setfill(' ');
+        };
+        for (size_t row = 0; row < reader.rows; ++row) {
+            if (block.kind == ARCHIVE_TRADES) {
+                time += c[TRADE_TIME].getZigzag();
+                buyId += c[TRADE_BUY_ID].getZigzag();
+                sellId += c[TRADE_SELL_ID].getZigzag();
+                ticks += c[TRADE_PRICE].getZigzag();
+                uint64_t quantity = c[TRADE_QUANTITY].getVarint();
+                cout << "trade " << symbol << " ";
+                printTime(time);
+                cout << " " << ticks * reader.priceTick / ARCHIVE_PRICE_SCALE << " " << quantity << " buy=" << buyId
+                     << " sell=" << sellId << "\n";
+            } else {
+                id += c[ORDER_ID].getZigzag();
+                time += c[ORDER_TIME].getZigzag();
+                uint64_t flags = c[ORDER_FLAGS].getVarint();
+                ticks += c[ORDER_PRICE].getZigzag();
+                uint64_t quantity = c[ORDER_QUANTITY].getVarint();
+                uint64_t filled = c[ORDER_FILLED].getVarint();
+                uint64_t stopTicks = c[ORDER_STOP].getVarint();
+                uint64_t peak = c[ORDER_PEAK].getVarint();
+                uint64_t account = c[ORDER_ACCOUNT].getVarint();
+                cout << "order " << symbol << " id=" << id << " ";
+                printTime(time);
+                cout << " " << (flags & 1 ? "SELL" : "BUY") << " " << variantNames[min<uint64_t>((flags >> 1) & 7, 6)] << " "
+                     << ticks * reader.priceTick / ARCHIVE_PRICE_SCALE << " qty=" << quantity << " filled=" << filled
+                     << " " << statusNames[(flags >> 4) & 3];
+                if (stopTicks) cout << " stop=" << static_cast<int64_t>(stopTicks) * reader.priceTick / ARCHIVE_PRICE_SCALE;
+                if (peak) cout << " peak=" << peak;
+                if (account) cout << " account=" << nameOf(account);
+                cout << "\n";
+            }
+        }
+        if (!reader.ok()) {
+            cerr << "Archive block at " << block.offset << " is malformed" << endl;
+            return 1;
+        }
+        rowsRead += reader.rows;
+    }
+
+    auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started);
+    cout << "Archive scan: " << rowsRead << " rows from " << blocksRead << " of " << blocks.size() << " blocks, "
+         << bytesRead << " of " << fileSize << " bytes read in " << elapsed.count() << " us" << endl;
+    return 0;
+}
+
+// Engine-wide settings. reference() is the plain configuration that the differential
+// runner checks the default (optimized) one against, so every new fast path should be
+// switchable here.
+struct EngineConfig {
+    bool deterministic = false;  // Logical clock advanced per input event, for replay
+    bool depthCache = true;      // Serve top-N depth from the per-book cache
+    bool levelLadder = true;     // Answer FOK eligibility and band counts from tick ladders
+    size_t compactAfterCancels = 256;  // Tombstones per book before it is compacted (0 = never)
+    size_t orderBatch = 0;       // Resting orders the command runners coalesce per symbol (0 = off)
+
+    // Threaded runner placement; -1 leaves a thread to the scheduler
+    int ioCpu = -1;
+    int matchingCpu = -1;
+    WaitStrategy inputWait = SPIN_THEN_FUTEX;
+    size_t inputQueueCapacity = 4096;
+
+    // The differential runs' baseline: every optional fast path off (depth cache, tick
+    // ladders, compaction, batching), so each query walks the books and each order is
+    // placed and matched on its own. Anything the default config turns on differs from it.
+    static EngineConfig reference() {
+        EngineConfig config;
+        config.depthCache = false;
+        config.levelLadder = false;
+        config.compactAfterCancels = 0;
+        config.orderBatch = 0;
+        return config;
+    }
+};
+
+// 2024-01-02 09:15:00 UTC, the start of every deterministic session
+const int64_t DETERMINISTIC_EPOCH_NS = 1704186900LL * 1000000000LL;
+
+class OrderBook {
+private:
+    // Price -> deque of Order pointers (for time priority)
+    // Using map for price levels (automatically sorted)
+    unordered_map<string, map<double, deque<shared_ptr<Order>>, greater<double>>> buyOrders;  // Descending for buys
+    unordered_map<string, map<double, deque<shared_ptr<Order>>, less<double>>> sellOrders;    // Ascending for sells
+
+    // All orders by ID for quick lookup
+    unordered_map<int, shared_ptr<Order>> orderMap;
+
+    // Status, fills and average price by order ID, for queries that take no book lock
+    OrderStatusTable orderStatus;
+
+    // Symbol-level locks for better concurrency
+    unordered_map<string, shared_mutex> symbolMutexes;
+    mutex orderIdMutex;
+
+    // Circuit breaker for market-wide halts, fed by update_index or the engine's own index
+    MarketCircuitBreaker circuitBreaker;
+    EngineIndex engineIndex;
+
+    // Individual stock price bands (dynamic circuit breakers)
+    unordered_map<string, double> referencePrices;
+    unordered_map<string, double> priceBandPercentages;
+    unordered_map<string, double> tickSizes;
+
+    // Pending stop orders, keyed by stop price so a new last price only visits the
+    // stops it crosses. Buy stops fire when last >= stop, sell stops when last <= stop.
+    unordered_map<string, multimap<double, shared_ptr<Order>>> buyStops;
+    unordered_map<string, multimap<double, shared_ptr<Order>>> sellStops;
+    unordered_map<string, shared_ptr<Trade>> lastTrades;
+
+    // Spread instruments over outright books, and the reverse index from a leg symbol to
+    // the spreads (and leg positions) that reference it. Guarded by spreadMutex, which is
+    // always taken after any symbol locks.
+    unordered_map<string, SpreadInstrument> spreads;
+    unordered_map<string, vector<pair<string, size_t>>> spreadLegIndex;
+    unordered_map<string, TopOfBook> legTops;
+    set<string> pendingSpreads;  // Spreads whose legs moved since their last implied match
+    mutex spreadMutex;
+
+    int nextOrderId;
+    vector<shared_ptr<Trade>> tradeHistory;
+
+    // Archive rows of finished orders pruned from orderMap since the last archive, in their
+    // final state, with interned symbol and account names (index 0 is the empty name). Orders
+    // still in orderMap are read from there at archive time. Guarded by orderIdMutex.
+    vector<ArchivedOrder> orderJournal;
+    vector<string> internedNames;
+    unordered_map<string, uint32_t> internedIds;
+
+    // Single source of event times for this book
+    EngineClock clock;
+
+    // Aggregated top-of-book depth per symbol, rebuilt lazily and invalidated only by
+    // changes at or inside the cached levels
+    unordered_map<string, DepthCache> depthCaches;
+    mutex depthCachesMutex;  // Guards the map itself; entries are node-stable once created
+
+    // Per-tick remaining quantity of each book side, for the vectorized level scans
+    unordered_map<string, LevelLadder> buyLadders;
+    unordered_map<string, LevelLadder> sellLadders;
+
+    // Cancels left in place as tombstones since each book's last compaction
+    unordered_map<string, size_t> tombstoneCounts;
+
+    // OCO and bracket groups per symbol
+    unordered_map<string, SymbolLinks> orderLinks;
+
+    // Instruments that do not allocate in plain price-time order
+    unordered_map<string, AllocationRule> allocationRules;
+
+    // Mass-quote slots, account -> symbol -> slot. The mutex guards the maps; a slot's
+    // orders are only touched under the symbol lock. Entries are node-stable once created.
+    unordered_map<string, unordered_map<string, QuoteSlot>> quoteSlots;
+    mutex quoteSlotsMutex;
+
+    // Optional shared-memory publication of top-of-book state
+    SnapshotPublisher snapshotPublisher;
+
+    // Reused output buffer for query_* commands
+    BufferWriter queryWriter;
+    mutex queryMutex;
+
+    EngineConfig config;
+
+    // Engine log and query output; shares cout's buffer unless redirected
+    ostream out;
+
+    // Hardware counter profile of the order path, when enabled
+    unique_ptr<StageProfiler> profiler;
+
+    // Positions and drop copy on their own thread, when enabled
+    unique_ptr<PostTradeProcessor> postTrade;
+
+    // Optional CSV stream of every fill as it happens (backtest runs)
+    ostream* fillLog;
+    mutex fillLogMutex;
+
+public:
+    explicit OrderBook(const EngineConfig& cfg = EngineConfig())
+        : circuitBreaker(17500.0), nextOrderId(1), config(cfg), out(cout.rdbuf()), fillLog(nullptr) {
+        // Initialize with default reference index value (e.g., Nifty50 at 17500)
+        intern("");
+        if (config.deterministic) {
+            clock.setLogical(DETERMINISTIC_EPOCH_NS);
+        }
+    }
+
+    // Send engine output somewhere other than stdout (nullptr silences it)
+    void setOutput(streambuf* buffer) {
+        out.rdbuf(buffer);
+    }
+
+    // Profile the order path from the calling thread, which must be the one driving the book
+    void enableProfiling() {
+        profiler.reset(new StageProfiler());
+    }
+
+    StageProfiler* stageProfiler() {
+        return profiler.get();
+    }
+
+    void printProfile() {
+        if (!profiler) {
+            out << "Profiling is off (start with --profile)" << endl;
+            return;
+        }
+        profiler->print(out);
+    }
+
+    // Start the post-trade stage, with a drop-copy CSV at dropCopyPath unless it is empty
+    bool enablePostTrade(const string& dropCopyPath) {
+        unique_ptr<ofstream> dropCopy;
+        if (!dropCopyPath.empty()) {
+            dropCopy.reset(new ofstream(dropCopyPath, ios::trunc));
+            if (!dropCopy->is_open()) {
+                cerr << "Failed to open drop-copy file: " << dropCopyPath << endl;
+                return false;
+            }
+        }
+        postTrade.reset(new PostTradeProcessor(move(dropCopy)));
+        return true;
+    }
+
+    void printPositions(const string& account) {
+        if (!postTrade) {
+            out << "Post-trade processing is off (start with --post-trade or --drop-copy)" << endl;
+            return;
+        }
+        postTrade->print(out, account);
+    }
+
+    // Stream each fill from now on as "time,symbol,price,quantity,buy_id,sell_id"
+    void setFillLog(ostream* log) {
+        lock_guard<mutex> lock(fillLogMutex);
+        fillLog = log;
+        if (fillLog) {
+            *fillLog << fixed << setprecision(2);
+        }
+    }
+
+    // Replay drivers move logical time forward once per input event
+    void advanceClock(int64_t ns) {
+        clock.advance(ns);
+    }
+
+    int64_t currentTime() {
+        return clock.now();
+    }
+
+    // Start publishing book snapshots to the named POSIX shared-memory object
+    bool enableSnapshots(const string& name) {
+        if (!snapshotPublisher.open(name)) {
+            return false;
+        }
+        snapshotPublisher.publishMarket(circuitBreaker.getStatus(), circuitBreaker.getCurrentValue());
+        out << "Publishing book snapshots to shared memory " << name << endl;
+        return true;
+    }
+
+    void setStockPriceBand(const string& symbol, double referencePrice, double bandPercentage) {
+        referencePrices[symbol] = referencePrice;
+        priceBandPercentages[symbol] = bandPercentage;
+    }
+
+    // Resting order prices must be a multiple of the instrument's tick (0 removes the rule)
+    void setTickSize(const string& symbol, double tick) {
+        if (tick > 0) {
+            tickSizes[symbol] = tick;
+        } else {
+            tickSizes.erase(symbol);
+        }
+    }
+
+    // How the instrument's price levels share incoming quantity; FIFO removes the rule
+    void setAllocationPolicy(const string& symbol, const AllocationRule& rule) {
+        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+        if (rule.policy == ALLOC_FIFO) {
+            allocationRules.erase(symbol);
+        } else {
+            allocationRules[symbol] = rule;
+        }
+        out << "Allocation for " << symbol << ": " << ALLOCATION_POLICY_NAMES[rule.policy];
+        if (rule.policy == ALLOC_LMM) {
+            out << " (" << rule.lmmAccount << " " << rule.lmmPercent << "%)";
+        }
+        out << endl;
+    }
+
+    void setIndexReference(double value) {
+        circuitBreaker.setReferenceValue(value);
+        if (snapshotPublisher.isOpen()) {
+            snapshotPublisher.publishMarket(circuitBreaker.getStatus(), value);
+        }
+    }
+
+    // Add (or with weight 0 remove) a constituent of the engine-computed index. Its last
+    // traded price, if any, counts from now on; otherwise the base price stands in.
+    void setIndexConstituent(const string& symbol, double weight, double basePrice) {
+        double lastPrice = 0.0;
+        {
+            shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+            auto lastIt = lastTrades.find(symbol);
+            if (lastIt != lastTrades.end()) lastPrice = lastIt->second->price;
+        }
+        engineIndex.setConstituent(symbol, weight, basePrice, lastPrice);
+    }
+
+    void setIndexInterval(int64_t milliseconds) {
+        engineIndex.setInterval(milliseconds * 1000000LL);
+    }
+
+    void printIndex() {
+        auto constituents = engineIndex.list();
+        double reference = circuitBreaker.getReferenceValue();
+        out << "Index: " << fixed << setprecision(2) << engineIndex.value(reference) << " (reference "
+            << reference << ", breaker value " << circuitBreaker.getCurrentValue() << ", "
+            << constituents.size() << " constituents, evaluated every "
+            << engineIndex.interval() / 1000000 << " ms)" << endl;
+        for (const auto& entry : constituents) {
+            out << "  " << entry.first << " weight " << entry.second.weight << " base " << entry.second.basePrice
+                << " last " << entry.second.lastPrice << endl;
+        }
+    }
+
+    // Feed the breaker from the engine's index once it has moved and the interval is up
+    void evaluateIndex() {
+        double value;
+        if (engineIndex.due(clock.now(), circuitBreaker.getReferenceValue(), value)) {
+            updateIndexValue(value);
+        }
+    }
+
+    // Hand the breaker a move the interval is still holding back, before the state is saved
+    // or the run ends. Deterministic runs leave it pending so a replay split by a snapshot
+    // matches an uninterrupted one; the snapshot carries the pending move instead.
+    void settleIndex() {
+        if (config.deterministic) {
+            return;
+        }
+        double value;
+        if (engineIndex.settle(clock.now(), circuitBreaker.getReferenceValue(), value)) {
+            updateIndexValue(value);
+        }
+    }
+
+    // Save the engine configuration and state for a cold start: index reference and breaker
+    // state, instruments (price bands, tick sizes), spread definitions, resting orders in
+    // time priority, pending stops, trade history and the next order ID. One binary file.
+    bool saveSnapshot(const string& path) {
+        settleIndex();
+
+        BufferWriter w(256 * 1024);
+        w.putRaw(ENGINE_SNAPSHOT_MAGIC);
+        w.putRaw(ENGINE_SNAPSHOT_VERSION);
+
+        w.putRaw(circuitBreaker.getReferenceValue());
+        w.putRaw(circuitBreaker.getCurrentValue());
+        w.putRaw<uint8_t>(circuitBreaker.getStatus());
+        w.putRaw<int64_t>(circuitBreaker.getHaltEndTime());
+        {
+            lock_guard<mutex> idLock(orderIdMutex);
+            w.putRaw<int32_t>(nextOrderId);
+        }
+
+        vector<string> instruments;
+        for (const auto& entry : referencePrices) instruments.push_back(entry.first);
+        for (const auto& entry : tickSizes) instruments.push_back(entry.first);
+        sort(instruments.begin(), instruments.end());
+        instruments.erase(unique(instruments.begin(), instruments.end()), instruments.end());
+        w.putRaw<uint32_t>(instruments.size());
+        for (const auto& symbol : instruments) {
+            auto refIt = referencePrices.find(symbol);
+            auto tickIt = tickSizes.find(symbol);
+            w.putShortString(symbol);
+            w.putRaw<double>(tickIt != tickSizes.end() ? tickIt->second : 0.0);
+            w.putRaw<uint8_t>(refIt != referencePrices.end());
+            w.putRaw<double>(refIt != referencePrices.end() ? refIt->second : 0.0);
+            w.putRaw<double>(refIt != referencePrices.end() ? priceBandPercentages.at(symbol) : 0.0);
+        }
+
+        {
+            lock_guard<mutex> spreadLock(spreadMutex);
+            w.putRaw<uint32_t>(spreads.size());
+            for (const auto& entry : spreads) {
+                w.putShortString(entry.first);
+                w.putRaw<uint32_t>(entry.second.legs.size());
+                for (const auto& leg : entry.second.legs) {
+                    w.putShortString(leg.symbol);
+                    w.putRaw<uint8_t>(leg.side);
+                    w.putRaw<int32_t>(leg.ratio);
+                }
+            }
+        }
+
+        size_t countOffset = w.size();
+        w.putRaw<uint32_t>(0);
+        uint32_t orders = 0;
+        for (const auto& symbol : knownSymbols()) {
+            shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+            auto buyIt = buyOrders.find(symbol);
+            if (buyIt != buyOrders.end()) orders += writeSnapshotOrders(w, buyIt->second);
+            auto sellIt = sellOrders.find(symbol);
+            if (sellIt != sellOrders.end()) orders += writeSnapshotOrders(w, sellIt->second);
+            for (const auto* stopsBySymbol : { &buyStops, &sellStops }) {
+                auto stopIt = stopsBySymbol->find(symbol);
+                if (stopIt == stopsBySymbol->end()) continue;
+                for (const auto& entry : stopIt->second) {
+                    if (entry.second->status == CANCELLED) continue;
+                    writeSnapshotOrder(w, *entry.second);
+                    ++orders;
+                }
+            }
+        }
+        w.patchRaw(countOffset, orders);
+
+        w.putRaw<uint32_t>(tradeHistory.size());
+        for (const auto& trade : tradeHistory) {
+            w.putShortString(trade->symbol);
+            w.putRaw<int32_t>(trade->buyOrderId);
+            w.putRaw<int32_t>(trade->sellOrderId);
+            w.putRaw(trade->price);
+            w.putRaw<int32_t>(trade->quantity);
+            w.putRaw<int64_t>(trade->timestamp);
+            w.putShortString(trade->buyAccount);
+            w.putShortString(trade->sellAccount);
+        }
+
+        // Quote slots by order ID (0 = side not quoted), so quoting resumes on the same orders
+        {
+            lock_guard<mutex> slotsLock(quoteSlotsMutex);
+            size_t slotCountOffset = w.size();
+            w.putRaw<uint32_t>(0);
+            uint32_t slots = 0;
+            for (const auto& accountEntry : quoteSlots) {
+                for (const auto& slotEntry : accountEntry.second) {
+                    shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(slotEntry.first));
+                    int bidId = isLiveQuote(slotEntry.second.bid) ? slotEntry.second.bid->id : 0;
+                    int askId = isLiveQuote(slotEntry.second.ask) ? slotEntry.second.ask->id : 0;
+                    if (bidId == 0 && askId == 0) continue;
+                    w.putShortString(accountEntry.first);
+                    w.putShortString(slotEntry.first);
+                    w.putRaw<int32_t>(bidId);
+                    w.putRaw<int32_t>(askId);
+                    ++slots;
+                }
+            }
+            w.patchRaw(slotCountOffset, slots);
+        }
+
+        // Index constituents with their last prices, the evaluation interval, and whether a
+        // move is still waiting for the breaker
+        auto constituents = engineIndex.list();
+        w.putRaw<int64_t>(engineIndex.interval());
+        w.putRaw<uint32_t>(constituents.size());
+        for (const auto& entry : constituents) {
+            w.putShortString(entry.first);
+            w.putRaw(entry.second.weight);
+            w.putRaw(entry.second.basePrice);
+            w.putRaw(entry.second.lastPrice);
+        }
+        w.putRaw<uint8_t>(engineIndex.movePending());
+        w.putRaw<int64_t>(engineIndex.lastEvaluation());
+
+        // Link groups by member ID; exits still held for a bracket entry are not in any book,
+        // so they are saved whole
+        size_t groupCountOffset = w.size();
+        w.putRaw<uint32_t>(0);
+        uint32_t groups = 0;
+        for (const auto& symbol : knownSymbols()) {
+            shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+            auto linksIt = orderLinks.find(symbol);
+            if (linksIt == orderLinks.end()) continue;
+            for (const auto& entry : linksIt->second.groups) {
+                const LinkGroup& group = entry.second;
+                w.putRaw<int32_t>(entry.first);
+                w.putRaw<uint8_t>(group.type);
+                w.putRaw<uint8_t>(group.working);
+                w.putRaw<int32_t>(group.entry ? group.entry->id : 0);
+                w.putRaw<uint32_t>(group.members.size());
+                for (const auto& member : group.members) {
+                    w.putRaw<int32_t>(member->id);
+                    if (!group.working) writeSnapshotOrder(w, *member);
+                }
+                ++groups;
+            }
+        }
+        w.patchRaw(groupCountOffset, groups);
+
+        w.putRaw<uint32_t>(allocationRules.size());
+        for (const auto& entry : allocationRules) {
+            w.putShortString(entry.first);
+            w.putRaw<uint8_t>(entry.second.policy);
+            w.putShortString(entry.second.lmmAccount);
+            w.putRaw<int32_t>(entry.second.lmmPercent);
+        }
+
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write(w.data(), w.size());
+        if (!file) {
+            out << "Snapshot save failed: " << path << endl;
+            return false;
+        }
+        out << "Snapshot saved: " << instruments.size() << " instruments, " << orders << " orders, "
+            << tradeHistory.size() << " trades to " << path << endl;
+        return true;
+    }
+
+    // Write the session's orders (current fields, status and fill) and trades to a columnar
+    // archive. The journal rows of pruned orders are dropped once written, so a later
+    // archive holds the orders finished since, and the live ones again.
+    bool writeArchive(const string& path) {
+        vector<ArchivedOrder> orders;
+        vector<string> names;
+        size_t journaled;
+        {
+            lock_guard<mutex> idLock(orderIdMutex);
+            journaled = orderJournal.size();
+            orders.reserve(journaled + orderMap.size());
+            orders.insert(orders.end(), orderJournal.begin(), orderJournal.end());
+            for (const auto& entry : orderMap) {
+                orders.push_back(archiveRow(*entry.second));
+            }
+            names = internedNames;
+        }
+        sort(orders.begin(), orders.end(),
+             [](const ArchivedOrder& a, const ArchivedOrder& b) { return a.entry.id < b.entry.id; });
+
+        // Trades of symbols no order was journaled for (restored history) get names too
+        unordered_map<string, uint32_t> nameIds;
+        for (uint32_t i = 0; i < names.size(); ++i) nameIds.emplace(names[i], i);
+        map<uint32_t, vector<const Trade*>> tradesBySymbol;
+        for (const auto& trade : tradeHistory) {
+            auto it = nameIds.find(trade->symbol);
+            if (it == nameIds.end()) {
+                it = nameIds.emplace(trade->symbol, static_cast<uint32_t>(names.size())).first;
+                names.push_back(trade->symbol);
+            }
+            tradesBySymbol[it->second].push_back(trade.get());
+        }
+        map<uint32_t, vector<const ArchivedOrder*>> ordersBySymbol;
+        for (const auto& order : orders) {
+            ordersBySymbol[order.entry.symbol].push_back(&order);
+        }
+
+        BufferWriter w(256 * 1024);
+        w.putRaw(ARCHIVE_MAGIC);
+        w.putRaw(ARCHIVE_VERSION);
+
+        BufferWriter directory(4096);
+        uint32_t blockCount = 0;
+        auto addBlock = [&](uint32_t symbol, ArchiveBlockKind kind, size_t rows, size_t offset) {
+            directory.putVarint(symbol);
+            directory.putRaw<uint8_t>(kind);
+            directory.putVarint(rows);
+            directory.putVarint(offset);
+            directory.putVarint(w.size() - offset);
+            directory.putRaw(crc32(w.data() + offset, w.size() - offset));
+            ++blockCount;
+        };
+
+        for (const auto& entry : tradesBySymbol) {
+            const auto& trades = entry.second;
+            for (size_t first = 0; first < trades.size(); first += ARCHIVE_BLOCK_ROWS) {
+                size_t last = min(trades.size(), first + ARCHIVE_BLOCK_ROWS);
+                int64_t tick = 0;
+                for (size_t i = first; i < last; ++i) tick = gcd(tick, archivePriceUnits(trades[i]->price));
+
+                ArchiveBlockWriter block(TRADE_COLUMNS);
+                tick = max<int64_t>(tick, 1);
+                int64_t time = 0, buyId = 0, sellId = 0, ticks = 0;
+                for (size_t i = first; i < last; ++i) {
+                    const Trade& trade = *trades[i];
+                    int64_t priceTicks = archivePriceUnits(trade.price) / tick;
+                    block[TRADE_TIME].putZigzag(trade.timestamp - time);
+                    block[TRADE_BUY_ID].putZigzag(trade.buyOrderId - buyId);
+                    block[TRADE_SELL_ID].putZigzag(trade.sellOrderId - sellId);
+                    block[TRADE_PRICE].putZigzag(priceTicks - ticks);
+                    block[TRADE_QUANTITY].putVarint(trade.quantity);
+                    time = trade.timestamp;
+                    buyId = trade.buyOrderId;
+                    sellId = trade.sellOrderId;
+                    ticks = priceTicks;
+                }
+                size_t offset = w.size();
+                block.finish(w, last - first, tick);
+                addBlock(entry.first, ARCHIVE_TRADES, last - first, offset);
+            }
+        }
+
+        for (const auto& entry : ordersBySymbol) {
+            const auto& symbolOrders = entry.second;
+            for (size_t first = 0; first < symbolOrders.size(); first += ARCHIVE_BLOCK_ROWS) {
+                size_t last = min(symbolOrders.size(), first + ARCHIVE_BLOCK_ROWS);
+                int64_t tick = 0;
+                for (size_t i = first; i < last; ++i) {
+                    tick = gcd(tick, archivePriceUnits(symbolOrders[i]->entry.price));
+                    tick = gcd(tick, archivePriceUnits(symbolOrders[i]->entry.stopPrice));
+                }
+
+                ArchiveBlockWriter block(ORDER_COLUMNS);
+                tick = max<int64_t>(tick, 1);
+                int64_t id = 0, time = 0, ticks = 0;
+                for (size_t i = first; i < last; ++i) {
+                    const OrderRecord& order = symbolOrders[i]->entry;
+                    int64_t priceTicks = archivePriceUnits(order.price) / tick;
+                    block[ORDER_ID].putZigzag(order.id - id);
+                    block[ORDER_TIME].putZigzag(order.timestamp - time);
+                    block[ORDER_FLAGS].putVarint(order.type | order.variant << 1 | symbolOrders[i]->status << 4);
+                    block[ORDER_PRICE].putZigzag(priceTicks - ticks);
+                    block[ORDER_QUANTITY].putVarint(order.quantity);
+                    block[ORDER_FILLED].putVarint(symbolOrders[i]->filled);
+                    block[ORDER_STOP].putVarint(archivePriceUnits(order.stopPrice) / tick);
+                    block[ORDER_PEAK].putVarint(order.peakSize);
+                    block[ORDER_ACCOUNT].putVarint(order.account);
+                    id = order.id;
+                    time = order.timestamp;
+                    ticks = priceTicks;
+                }
+                size_t offset = w.size();
+                block.finish(w, last - first, tick);
+                addBlock(entry.first, ARCHIVE_ORDERS, last - first, offset);
+            }
+        }
+
+        uint64_t footerOffset = w.size();
+        w.putRaw<uint32_t>(names.size());
+        for (const auto& name : names) w.putShortString(name);
+        w.putRaw<uint32_t>(blockCount);
+        w.put(directory.data(), directory.size());
+        uint32_t footerCrc = crc32(w.data() + footerOffset, w.size() - footerOffset);
+        w.putRaw(footerOffset);
+        w.putRaw(footerCrc);
+        w.putRaw(ARCHIVE_MAGIC);
+
+        ofstream file(path, ios::binary | ios::trunc);
+        file.write(w.data(), w.size());
+        if (!file) {
+            out << "Archive write failed: " << path << endl;
+            return false;
+        }
+        {
+            lock_guard<mutex> idLock(orderIdMutex);
+            orderJournal.erase(orderJournal.begin(), orderJournal.begin() + journaled);
+            if (orderJournal.empty()) {
+                internedNames.clear();
+                internedIds.clear();
+                intern("");
+            }
+        }
+
+        size_t rows = orders.size() + tradeHistory.size();
+        out << "Archive written: " << orders.size() << " orders, " << tradeHistory.size() << " trades in "
+            << blockCount << " blocks, " << w.size() << " bytes (" << fixed << setprecision(1)
+            << (rows ? static_cast<double>(w.size()) / rows : 0.0) << " bytes/row) to " << path << endl;
+        return true;
+    }
+
+    // Replace the engine's state with a saved snapshot in one read. Books are rebuilt in
+    // saved priority order without matching; they were uncrossed when saved.
+    bool loadSnapshot(const string& path) {
+        auto started = chrono::steady_clock::now();
+
+        ifstream file(path, ios::binary | ios::ate);
+        if (!file.is_open()) {
+            out << "Snapshot load failed: cannot open " << path << endl;
+            return false;
+        }
+        vector<char> data(static_cast<size_t>(file.tellg()));
+        file.seekg(0);
+        file.read(data.data(), data.size());
+
+        BufferReader r(data.data(), data.size());
+        if (r.getRaw<uint32_t>() != ENGINE_SNAPSHOT_MAGIC || r.getRaw<uint16_t>() != ENGINE_SNAPSHOT_VERSION) {
+            out << "Snapshot load failed: " << path << " is not a version " << ENGINE_SNAPSHOT_VERSION
+                << " engine snapshot" << endl;
+            return false;
+        }
+
+        double indexReference = r.getRaw<double>();
+        double indexValue = r.getRaw<double>();
+        MarketStatus marketStatus = r.getEnum<MarketStatus>(NORMAL_TRADING, CLOSED);
+        time_t haltEnd = static_cast<time_t>(r.getRaw<int64_t>());
+        int savedNextId = r.getRaw<int32_t>();
+
+        // Decode everything before touching the engine, so a bad file changes nothing
+        struct Instrument {
+            string symbol;
+            double tick;
+            bool hasBand;
+            double reference;
+            double band;
+        };
+        vector<Instrument> instruments(r.getCount(26));
+        for (auto& instrument : instruments) {
+            instrument.symbol = r.getShortString();
+            instrument.tick = r.getRaw<double>();
+            instrument.hasBand = r.getRaw<uint8_t>() != 0;
+            instrument.reference = r.getRaw<double>();
+            instrument.band = r.getRaw<double>();
+            if (!r.ok()) break;
+        }
+
+        vector<pair<string, vector<SpreadLeg>>> spreadDefinitions(r.getCount(5));
+        for (auto& definition : spreadDefinitions) {
+            definition.first = r.getShortString();
+            definition.second.resize(r.getCount(6));
+            for (auto& leg : definition.second) {
+                leg.symbol = r.getShortString();
+                leg.side = r.getEnum<OrderType>(BUY, SELL);
+                leg.ratio = r.getRaw<int32_t>();
+            }
+            if (!r.ok()) break;
+        }
+
+        vector<shared_ptr<Order>> orders(r.getCount(49));
+        for (auto& order : orders) {
+            order = readSnapshotOrder(r);
+            if (!r.ok()) break;
+        }
+
+        vector<shared_ptr<Trade>> trades(r.getCount(29));
+        for (auto& trade : trades) {
+            string symbol = r.getShortString();
+            int buyId = r.getRaw<int32_t>();
+            int sellId = r.getRaw<int32_t>();
+            double price = r.getRaw<double>();
+            int quantity = r.getRaw<int32_t>();
+            int64_t timestamp = r.getRaw<int64_t>();
+            string buyAccount = r.getShortString();
+            string sellAccount = r.getShortString();
+            trade = make_shared<Trade>(buyId, sellId, symbol, price, quantity, timestamp, buyAccount, sellAccount);
+            if (!r.ok()) break;
+        }
+
+        struct SavedQuote {
+            string account;
+            string symbol;
+            int bidId;
+            int askId;
+        };
+        vector<SavedQuote> savedQuotes(r.getCount(10));
+        for (auto& quote : savedQuotes) {
+            quote.account = r.getShortString();
+            quote.symbol = r.getShortString();
+            quote.bidId = r.getRaw<int32_t>();
+            quote.askId = r.getRaw<int32_t>();
+            if (!r.ok()) break;
+        }
+
+        int64_t indexInterval = r.getRaw<int64_t>();
+        vector<pair<string, EngineIndex::Constituent>> constituents(r.getCount(25));
+        for (auto& entry : constituents) {
+            entry.first = r.getShortString();
+            entry.second.weight = r.getRaw<double>();
+            entry.second.basePrice = r.getRaw<double>();
+            entry.second.lastPrice = r.getRaw<double>();
+            if (!r.ok()) break;
+        }
+        bool indexMovePending = r.getRaw<uint8_t>() != 0;
+        int64_t lastIndexEvaluation = r.getRaw<int64_t>();
+
+        struct SavedLinkGroup {
+            int id;
+            LinkType type;
+            bool working;
+            int entryId;
+            vector<int> memberIds;
+            vector<shared_ptr<Order>> heldMembers;
+        };
+        vector<SavedLinkGroup> savedLinks(r.getCount(14));
+        for (auto& group : savedLinks) {
+            group.id = r.getRaw<int32_t>();
+            group.type = r.getEnum<LinkType>(LINK_OCO, LINK_BRACKET);
+            group.working = r.getRaw<uint8_t>() != 0;
+            group.entryId = r.getRaw<int32_t>();
+            group.memberIds.resize(r.getCount(4));
+            for (auto& memberId : group.memberIds) {
+                memberId = r.getRaw<int32_t>();
+                if (!group.working) group.heldMembers.push_back(readSnapshotOrder(r));
+                if (!r.ok()) break;
+            }
+            if (!r.ok()) break;
+        }
+
+        vector<pair<string, AllocationRule>> savedRules(r.getCount(7));
+        for (auto& entry : savedRules) {
+            entry.first = r.getShortString();
+            entry.second.policy = r.getEnum<AllocationPolicy>(ALLOC_FIFO, ALLOC_LMM);
+            entry.second.lmmAccount = r.getShortString();
+            entry.second.lmmPercent = r.getRaw<int32_t>();
+            if (!r.ok()) break;
+        }
+
+        if (!r.ok() || !r.atEnd()) {
+            out << "Snapshot load failed: " << path << " is truncated or corrupt" << endl;
+            return false;
+        }
+
+        resetState();
+        circuitBreaker.restore(indexReference, indexValue, marketStatus, haltEnd);
+        for (const auto& instrument : instruments) {
+            setTickSize(instrument.symbol, instrument.tick);
+            if (instrument.hasBand) {
+                setStockPriceBand(instrument.symbol, instrument.reference, instrument.band);
+            }
+        }
+        for (const auto& entry : savedRules) {
+            allocationRules[entry.first] = entry.second;
+        }
+
+        orderMap.reserve(orders.size());
+        for (const auto& order : orders) {
+            orderMap[order->id] = order;
+            unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
+            if (order->variant == STOP || order->variant == STOP_LIMIT) {
+                (order->type == BUY ? buyStops : sellStops)[order->symbol].emplace(order->stopPrice, order);
+            } else {
+                addToBook(order);
+            }
+        }
+
+        engineIndex.setInterval(indexInterval);
+        for (const auto& entry : constituents) {
+            engineIndex.setConstituent(entry.first, entry.second.weight, entry.second.basePrice,
+                                       entry.second.lastPrice);
+        }
+
+        tradeHistory.reserve(trades.size());
+        for (const auto& trade : trades) {
+            recordTrade(trade, true);
+        }
+        engineIndex.restoreEvaluation(indexMovePending, lastIndexEvaluation);
+
+        {
+            lock_guard<mutex> slotsLock(quoteSlotsMutex);
+            for (const auto& quote : savedQuotes) {
+                QuoteSlot& slot = quoteSlots[quote.account][quote.symbol];
+                auto bidIt = orderMap.find(quote.bidId);
+                auto askIt = orderMap.find(quote.askId);
+                slot.bid = bidIt != orderMap.end() ? bidIt->second : nullptr;
+                slot.ask = askIt != orderMap.end() ? askIt->second : nullptr;
+            }
+        }
+
+        for (const auto& saved : savedLinks) {
+            for (const auto& held : saved.heldMembers) {
+                orderMap[held->id] = held;
+            }
+            auto entryIt = orderMap.find(saved.entryId);
+            LinkGroup group;
+            group.type = saved.type;
+            group.working = saved.working;
+            group.entry = entryIt != orderMap.end() ? entryIt->second : nullptr;
+            for (int memberId : saved.memberIds) {
+                auto memberIt = orderMap.find(memberId);
+                if (memberIt != orderMap.end()) group.members.push_back(memberIt->second);
+            }
+            if (group.members.empty() || (!group.working && !group.entry)) continue;
+            const string& symbol = group.members.front()->symbol;
+            unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+            if (group.entry) group.entry->linkGroup = saved.id;
+            for (const auto& member : group.members) member->linkGroup = saved.id;
+            orderLinks[symbol].groups[saved.id] = move(group);
+        }
+
+        for (const auto& definition : spreadDefinitions) {
+            defineSpread(definition.first, definition.second, true);
+        }
+        {
+            lock_guard<mutex> idLock(orderIdMutex);
+            nextOrderId = savedNextId;
+        }
+        for (const auto& entry : orderMap) {
+            clock.catchUp(entry.second->timestamp);
+            publishStatus(*entry.second);
+        }
+        // Average prices of restored orders; leg trades under a spread order's ID are not its own
+        for (const auto& trade : trades) {
+            for (int id : { trade->buyOrderId, trade->sellOrderId }) {
+                auto it = orderMap.find(id);
+                if (it != orderMap.end() && it->second->symbol == trade->symbol) {
+                    orderStatus.addFill(id, trade->quantity, trade->price);
+                }
+            }
+        }
+        if (!trades.empty()) {
+            clock.catchUp(trades.back()->timestamp);
+        }
+        for (const auto& symbol : knownSymbols()) {
+            unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+            onBookChanged(symbol);
+        }
+        if (snapshotPublisher.isOpen()) {
+            snapshotPublisher.publishMarket(circuitBreaker.getStatus(), indexValue);
+        }
+
+        out << "Snapshot loaded: " << instruments.size() << " instruments, " << spreadDefinitions.size()
+            << " spreads, " << orders.size() << " orders, " << trades.size() << " trades";
+        if (!config.deterministic) {
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started);
+            out << " in " << elapsed.count() << " us";
+        }
+        out << endl;
+        return true;
+    }
+
+    void updateIndexValue(double newValue) {
+        updateIndexValue(newValue, clock.nowSeconds());
+    }
+
+    void updateIndexValue(double newValue, time_t currentTime) {
+        bool circuitTriggered = circuitBreaker.updateMarketValue(newValue, currentTime);
+        if (snapshotPublisher.isOpen()) {
+            snapshotPublisher.publishMarket(circuitBreaker.getStatus(), newValue);
+        }
+        if (circuitTriggered) {
+            out << "MARKET CIRCUIT BREAKER TRIGGERED!" << endl;
+            MarketStatus status = circuitBreaker.getStatus();
+            if (status == CIRCUIT_HALT) {
+                time_t endTime = circuitBreaker.getHaltEndTime();
+                struct tm endLocal;
+                localtime_r(&endTime, &endLocal);
+                char buffer[26];
+                strftime(buffer, 26, "%H:%M:%S", &endLocal);
+                out << "Trading halted until: " << buffer << endl;
+            } else if (status == CLOSED) {
+                out << "Trading halted for the remainder of the day." << endl;
+            }
+
+            // A halt pulls every resting order; no symbol lock is held here
+            if (status != NORMAL_TRADING) {
+                massCancel(MassCancelFilter(), "circuit breaker");
+            }
+        }
+    }
+
+    // Market Order - executes immediately at best available price
+    int placeMarketOrder(OrderType type, int quantity, const string& symbol, const string& account = "") {
+        StageScope stage(profiler.get(), MARKET, STAGE_RISK);
+
+        // Check market status
+        MarketStatus marketStatus = circuitBreaker.getStatus();
+        if (marketStatus != NORMAL_TRADING) {
+            out << "Market order rejected: Market is not in normal trading mode." << endl;
+            return -1;
+        }
+
+        // For market orders, price is set to 0 initially (placeholder)
+        stage.next(STAGE_INSERT);
+        auto newOrder = createOrder(type, MARKET, 0.0, quantity, symbol, account);
+        int orderId = newOrder->id;
+
+        stage.next(STAGE_REPORT);
+        out << "Market Order Placed: " << (type == BUY ? "BUY" : "SELL")
+             << " " << quantity << " " << symbol << " at MARKET"
+             << " (ID: " << orderId << ")" << endl;
+
+        // Execute market order immediately
+        stage.next(STAGE_SWEEP);
+        executeMarketOrder(newOrder);
+        stage.next(STAGE_POST_MATCH);
+        afterMatch(symbol);
+
+        return orderId;
+    }
+
+    // IOC (Immediate or Cancel) Order
+    int placeIOCOrder(OrderType type, double price, int quantity, const string& symbol, const string& account = "") {
+        StageScope stage(profiler.get(), IOC, STAGE_RISK);
+
+        // Check market status
+        MarketStatus marketStatus = circuitBreaker.getStatus();
+        if (marketStatus != NORMAL_TRADING) {
+            out << "IOC order rejected: Market is not in normal trading mode." << endl;
+            return -1;
+        }
+
+        stage.next(STAGE_INSERT);
+        auto newOrder = createOrder(type, IOC, price, quantity, symbol, account);
+        int orderId = newOrder->id;
+
+        stage.next(STAGE_REPORT);
+        out << "IOC Order Placed: " << (type == BUY ? "BUY" : "SELL")
+             << " " << quantity << " " << symbol << " at $" << fixed << setprecision(2)
+             << price << " (ID: " << orderId << ")" << endl;
+
+        // Execute IOC order immediately
+        stage.next(STAGE_SWEEP);
+        executeIOCOrder(newOrder);
+        stage.next(STAGE_POST_MATCH);
+        afterMatch(symbol);
+
+        return orderId;
+    }
+
+    // FOK (Fill or Kill) Order
+    int placeFOKOrder(OrderType type, double price, int quantity, const string& symbol, const string& account = "") {
+        StageScope stage(profiler.get(), FOK, STAGE_RISK);
+
+        // Check market status
+        MarketStatus marketStatus = circuitBreaker.getStatus();
+        if (marketStatus != NORMAL_TRADING) {
+            out << "FOK order rejected: Market is not in normal trading mode." << endl;
+            return -1;
+        }
+
+        stage.next(STAGE_INSERT);
+        auto newOrder = createOrder(type, FOK, price, quantity, symbol, account);
+        int orderId = newOrder->id;
+
+        stage.next(STAGE_REPORT);
+        out << "FOK Order Placed: " << (type == BUY ? "BUY" : "SELL")
+             << " " << quantity << " " << symbol << " at $" << fixed << setprecision(2)
+             << price << " (ID: " << orderId << ")" << endl;
+
+        // Execute FOK order
+        stage.next(STAGE_SWEEP);
+        if (!executeFOKOrder(newOrder)) {
+            // If not fully executed, cancel the order
+            newOrder->status = CANCELLED;
+            publishStatus(*newOrder);
+            out << "FOK Order " << orderId << " cancelled: Could not fill completely." << endl;
+        }
+        stage.next(STAGE_POST_MATCH);
+        afterMatch(symbol);
+
+        return orderId;
+    }
+
+    // Regular limit order (enhanced version to include OrderVariant)
+    int placeOrder(OrderType type, double price, int quantity, const string& symbol) {
+        return placeOrder(type, LIMIT, price, quantity, symbol);
+    }
+
+    // General order placement function that handles all order types.
+    // peakSize is the visible slice of an ICEBERG order; the rest is held in reserve.
+    int placeOrder(OrderType type, OrderVariant variant, double price, int quantity, const string& symbol,
+                   int peakSize = 0, const string& account = "") {
+        // For market orders, delegate to dedicated function
+        if (variant == MARKET) {
+            return placeMarketOrder(type, quantity, symbol, account);
+        }
+        // For IOC orders, delegate to dedicated function
+        else if (variant == IOC) {
+            return placeIOCOrder(type, price, quantity, symbol, account);
+        }
+        // For FOK orders, delegate to dedicated function
+        else if (variant == FOK) {
+            return placeFOKOrder(type, price, quantity, symbol, account);
+        }
+        // Stop orders without an explicit trigger use the price as the stop price
+        else if (variant == STOP || variant == STOP_LIMIT) {
+            return placeStopOrder(type, variant, price, price, quantity, symbol, account);
+        }
+
+        // Regular limit order processing
+        StageScope stage(profiler.get(), variant, STAGE_RISK);
+        if (!admitRestingOrder(symbol, price)) {
+            return -1;
+        }
+
+        stage.next(STAGE_INSERT);
+        auto newOrder = createOrder(type, variant, price, quantity, symbol, account, 0, 0.0, peakSize);
+
+        // Insert and match in one hold of the symbol lock
+        {
+            unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(symbol));
+            restAndMatchLocked(newOrder, stage);
+        }
+        stage.next(STAGE_POST_MATCH);
+        afterMatch(symbol);
+
+        return newOrder->id;
+    }
+
+    // Resting limit/iceberg orders for one symbol, placed in arrival order under a single
+    // hold of the symbol lock. Post-match work (stop triggers, spread orders, compaction)
+    // normally runs once at the end; it runs between orders only when a fill may have
+    // triggered stops or spread orders are waiting, so the outcome is the same as placing
+    // the orders one by one.
+    void placeOrderBatch(const vector<OrderRequest>& batch) {
+        if (batch.empty()) {
+            return;
+        }
+
+        const string& symbol = batch.front().symbol;
+        unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(symbol));
+        for (const auto& request : batch) {
+            StageScope stage(profiler.get(), request.variant, STAGE_RISK);
+            if (!admitRestingOrder(symbol, request.price)) {
+                continue;
+            }
+
+            stage.next(STAGE_INSERT);
+            auto newOrder = createOrder(request.type, request.variant, request.price, request.quantity,
+                                        symbol, request.account, request.timestamp, 0.0, request.peakSize);
+
+            size_t tradesBefore = tradeHistory.size();
+            restAndMatchLocked(newOrder, stage);
+
+            if (needsPostMatchNow(symbol, tradesBefore)) {
+                stage.next(STAGE_POST_MATCH);
+                symbolLock.unlock();
+                afterMatch(symbol);
+                symbolLock.lock();
+            }
+        }
+        symbolLock.unlock();
+        StageScope stage(profiler.get(), batch.back().variant, STAGE_POST_MATCH);
+        afterMatch(symbol);
+    }
+
+    // Stop / Stop-Limit Order - rests in the trigger index until the last traded price
+    // crosses stopPrice, then enters the book as a MARKET or LIMIT order respectively
+    int placeStopOrder(OrderType type, OrderVariant variant, double limitPrice, double stopPrice,
+                       int quantity, const string& symbol, const string& account = "") {
+        StageScope stage(profiler.get(), variant, STAGE_RISK);
+        MarketStatus marketStatus = circuitBreaker.getStatus();
+        if (marketStatus != NORMAL_TRADING) {
+            out << "Stop order rejected: Market is not in normal trading mode." << endl;
+            return -1;
+        }
+
+        if (variant == STOP_LIMIT && !isWithinPriceBand(symbol, limitPrice)) {
+            return -1;
+        }
+
+        stage.next(STAGE_INSERT);
+        auto newOrder = createOrder(type, variant, variant == STOP_LIMIT ? limitPrice : 0.0, quantity, symbol, account,
+                                    0, stopPrice);
+        int orderId = newOrder->id;
+
+        {
+            unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(symbol));
+            if (type == BUY) {
+                buyStops[symbol].emplace(stopPrice, newOrder);
+            } else {
+                sellStops[symbol].emplace(stopPrice, newOrder);
+            }
+        }
+
+        stage.next(STAGE_REPORT);
+        out << "Stop Order Placed: " << (type == BUY ? "BUY" : "SELL")
+             << " " << quantity << " " << symbol << " stop $" << fixed << setprecision(2) << stopPrice;
+        if (variant == STOP_LIMIT) {
+            out << " limit $" << limitPrice;
+        }
+        out << " (" << newOrder->getVariantString() << ", ID: " << orderId << ")" << endl;
+
+        // The stop may already be crossed by the current last price
+        stage.next(STAGE_POST_MATCH);
+        afterMatch(symbol);
+
+        return orderId;
+    }
+
+    // Replace an account's bid and ask in many symbols with one message. Each side reuses
+    // the account's live quote order for that symbol in place: same ID, no new allocation,
+    // and it keeps time priority when only its size shrinks. Each book is updated and
+    // matched once under one hold of its lock. The message gets one aggregated ack.
+    void massQuote(const string& account, const vector<QuoteRequest>& quotes) {
+        int placed = 0, updated = 0, pulled = 0, rejected = 0;
+        size_t tradesBefore = tradeHistory.size();
+
+        for (const auto& quote : quotes) {
+            QuoteSlot& slot = quoteSlotFor(account, quote.symbol);
+            {
+                unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(quote.symbol));
+                if (quote.bidQuantity > 0 && quote.askQuantity > 0 && quote.bidPrice >= quote.askPrice) {
+                    out << "Quote rejected: " << quote.symbol << " bid " << quote.bidPrice
+                         << " crosses ask " << quote.askPrice << endl;
+                    pulled += pullQuote(slot.bid) + pullQuote(slot.ask);
+                    rejected += 2;
+                } else {
+                    for (auto side : { BUY, SELL }) {
+                        shared_ptr<Order>& order = side == BUY ? slot.bid : slot.ask;
+                        double price = side == BUY ? quote.bidPrice : quote.askPrice;
+                        int quantity = side == BUY ? quote.bidQuantity : quote.askQuantity;
+                        if (quantity <= 0) {
+                            pulled += pullQuote(order);
+                        } else if (!admitRestingOrder(quote.symbol, price)) {
+                            pulled += pullQuote(order);
+                            ++rejected;
+                        } else if (!isLiveQuote(order)) {
+                            order = createOrder(side, LIMIT, price, quantity, quote.symbol, account);
+                            addToBook(order);
+                            ++placed;
+                        } else {
+                            requote(order, price, quantity);
+                            ++updated;
+                        }
+                    }
+                }
+                matchOrdersLocked(quote.symbol);
+            }
+            afterMatch(quote.symbol);
+        }
+
+        out << "Mass Quote Ack: " << account << " " << quotes.size() << " symbols, " << placed
+             << " placed, " << updated << " updated, " << pulled << " pulled, " << rejected << " rejected, "
+             << tradeHistory.size() - tradesBefore << " trades" << endl;
+    }
+
+    // One-cancels-other: resting and stop legs on one side of one symbol, entered together
+    // under one hold of the symbol lock. A fill on any leg takes the same quantity off every
+    // other leg within the lock hold of that fill; cancelling a leg cancels the group.
+    // Returns the group ID (the first leg's ID), or -1 if the group is rejected.
+    int placeOCO(const vector<OrderRequest>& legs) {
+        if (legs.size() < 2) {
+            out << "OCO rejected: at least two legs are needed" << endl;
+            return -1;
+        }
+        if (!validLinkedOrders(legs, legs.front().type, "OCO")) {
+            return -1;
+        }
+        for (const auto& leg : legs) {
+            if (!admitLinkedOrder(leg)) return -1;
+        }
+
+        const string& symbol = legs.front().symbol;
+        vector<shared_ptr<Order>> orders;
+        for (const auto& leg : legs) {
+            orders.push_back(createLinkedOrder(leg));
+        }
+        int groupId = orders.front()->id;
+
+        {
+            unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(symbol));
+            LinkGroup& group = orderLinks[symbol].groups[groupId];
+            group.type = LINK_OCO;
+            group.members = orders;
+            group.working = true;
+
+            out << "OCO Placed: " << (orders.front()->type == BUY ? "BUY" : "SELL") << " " << symbol << ", legs";
+            for (size_t i = 0; i < orders.size(); ++i) {
+                orders[i]->linkGroup = groupId;
+                workLinkedOrder(orders[i]);
+                out << (i ? ", " : " ") << describeLinkedOrder(*orders[i]);
+            }
+            out << " (group " << groupId << ")" << endl;
+            matchOrdersLocked(symbol);
+        }
+        afterMatch(symbol);
+        return groupId;
+    }
+
+    // Bracket: a LIMIT or ICEBERG entry with exits on the other side, typically a take-profit
+    // LIMIT and a stop-loss STOP of the entry's size. The exits are held until the entry is
+    // done - filled, or cancelled after a partial fill - and are then released, sized to what
+    // the entry filled, within the lock hold of that fill or cancel, to work as an OCO group.
+    // Returns the group ID (the entry's ID), or -1 if the bracket is rejected.
+    int placeBracket(const OrderRequest& entry, const vector<OrderRequest>& exits) {
+        if (entry.variant != LIMIT && entry.variant != ICEBERG) {
+            out << "Bracket rejected: the entry must be a LIMIT or ICEBERG order" << endl;
+            return -1;
+        }
+        if (exits.empty() || !validLinkedOrders(exits, entry.type == BUY ? SELL : BUY, "Bracket") ||
+            exits.front().symbol != entry.symbol) {
+            out << "Bracket rejected: exits must be on the other side of the entry's symbol" << endl;
+            return -1;
+        }
+        for (const auto& exit : exits) {
+            if (exit.quantity != entry.quantity) {
+                out << "Bracket rejected: exits must be the size of the entry" << endl;
+                return -1;
+            }
+            if (!admitLinkedOrder(exit)) return -1;
+        }
+
+        StageScope stage(profiler.get(), entry.variant, STAGE_RISK);
+        if (!admitRestingOrder(entry.symbol, entry.price)) {
+            return -1;
+        }
+
+        stage.next(STAGE_INSERT);
+        auto entryOrder = createLinkedOrder(entry);
+        vector<shared_ptr<Order>> exitOrders;
+        for (const auto& exit : exits) {
+            exitOrders.push_back(createLinkedOrder(exit));
+        }
+        int groupId = entryOrder->id;
+
+        {
+            unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(entry.symbol));
+            LinkGroup& group = orderLinks[entry.symbol].groups[groupId];
+            group.type = LINK_BRACKET;
+            group.entry = entryOrder;
+            group.members = exitOrders;
+            group.working = false;
+            entryOrder->linkGroup = groupId;
+
+            out << "Bracket Placed: entry " << groupId << ", exits";
+            for (size_t i = 0; i < exitOrders.size(); ++i) {
+                exitOrders[i]->linkGroup = groupId;
+                out << (i ? ", " : " ") << describeLinkedOrder(*exitOrders[i]);
+            }
+            out << " held until the entry fills" << endl;
+            restAndMatchLocked(entryOrder, stage);
+        }
+        stage.next(STAGE_POST_MATCH);
+        afterMatch(entry.symbol);
+        return groupId;
+    }
+
+    void matchOrders(const string& symbol) {
+        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+        matchOrdersLocked(symbol);
+    }
+
+private:
+    // Uncross the book under the symbol's allocation policy; the caller holds the symbol's
+    // unique lock. incoming is the order that just entered the book, when there is one.
+    void matchOrdersLocked(const string& symbol, const Order* incoming = nullptr) {
+        const AllocationRule* rule = allocationRuleFor(symbol);
+        if (rule && rule->policy == ALLOC_PRO_RATA) {
+            uncrossByLevel<ProRataAllocation>(symbol, *rule, incoming);
+        } else if (rule && rule->policy == ALLOC_LMM) {
+            uncrossByLevel<LmmAllocation>(symbol, *rule, incoming);
+        } else {
+            uncrossFifo(symbol);
+        }
+    }
+
+    // Null for plain price-time instruments, which is every one until a rule is set
+    const AllocationRule* allocationRuleFor(const string& symbol) const {
+        if (allocationRules.empty()) return nullptr;
+        auto it = allocationRules.find(symbol);
+        if (it == allocationRules.end() || it->second.policy == ALLOC_FIFO) return nullptr;
+        return &it->second;
+    }
+
+    // Price-time uncross: the front orders of the best levels trade until they no longer cross
+    void uncrossFifo(const string& symbol) {
+        auto buyIt = buyOrders.find(symbol);
+        auto sellIt = sellOrders.find(symbol);
+        if (buyIt == buyOrders.end() || sellIt == sellOrders.end()) {
+            onBookChanged(symbol);
+            return;
+        }
+        auto& buyBook = buyIt->second;
+        auto& sellBook = sellIt->second;
+
+        bool matchFound;
+        do {
+            matchFound = false;
+
+            // Check if we have any buy and sell orders
+            if (!buyBook.empty() && !sellBook.empty()) {
+                // Get best buy price (highest) and best sell price (lowest)
+                auto bestBuyIt = buyBook.begin();
+                auto bestSellIt = sellBook.begin();
+
+                // If the best buy price >= best sell price, we have a match
+                if (bestBuyIt->first >= bestSellIt->first &&
+                    !bestBuyIt->second.empty() && !bestSellIt->second.empty()) {
+
+                    // Get the oldest orders at these price levels
+                    auto buyOrder = bestBuyIt->second.front();
+                    auto sellOrder = bestSellIt->second.front();
+
+                    // Continue only if both orders are active
+                    if (buyOrder->status != CANCELLED && sellOrder->status != CANCELLED) {
+                        // Determine match quantity and execute the trade
+                        int matchQuantity = min(buyOrder->getDisplayedQuantity(), sellOrder->getDisplayedQuantity());
+                        double tradePrice = sellOrder->price; // Match at sell price (taker pays)
+
+                        // Record the trade
+                        auto trade = make_shared<Trade>(buyOrder->id, sellOrder->id, symbol, tradePrice, matchQuantity,
+                                                        clock.now(), buyOrder->account, sellOrder->account);
+                        recordTrade(trade);
+
+                        // Update order quantities and status
+                        applyFill(buyOrder, matchQuantity, tradePrice);
+                        applyFill(sellOrder, matchQuantity, tradePrice);
+
+                        out << "\nTrade Executed: " << matchQuantity << " " << symbol
+                             << " at $" << fixed << setprecision(2) << tradePrice
+                             << " (Buy: " << buyOrder->id << ", Sell: " << sellOrder->id << ")" << endl;
+
+                        // Clean up fully filled orders and refresh exhausted iceberg slices
+                        settleFrontOrder(bestBuyIt->second, buyOrder);
+                        if (bestBuyIt->second.empty()) {
+                            buyBook.erase(bestBuyIt);
+                        }
+
+                        settleFrontOrder(bestSellIt->second, sellOrder);
+                        if (bestSellIt->second.empty()) {
+                            sellBook.erase(bestSellIt);
+                        }
+
+                        matchFound = true;
+                    } else {
+                        // Remove cancelled orders
+                        if (buyOrder->status == CANCELLED) {
+                            bestBuyIt->second.pop_front();
+                            if (bestBuyIt->second.empty()) {
+                                buyBook.erase(bestBuyIt);
+                            }
+                        }
+
+                        if (sellOrder->status == CANCELLED) {
+                            bestSellIt->second.pop_front();
+                            if (bestSellIt->second.empty()) {
+                                sellBook.erase(bestSellIt);
+                            }
+                        }
+
+                        matchFound = true; // Continue checking after removing cancelled orders
+                    }
+                }
+            }
+        } while (matchFound);
+
+        onBookChanged(symbol);
+    }
+
+    // Uncross under a level-at-once policy: the incoming order, or else the later arrival of
+    // the two front orders, is the aggressor, and its displayed slice is allocated across
+    // the other side's best level
+    template <typename Policy>
+    void uncrossByLevel(const string& symbol, const AllocationRule& rule, const Order* incoming) {
+        auto buyIt = buyOrders.find(symbol);
+        auto sellIt = sellOrders.find(symbol);
+        if (buyIt == buyOrders.end() || sellIt == sellOrders.end()) {
+            onBookChanged(symbol);
+            return;
+        }
+        auto& buyBook = buyIt->second;
+        auto& sellBook = sellIt->second;
+
+        while (!buyBook.empty() && !sellBook.empty()) {
+            auto bestBuyIt = buyBook.begin();
+            auto bestSellIt = sellBook.begin();
+            if (bestBuyIt->first < bestSellIt->first) break;
+
+            // Remove cancelled orders at the front first, as the FIFO loop does
+            if (popCancelledFront(buyBook, bestBuyIt) || popCancelledFront(sellBook, bestSellIt)) continue;
+
+            auto buyOrder = bestBuyIt->second.front();
+            auto sellOrder = bestSellIt->second.front();
+            bool buyAggressor;
+            if (incoming == buyOrder.get() || incoming == sellOrder.get()) {
+                buyAggressor = incoming == buyOrder.get();
+            } else {
+                buyAggressor = sellOrder->timestamp < buyOrder->timestamp ||
+                               (sellOrder->timestamp == buyOrder->timestamp && sellOrder->id < buyOrder->id);
+            }
+
+            // Match at sell price (taker pays), as in the FIFO loop
+            int executed;
+            if (buyAggressor) {
+                executed = allocateLevel<Policy>(buyOrder, true, bestSellIt->second, sellOrder->price,
+                                                 buyOrder->getDisplayedQuantity(), rule, "");
+                settleFrontOrder(bestBuyIt->second, buyOrder);
+            } else {
+                executed = allocateLevel<Policy>(sellOrder, true, bestBuyIt->second, sellOrder->price,
+                                                 sellOrder->getDisplayedQuantity(), rule, "");
+                settleFrontOrder(bestSellIt->second, sellOrder);
+            }
+            if (bestBuyIt->second.empty()) buyBook.erase(bestBuyIt);
+            if (bestSellIt->second.empty()) sellBook.erase(bestSellIt);
+            if (executed == 0) break;
+        }
+
+        onBookChanged(symbol);
+    }
+
+    // Pop a cancelled front order, dropping the level if that empties it
+    template <typename Book>
+    static bool popCancelledFront(Book& book, typename Book::iterator levelIt) {
+        if (levelIt->second.front()->status != CANCELLED) return false;
+        levelIt->second.pop_front();
+        if (levelIt->second.empty()) book.erase(levelIt);
+        return true;
+    }
+
+    // Market status and price band checks shared by every resting order
+    bool admitRestingOrder(const string& symbol, double price) {
+        // Check if market is halted due to circuit breaker
+        MarketStatus marketStatus = circuitBreaker.getStatus();
+        if (marketStatus == CIRCUIT_HALT || marketStatus == CLOSED) {
+            out << "Order rejected: Market is currently halted due to circuit breaker." << endl;
+            return false;
+        }
+
+        // Check if pre-open auction is in progress (would have different order matching)
+        if (marketStatus == PRE_OPEN_AUCTION) {
+            out << "Order queued for pre-open auction session." << endl;
+            // In a real system, this would queue the order for the auction matching
+            // For simplicity, we'll just reject it
+            return false;
+        }
+
+        // Check stock-specific price bands
+        if (!isWithinPriceBand(symbol, price)) {
+            return false;
+        }
+
+        auto tickIt = tickSizes.find(symbol);
+        if (tickIt != tickSizes.end()) {
+            double ticks = price / tickIt->second;
+            if (fabs(ticks - round(ticks)) > PRICE_EPSILON) {
+                out << "Order rejected: Price " << price << " is not a multiple of the tick size "
+                     << tickIt->second << " for " << symbol << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // New order with the next ID, indexed in orderMap and journaled. Only this step takes
+    // orderIdMutex, so matching and post-match work never run under it. A peak size only
+    // applies to an ICEBERG order larger than its peak.
+    shared_ptr<Order> createOrder(OrderType type, OrderVariant variant, double price, int quantity,
+                                  const string& symbol, const string& account, int64_t timestamp = 0,
+                                  double stopPrice = 0.0, int peakSize = 0) {
+        lock_guard<mutex> idLock(orderIdMutex);
+        int orderId = nextOrderId++;
+        auto newOrder = make_shared<Order>(orderId, type, variant, price, quantity, symbol,
+                                           timestamp ? timestamp : clock.now());
+        newOrder->account = account;
+        newOrder->stopPrice = stopPrice;
+        if (variant == ICEBERG && peakSize > 0 && peakSize < quantity) {
+            newOrder->peakSize = peakSize;
+            newOrder->replenish();
+        }
+        orderMap[orderId] = newOrder;
+        publishStatus(*newOrder);
+        return newOrder;
+    }
+
+    // An order as the archive shows it: its current fields and how it stands. Caller holds
+    // orderIdMutex.
+    ArchivedOrder archiveRow(const Order& order) {
+        OrderRecord entry{ order.id, order.type, order.variant, order.price, order.quantity, order.stopPrice,
+                           order.peakSize, order.timestamp, intern(order.symbol), intern(order.account) };
+        return { entry, order.status, order.filled_quantity };
+    }
+
+    // Caller holds orderIdMutex
+    uint32_t intern(const string& name) {
+        auto it = internedIds.find(name);
+        if (it == internedIds.end()) {
+            it = internedIds.emplace(name, static_cast<uint32_t>(internedNames.size())).first;
+            internedNames.push_back(name);
+        }
+        return it->second;
+    }
+
+    // Insert a resting order, acknowledge it and match, moving `stage` along. Caller holds
+    // the symbol lock.
+    void restAndMatchLocked(const shared_ptr<Order>& newOrder, StageScope& stage) {
+        addToBook(newOrder);
+
+        stage.next(STAGE_REPORT);
+        out << "Order Placed: " << (newOrder->type == BUY ? "BUY" : "SELL")
+             << " " << newOrder->quantity << " " << newOrder->symbol << " at $" << fixed << setprecision(2)
+             << newOrder->price << " (" << newOrder->getVariantString();
+        if (newOrder->peakSize > 0) {
+            out << ", Peak: " << newOrder->peakSize;
+        }
+        out << ", ID: " << newOrder->id << ")" << endl;
+
+        stage.next(STAGE_SWEEP);
+        matchOrdersLocked(newOrder->symbol, newOrder.get());
+    }
+
+    // Whether a batched order left work that the next order in the batch must not overtake
+    bool needsPostMatchNow(const string& symbol, size_t tradesBefore) {
+        {
+            lock_guard<mutex> spreadLock(spreadMutex);
+            if (!pendingSpreads.empty()) {
+                return true;
+            }
+        }
+        // A move held back by the interval may fall due between any two orders
+        if (engineIndex.pending(clock.now())) {
+            return true;
+        }
+        if (tradeHistory.size() == tradesBefore) {
+            return false;
+        }
+        for (const auto* stopsBySymbol : { &buyStops, &sellStops }) {
+            auto it = stopsBySymbol->find(symbol);
+            if (it != stopsBySymbol->end() && !it->second.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    QuoteSlot& quoteSlotFor(const string& account, const string& symbol) {
+        lock_guard<mutex> slotsLock(quoteSlotsMutex);
+        return quoteSlots[account][symbol];
+    }
+
+    // A quote side still resting with quantity left; a filled or cancelled one gets a new order
+    static bool isLiveQuote(const shared_ptr<Order>& order) {
+        return order && order->resting && !isDead(order);
+    }
+
+    // Cancel a quote side if it is live and clear the slot. Caller holds the symbol lock.
+    int pullQuote(shared_ptr<Order>& order) {
+        bool live = isLiveQuote(order);
+        if (live) {
+            markCancelled(order);
+        }
+        order.reset();
+        return live ? 1 : 0;
+    }
+
+    // Move a live quote order to a new price and size (the open quantity it should show). A
+    // smaller size at the same price is applied where the order stands; anything else
+    // re-queues it at the back of its level. What it has already filled stays on it.
+    // Caller holds the symbol lock.
+    void requote(const shared_ptr<Order>& order, double price, int quantity) {
+        int remaining = order->getRemainingQuantity();
+        if (price == order->price && quantity <= remaining) {
+            if (quantity < remaining) {
+                order->quantity -= remaining - quantity;
+                publishStatus(*order);
+                touchDepth(order->symbol, order->type, order->price);
+                ladderAdd(order->symbol, order->type, order->price, quantity - remaining);
+            }
+            return;
+        }
+
+        unlinkFromBook(order);
+        order->price = price;
+        order->quantity = order->filled_quantity + quantity;
+        order->status = order->filled_quantity > 0 ? PARTIALLY_FILLED : ACTIVE;
+        order->timestamp = clock.now();
+        publishStatus(*order);
+        addToBook(order);
+    }
+
+    // Linked legs: resting or stop variants with a size, all on one side of one symbol
+    bool validLinkedOrders(const vector<OrderRequest>& orders, OrderType side, const char* kind) {
+        for (const auto& order : orders) {
+            if (order.variant == MARKET || order.variant == IOC || order.variant == FOK) {
+                out << kind << " rejected: linked orders must be LIMIT, ICEBERG, STOP or STOP_LIMIT" << endl;
+                return false;
+            }
+            if (order.quantity <= 0 || order.symbol != orders.front().symbol || order.type != side) {
+                out << kind << " rejected: linked orders must be on one side of one symbol" << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Risk checks for one leg, run for every leg before any is created so a group is all or
+    // nothing
+    bool admitLinkedOrder(const OrderRequest& request) {
+        if (request.variant == STOP || request.variant == STOP_LIMIT) {
+            if (circuitBreaker.getStatus() != NORMAL_TRADING) {
+                out << "Stop order rejected: Market is not in normal trading mode." << endl;
+                return false;
+            }
+            return request.variant == STOP || isWithinPriceBand(request.symbol, request.price);
+        }
+        return admitRestingOrder(request.symbol, request.price);
+    }
+
+    shared_ptr<Order> createLinkedOrder(const OrderRequest& request) {
+        bool stop = request.variant == STOP || request.variant == STOP_LIMIT;
+        return createOrder(request.type, request.variant, request.variant == STOP ? 0.0 : request.price,
+                           request.quantity, request.symbol, request.account, 0, stop ? request.stopPrice : 0.0,
+                           request.peakSize);
+    }
+
+    static string describeLinkedOrder(const Order& order) {
+        ostringstream text;
+        text << fixed << setprecision(2) << order.id << " " << order.getVariantString() << " "
+             << order.getRemainingQuantity();
+        if (order.variant == STOP || order.variant == STOP_LIMIT) {
+            text << " stop $" << order.stopPrice;
+        }
+        if (order.variant != STOP) {
+            text << " @ $" << order.price;
+        }
+        return text.str();
+    }
+
+    // Put a linked order to work: a stop goes to the trigger index, anything else rests.
+    // Caller holds the symbol lock.
+    void workLinkedOrder(const shared_ptr<Order>& order) {
+        if (order->variant == STOP || order->variant == STOP_LIMIT) {
+            (order->type == BUY ? buyStops : sellStops)[order->symbol].emplace(order->stopPrice, order);
+        } else {
+            addToBook(order);
+        }
+    }
+
+    LinkGroup* findLinkGroup(const Order& order) {
+        auto symbolIt = orderLinks.find(order.symbol);
+        if (symbolIt == orderLinks.end()) {
+            return nullptr;
+        }
+        auto groupIt = symbolIt->second.groups.find(order.linkGroup);
+        return groupIt == symbolIt->second.groups.end() ? nullptr : &groupIt->second;
+    }
+
+    // Nothing left to work: filled, cancelled, or a triggered stop that has already swept
+    static bool linkedOrderDone(const shared_ptr<Order>& order) {
+        return isDead(order) || order->getRemainingQuantity() <= 0 || order->variant == MARKET;
+    }
+
+    // A linked order traded. The other members of a working group give up the same quantity
+    // right away; a bracket entry that is now filled queues its exits for release. Caller
+    // holds the symbol lock.
+    void onLinkedFill(const shared_ptr<Order>& order, int quantity) {
+        LinkGroup* group = findLinkGroup(*order);
+        if (!group) {
+            return;
+        }
+        if (order == group->entry) {
+            if (order->getRemainingQuantity() == 0) {
+                orderLinks[order->symbol].releases.push_back(order->linkGroup);
+            }
+            return;
+        }
+        for (const auto& member : group->members) {
+            if (member != order) {
+                reduceLinkedOrder(member, quantity);
+            }
+        }
+        dropLinkGroupIfDone(order->symbol, order->linkGroup);
+    }
+
+    // A linked order was cancelled. A bracket entry that filled in part releases its exits
+    // for that part; otherwise the other members are cancelled too, and an entry still
+    // working carries on without exits. Caller holds the symbol lock.
+    void onLinkedCancel(const shared_ptr<Order>& order) {
+        LinkGroup* group = findLinkGroup(*order);
+        if (!group) {
+            return;
+        }
+        if (order == group->entry && order->filled_quantity > 0) {
+            orderLinks[order->symbol].releases.push_back(order->linkGroup);
+            return;
+        }
+        cancelLinkGroup(order->symbol, order->linkGroup, false);
+    }
+
+    // Take quantity off a linked order's open size; one left with nothing is cancelled.
+    // Caller holds the symbol lock.
+    void reduceLinkedOrder(const shared_ptr<Order>& order, int quantity) {
+        if (linkedOrderDone(order)) {
+            return;
+        }
+        int remaining = order->getRemainingQuantity();
+        if (quantity < remaining) {
+            order->quantity -= quantity;
+            publishStatus(*order);
+            if (order->resting) {
+                touchDepth(order->symbol, order->type, order->price);
+                ladderAdd(order->symbol, order->type, order->price, -quantity);
+            }
+            out << "Linked Order " << order->id << " reduced by " << quantity << " to "
+                << order->getRemainingQuantity() << endl;
+        } else {
+            order->linkGroup = 0;
+            markCancelled(order);
+            out << "Linked Order " << order->id << " cancelled: its sibling filled" << endl;
+        }
+    }
+
+    // Cancel what is left of a group's members (and its entry, when withEntry) and forget
+    // the group. Caller holds the symbol lock.
+    void cancelLinkGroup(const string& symbol, int groupId, bool withEntry) {
+        SymbolLinks& links = orderLinks[symbol];
+        auto groupIt = links.groups.find(groupId);
+        if (groupIt == links.groups.end()) {
+            return;
+        }
+        LinkGroup group = move(groupIt->second);
+        links.groups.erase(groupIt);
+        links.releases.erase(remove(links.releases.begin(), links.releases.end(), groupId), links.releases.end());
+
+        if (group.entry) {
+            group.entry->linkGroup = 0;
+            if (withEntry && !isDead(group.entry)) {
+                markCancelled(group.entry);
+            }
+        }
+        for (const auto& member : group.members) {
+            member->linkGroup = 0;
+        }
+        for (const auto& member : group.members) {
+            if (!linkedOrderDone(member)) {
+                markCancelled(member);
+                out << "Linked Order " << member->id << " cancelled with group " << groupId << endl;
+            }
+        }
+    }
+
+    void dropLinkGroupIfDone(const string& symbol, int groupId) {
+        SymbolLinks& links = orderLinks[symbol];
+        auto groupIt = links.groups.find(groupId);
+        if (groupIt == links.groups.end() || !groupIt->second.working) {
+            return;
+        }
+        for (const auto& member : groupIt->second.members) {
+            if (!linkedOrderDone(member)) return;
+        }
+        for (const auto& member : groupIt->second.members) {
+            member->linkGroup = 0;
+        }
+        links.groups.erase(groupIt);
+    }
+
+    // Start the exits of brackets whose entry is done, sized to what the entry filled. Runs
+    // from onBookChanged, so within the lock hold of the fill or cancel that finished the
+    // entry. Returns whether any exit went to work.
+    bool releaseBracketExits(const string& symbol) {
+        auto symbolIt = orderLinks.find(symbol);
+        if (symbolIt == orderLinks.end() || symbolIt->second.releases.empty()) {
+            return false;
+        }
+        vector<int> releases;
+        releases.swap(symbolIt->second.releases);
+
+        bool released = false;
+        for (int groupId : releases) {
+            auto groupIt = symbolIt->second.groups.find(groupId);
+            if (groupIt == symbolIt->second.groups.end() || groupIt->second.working) continue;
+            LinkGroup& group = groupIt->second;
+            int quantity = group.entry->filled_quantity;
+            group.entry->linkGroup = 0;
+            group.entry.reset();
+            group.working = true;
+
+            for (const auto& exit : group.members) {
+                if (isDead(exit)) continue;
+                exit->quantity = quantity;
+                exit->timestamp = clock.now();
+                publishStatus(*exit);
+                if (exit->peakSize > 0) {
+                    exit->replenish();
+                }
+                workLinkedOrder(exit);
+                released = true;
+                out << "Bracket Exit Released: " << describeLinkedOrder(*exit) << " (group " << groupId << ")"
+                    << endl;
+            }
+            dropLinkGroupIfDone(symbol, groupId);
+        }
+        return released;
+    }
+
+    // Linked orders a mass cancel dropped without markCancelled (whole levels, stops) get the
+    // same follow-up a single cancel would. Caller holds the symbol lock.
+    void onLinkedCancels(const vector<shared_ptr<Order>>& cancelledOrders) {
+        for (const auto& order : cancelledOrders) {
+            onLinkedCancel(order);
+        }
+    }
+
+public:
+    bool cancelOrder(int orderId) {
+        // Find the order first
+        auto it = orderMap.find(orderId);
+        if (it == orderMap.end()) {
+            // A finished order pruned from the map still answers as it did before pruning
+            OrderStatusView view;
+            if (!orderStatus.read(orderId, view)) {
+                out << "Order not found: " << orderId << endl;
+                return false;
+            }
+            if (view.status == FILLED) {
+                out << "Cannot cancel filled order: " << orderId << endl;
+                return false;
+            }
+            out << "Order cancelled: " << orderId << endl;
+            return true;
+        }
+
+        auto order = it->second;
+
+        {
+            // Lock the specific symbol
+            unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
+
+            if (order->status == FILLED) {
+                out << "Cannot cancel filled order: " << orderId << endl;
+                return false;
+            }
+
+            // Mark as cancelled
+            markCancelled(order);
+            onBookChanged(order->symbol);
+        }
+
+        out << "Order cancelled: " << orderId << endl;
+        maybeCompact(order->symbol);
+        return true;
+    }
+
+    // Reclaim tombstones, empty levels and retired orders in every book
+    void compactAll() {
+        size_t reclaimed = 0;
+        for (const auto& symbol : knownSymbols()) {
+            reclaimed += compactSymbol(symbol);
+        }
+        size_t retired = pruneOrderMap();
+        out << "Compaction: " << reclaimed << " book entries reclaimed, " << retired
+            << " orders retired from the ID map" << endl;
+    }
+
+    // Orders created so far, accepted or not
+    int ordersCreated() {
+        lock_guard<mutex> idLock(orderIdMutex);
+        return nextOrderId - 1;
+    }
+
+    // Trade count, volume and notional per symbol over the whole trade history
+    map<string, TradeStats> summarizeTrades() const {
+        map<string, TradeStats> stats;
+        for (const auto& trade : tradeHistory) {
+            TradeStats& entry = stats[trade->symbol];
+            ++entry.trades;
+            entry.volume += trade->quantity;
+            entry.notional += trade->price * trade->quantity;
+        }
+        return stats;
+    }
+
+    // Idle-time pass: an index move the interval held back, then only books that have
+    // collected tombstones since their last compaction. Replay time stands still while
+    // idle, so there the move waits for the next event as it would without the pause.
+    void compactIdle() {
+        if (!config.deterministic) {
+            evaluateIndex();
+        }
+        if (config.compactAfterCancels == 0 || tombstoneCounts.empty()) {
+            return;
+        }
+        vector<string> symbols;
+        for (const auto& entry : tombstoneCounts) symbols.push_back(entry.first);
+        for (const auto& symbol : symbols) {
+            compactSymbol(symbol);
+        }
+        pruneOrderMap();
+    }
+
+    // Estimated footprint per instrument: live and dead book entries, levels, stops, trades
+    void printMemory(const string& symbolFilter) {
+        vector<string> symbols;
+        if (!symbolFilter.empty()) {
+            symbols.push_back(symbolFilter);
+        } else {
+            symbols = knownSymbols();
+        }
+
+        unordered_map<string, size_t> tradeCounts;
+        for (const auto& trade : tradeHistory) {
+            ++tradeCounts[trade->symbol];
+        }
+
+        out << "\nMemory Usage:" << endl;
+        out << "------------------------" << endl;
+        size_t totalBytes = 0;
+        for (const auto& symbol : symbols) {
+            shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+            BookMemory memory;
+            auto buyIt = buyOrders.find(symbol);
+            if (buyIt != buyOrders.end()) measureBook(buyIt->second, memory);
+            auto sellIt = sellOrders.find(symbol);
+            if (sellIt != sellOrders.end()) measureBook(sellIt->second, memory);
+            for (const auto* stopsBySymbol : { &buyStops, &sellStops }) {
+                auto stopIt = stopsBySymbol->find(symbol);
+                if (stopIt == stopsBySymbol->end()) continue;
+                memory.stops += stopIt->second.size();
+                memory.bytes += stopIt->second.size() * (sizeof(pair<const double, shared_ptr<Order>>) + TREE_NODE_OVERHEAD + ORDER_BYTES);
+            }
+            for (const auto* ladders : { &buyLadders, &sellLadders }) {
+                auto ladderIt = ladders->find(symbol);
+                if (ladderIt != ladders->end()) memory.bytes += ladderIt->second.size() * sizeof(int64_t);
+            }
+            size_t trades = tradeCounts[symbol];
+            size_t tradeBytes = trades * (sizeof(Trade) + CONTROL_BLOCK_BYTES + sizeof(shared_ptr<Trade>));
+            totalBytes += memory.bytes + tradeBytes;
+
+            out << symbol << ": " << memory.liveOrders << " live orders, " << memory.deadOrders << " tombstones, "
+                << memory.levels << " levels, " << memory.stops << " stops, ~" << memory.bytes << " book bytes, "
+                << trades << " trades (~" << tradeBytes << " bytes)" << endl;
+        }
+
+        size_t retired = 0;
+        {
+            lock_guard<mutex> idLock(orderIdMutex);
+            for (const auto& entry : orderMap) {
+                if (isRetired(*entry.second)) ++retired;
+            }
+        }
+        out << "Total: ~" << totalBytes << " bytes across " << symbols.size() << " instruments; order map "
+            << orderMap.size() << " entries (" << retired << " retired)" << endl;
+    }
+
+    // Cancel every resting and pending stop order that matches the filter, taking each
+    // book's lock once. Without an account filter whole price levels are dropped at once;
+    // otherwise matching orders are cancelled in place. Stops are filtered by stop price.
+    int massCancel(const MassCancelFilter& filter, const char* reason = nullptr) {
+        vector<string> symbols;
+        if (!filter.symbol.empty()) {
+            symbols.push_back(filter.symbol);
+        } else {
+            symbols = knownSymbols();
+        }
+
+        int cancelled = 0;
+        int levelsDropped = 0;
+        vector<shared_ptr<Order>> linkedCancels;
+        for (const auto& symbol : symbols) {
+            unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+            int before = cancelled;
+            linkedCancels.clear();
+
+            if (filter.anySide || filter.side == BUY) {
+                auto it = buyOrders.find(symbol);
+                if (it != buyOrders.end()) {
+                    // Bids are ordered high to low
+                    auto& book = it->second;
+                    cancelled += cancelLevels(book, book.lower_bound(filter.maxPrice),
+                                              book.upper_bound(filter.minPrice), filter, levelsDropped,
+                                              linkedCancels);
+                }
+            }
+            if (filter.anySide || filter.side == SELL) {
+                auto it = sellOrders.find(symbol);
+                if (it != sellOrders.end()) {
+                    auto& book = it->second;
+                    cancelled += cancelLevels(book, book.lower_bound(filter.minPrice),
+                                              book.upper_bound(filter.maxPrice), filter, levelsDropped,
+                                              linkedCancels);
+                }
+            }
+
+            for (auto* stopsBySymbol : { &buyStops, &sellStops }) {
+                auto stopIt = stopsBySymbol->find(symbol);
+                if (stopIt == stopsBySymbol->end()) continue;
+                auto& stops = stopIt->second;
+                for (auto it = stops.lower_bound(filter.minPrice);
+                     it != stops.end() && it->first <= filter.maxPrice;) {
+                    if (filter.matchesOrder(*it->second)) {
+                        if (it->second->status != CANCELLED) {
+                            it->second->status = CANCELLED;
+                            publishStatus(*it->second);
+                            if (it->second->linkGroup) linkedCancels.push_back(it->second);
+                            ++cancelled;
+                        }
+                        it = stops.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+
+            if (cancelled != before) {
+                onLinkedCancels(linkedCancels);
+                onBookChanged(symbol);
+            }
+        }
+
+        out << "Mass Cancel";
+        if (reason) out << " (" << reason << ")";
+        out << ": " << cancelled << " orders cancelled, " << levelsDropped << " levels removed [symbol="
+            << (filter.symbol.empty() ? "*" : filter.symbol)
+            << " side=" << (filter.anySide ? "*" : filter.side == BUY ? "BUY" : "SELL")
+            << " account=" << (filter.account.empty() ? "*" : filter.account);
+        if (!filter.coversAllPrices()) {
+            out << " price=" << fixed << setprecision(2) << filter.minPrice << "-";
+            if (filter.maxPrice == numeric_limits<double>::max()) out << "*";
+            else out << filter.maxPrice;
+        }
+        out << "]" << endl;
+        return cancelled;
+    }
+
+    void printOrderBook(const string& symbol) {
+        // Read-only lock for the symbol
+        shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+
+        out << "\nOrder Book for " << symbol << ":" << endl;
+        out << "-------------------" << endl;
+
+        out << "Buy Orders (highest first):" << endl;
+        auto buyIt = buyOrders.find(symbol);
+        if (buyIt != buyOrders.end()) {
+            for (const auto& priceLevelPair : buyIt->second) {
+                double price = priceLevelPair.first;
+                const auto& orders = priceLevelPair.second;
+
+                for (const auto& order : orders) {
+                    if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
+                        out << "Price: $" << fixed << setprecision(2) << price
+                             << ", Qty: " << order->getDisplayedQuantity()
+                             << ", ID: " << order->id
+                             << ", Type: " << order->getVariantString()
+                             << ", Status: " << order->getStatusString()
+                             << ", Time: " << order->getTimestamp() << endl;
+                    }
+                }
+            }
+        }
+
+        out << "\nSell Orders (lowest first):" << endl;
+        auto sellIt = sellOrders.find(symbol);
+        if (sellIt != sellOrders.end()) {
+            for (const auto& priceLevelPair : sellIt->second) {
+                double price = priceLevelPair.first;
+                const auto& orders = priceLevelPair.second;
+
+                for (const auto& order : orders) {
+                    if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
+                        out << "Price: $" << fixed << setprecision(2) << price
+                             << ", Qty: " << order->getDisplayedQuantity()
+                             << ", ID: " << order->id
+                             << ", Type: " << order->getVariantString()
+                             << ", Status: " << order->getStatusString()
+                             << ", Time: " << order->getTimestamp() << endl;
+                    }
+                }
+            }
+        }
+
+        printPendingStops(symbol);
+    }
+
+    // Aggregated top levels of both sides, best first
+    void printDepth(const string& symbol, size_t maxLevels) {
+        shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+
+        vector<DepthLevel> bids, asks;
+        getDepth(symbol, BUY, maxLevels, bids);
+        getDepth(symbol, SELL, maxLevels, asks);
+
+        out << "\nDepth for " << symbol << ":" << endl;
+        out << "------------------------" << endl;
+        for (size_t i = 0; i < max(bids.size(), asks.size()); ++i) {
+            out << setw(2) << i + 1 << "  ";
+            if (i < bids.size()) {
+                out << setw(8) << bids[i].quantity << " (" << bids[i].orders << ") $"
+                    << fixed << setprecision(2) << setw(9) << left << bids[i].price << right;
+            } else {
+                out << setw(24) << "";
+            }
+            out << "  |  ";
+            if (i < asks.size()) {
+                out << "$" << fixed << setprecision(2) << asks[i].price << " "
+                    << asks[i].quantity << " (" << asks[i].orders << ")";
+            }
+            out << endl;
+        }
+        out << "Levels within 1% of touch: " << levelsInBand(symbol, BUY, 1.0) << " bid, "
+            << levelsInBand(symbol, SELL, 1.0) << " ask" << endl;
+    }
+
+    void printTradeHistory(const string& symbol) {
+        out << "\nTrade History for " << symbol << ":" << endl;
+        out << "------------------------" << endl;
+
+        for (const auto& trade : tradeHistory) {
+            if (trade->symbol == symbol) {
+                out << "Time: " << trade->getTimestamp()
+                     << ", Qty: " << trade->quantity
+                     << ", Price: $" << fixed << setprecision(2) << trade->price
+                     << ", Buy ID: " << trade->buyOrderId
+                     << ", Sell ID: " << trade->sellOrderId << endl;
+            }
+        }
+    }
+
+    // Structured book query: aggregated price levels or individual orders, as one JSON
+    // line or one binary frame. Built straight from the book so callers don't parse text.
+    // A non-zero maxLevels limits the level view to the top levels, served from the depth cache.
+    void queryOrderBook(const string& symbol, BookView view, QueryFormat format, size_t maxLevels = 0) {
+        shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+        lock_guard<mutex> writerLock(queryMutex);
+
+        BufferWriter& w = queryWriter;
+        w.clear();
+
+        auto buyIt = buyOrders.find(symbol);
+        auto sellIt = sellOrders.find(symbol);
+        bool topLevels = view == LEVEL_VIEW && maxLevels > 0;
+        vector<DepthLevel> bids, asks;
+        if (topLevels) {
+            getDepth(symbol, BUY, maxLevels, bids);
+            getDepth(symbol, SELL, maxLevels, asks);
+        }
+
+        if (format == JSON_FORMAT) {
+            w.put("{\"type\":\"book\",\"symbol\":");
+            w.putString(symbol);
+            w.put(view == LEVEL_VIEW ? ",\"view\":\"levels\",\"buy_orders\":[" : ",\"view\":\"orders\",\"buy_orders\":[");
+            if (topLevels) writeDepthLevels(w, bids, format);
+            else if (buyIt != buyOrders.end()) writeBookSide(w, buyIt->second, view, format);
+            w.put("],\"sell_orders\":[");
+            if (topLevels) writeDepthLevels(w, asks, format);
+            else if (sellIt != sellOrders.end()) writeBookSide(w, sellIt->second, view, format);
+            w.put("]}");
+        } else {
+            size_t header = beginFrame(w, view == LEVEL_VIEW ? FRAME_BOOK_LEVELS : FRAME_BOOK_ORDERS);
+            w.putShortString(symbol);
+            size_t buyCount = w.size();
+            w.putRaw<uint32_t>(0);
+            uint32_t n = topLevels ? writeDepthLevels(w, bids, format)
+                       : buyIt != buyOrders.end() ? writeBookSide(w, buyIt->second, view, format) : 0;
+            w.patchRaw(buyCount, n);
+            size_t sellCount = w.size();
+            w.putRaw<uint32_t>(0);
+            n = topLevels ? writeDepthLevels(w, asks, format)
+              : sellIt != sellOrders.end() ? writeBookSide(w, sellIt->second, view, format) : 0;
+            w.patchRaw(sellCount, n);
+            endFrame(w, header);
+        }
+
+        emitQueryResult(w, format);
+    }
+
+    void queryTrades(const string& symbol, QueryFormat format) {
+        lock_guard<mutex> writerLock(queryMutex);
+
+        BufferWriter& w = queryWriter;
+        w.clear();
+
+        if (format == JSON_FORMAT) {
+            w.put("{\"type\":\"trades\",\"symbol\":");
+            w.putString(symbol);
+            w.put(",\"trades\":[");
+            bool first = true;
+            for (const auto& trade : tradeHistory) {
+                if (trade->symbol != symbol) continue;
+                if (!first) w.put(',');
+                first = false;
+                w.put("{\"timestamp\":");
+                w.putString(trade->getTimestamp());
+                w.put(",\"quantity\":");
+                w.putNumber(trade->quantity);
+                w.put(",\"price\":");
+                w.putNumber(trade->price);
+                w.put(",\"buy_order_id\":");
+                w.putNumber(trade->buyOrderId);
+                w.put(",\"sell_order_id\":");
+                w.putNumber(trade->sellOrderId);
+                w.put('}');
+            }
+            w.put("]}");
+        } else {
+            size_t header = beginFrame(w, FRAME_TRADES);
+            w.putShortString(symbol);
+            size_t countOffset = w.size();
+            w.putRaw<uint32_t>(0);
+            uint32_t count = 0;
+            for (const auto& trade : tradeHistory) {
+                if (trade->symbol != symbol) continue;
+                w.putRaw(trade->price);
+                w.putRaw<int32_t>(trade->quantity);
+                w.putRaw<int32_t>(trade->buyOrderId);
+                w.putRaw<int32_t>(trade->sellOrderId);
+                w.putRaw<int64_t>(trade->timestamp);
+                ++count;
+            }
+            w.patchRaw(countOffset, count);
+            endFrame(w, header);
+        }
+
+        emitQueryResult(w, format);
+    }
+
+    // One order's status, fills and average fill price, read from its seqlock record. Takes
+    // no book lock and not the query writer either, so status polling never waits on matching.
+    void queryOrderStatus(int orderId, QueryFormat format) {
+        static const char* const statusNames[] = { "ACTIVE", "FILLED", "PARTIALLY_FILLED", "CANCELLED" };
+        OrderStatusView view;
+        bool known = orderStatus.read(orderId, view);
+
+        BufferWriter w(256);
+        if (format == JSON_FORMAT) {
+            w.put("{\"type\":\"order_status\",\"id\":");
+            w.putNumber(orderId);
+            w.put(",\"status\":");
+            w.putString(known ? statusNames[view.status] : "UNKNOWN");
+            if (known) {
+                w.put(",\"quantity\":");
+                w.putNumber(view.quantity);
+                w.put(",\"filled\":");
+                w.putNumber(view.filled);
+                w.put(",\"average_price\":");
+                w.putNumber(view.averagePrice());
+            }
+            w.put('}');
+        } else {
+            size_t header = beginFrame(w, FRAME_ORDER_STATUS);
+            w.putRaw<int32_t>(orderId);
+            w.putRaw<uint8_t>(known);
+            w.putRaw<uint8_t>(known ? view.status : 0);
+            w.putRaw<int32_t>(known ? view.quantity : 0);
+            w.putRaw<int32_t>(known ? view.filled : 0);
+            w.putRaw<double>(known ? view.averagePrice() : 0.0);
+            endFrame(w, header);
+        }
+        emitQueryResult(w, format);
+    }
+
+    void queryStatus(QueryFormat format) {
+        lock_guard<mutex> writerLock(queryMutex);
+
+        BufferWriter& w = queryWriter;
+        w.clear();
+
+        vector<string> symbols;
+        for (const auto& entry : buyOrders) symbols.push_back(entry.first);
+        for (const auto& entry : sellOrders) {
+            if (buyOrders.find(entry.first) == buyOrders.end()) symbols.push_back(entry.first);
+        }
+        sort(symbols.begin(), symbols.end());
+
+        if (format == JSON_FORMAT) {
+            w.put("{\"type\":\"status\",\"market_status\":");
+            w.putString(getMarketStatusString(circuitBreaker.getStatus()));
+            w.put(",\"index_value\":");
+            w.putNumber(circuitBreaker.getCurrentValue());
+            w.put(",\"orders\":");
+            w.putNumber(orderMap.size());
+            w.put(",\"trades\":");
+            w.putNumber(tradeHistory.size());
+            w.put(",\"symbols\":[");
+            for (size_t i = 0; i < symbols.size(); ++i) {
+                if (i > 0) w.put(',');
+                w.putString(symbols[i]);
+            }
+            w.put("]}");
+        } else {
+            size_t header = beginFrame(w, FRAME_STATUS);
+            w.putRaw<uint8_t>(circuitBreaker.getStatus());
+            w.putRaw(circuitBreaker.getCurrentValue());
+            w.putRaw<uint32_t>(orderMap.size());
+            w.putRaw<uint32_t>(tradeHistory.size());
+            w.putRaw<uint32_t>(symbols.size());
+            for (const auto& symbol : symbols) {
+                w.putShortString(symbol);
+            }
+            endFrame(w, header);
+        }
+
+        emitQueryResult(w, format);
+    }
+
+    // Define a spread instrument over existing outright symbols. A snapshot restore skips the
+    // namespace checks: its spread book and leg books were restored (or emptied) before this.
+    bool defineSpread(const string& name, const vector<SpreadLeg>& legs, bool restoring = false) {
+        if (legs.empty()) {
+            out << "Spread " << name << " rejected: no legs" << endl;
+            return false;
+        }
+        if (!restoring) {
+            if (isOutrightSymbol(name)) {
+                out << "Spread " << name << " rejected: " << name << " is an outright symbol" << endl;
+                return false;
+            }
+            set<string> seen;
+            for (const auto& leg : legs) {
+                if (!isOutrightSymbol(leg.symbol)) {
+                    out << "Spread " << name << " rejected: unknown leg " << leg.symbol << endl;
+                    return false;
+                }
+                if (!seen.insert(leg.symbol).second) {
+                    out << "Spread " << name << " rejected: duplicate leg " << leg.symbol << endl;
+                    return false;
+                }
+            }
+        }
+
+        vector<string> legSymbols;
+        for (const auto& leg : legs) {
+            legSymbols.push_back(leg.symbol);
+        }
+        auto locks = lockSymbols(legSymbols);
+        lock_guard<mutex> spreadLock(spreadMutex);
+
+        if (spreads.find(name) != spreads.end()) {
+            out << "Spread " << name << " already defined" << endl;
+            return false;
+        }
+
+        SpreadInstrument& spread = spreads[name];
+        spread.name = name;
+        spread.legs = legs;
+        spread.missingBidTerms = legs.size();
+        spread.missingAskTerms = legs.size();
+
+        for (size_t i = 0; i < legs.size(); ++i) {
+            spreadLegIndex[legs[i].symbol].push_back({ name, i });
+            TopOfBook& top = legTops[legs[i].symbol];
+            top = readTopOfBook(legs[i].symbol);
+            patchLegTerms(spread, spread.legs[i], top);
+        }
+
+        if (!restoring) {
+            out << "Spread Defined: " << name << " =";
+            for (const auto& leg : legs) {
+                out << " " << (leg.side == BUY ? "+" : "-") << leg.ratio << "x" << leg.symbol;
+            }
+            out << endl;
+        }
+        return true;
+    }
+
+    // Spread order: matches resting spread orders first, then implied-in liquidity from the
+    // leg books; any remainder rests in the spread's own book.
+    int placeSpreadOrder(OrderType type, const string& name, double price, int quantity) {
+        {
+            lock_guard<mutex> spreadLock(spreadMutex);
+            if (spreads.find(name) == spreads.end()) {
+                out << "Spread order rejected: unknown spread " << name << endl;
+                return -1;
+            }
+        }
+
+        MarketStatus marketStatus = circuitBreaker.getStatus();
+        if (marketStatus != NORMAL_TRADING) {
+            out << "Spread order rejected: Market is not in normal trading mode." << endl;
+            return -1;
+        }
+
+        auto newOrder = createOrder(type, LIMIT, price, quantity, name, "");
+        int orderId = newOrder->id;
+
+        {
+            unique_lock<shared_mutex> symbolLock(getOrCreateSymbolMutex(name));
+            addToBook(newOrder);
+        }
+
+        out << "Spread Order Placed: " << (type == BUY ? "BUY" : "SELL")
+            << " " << quantity << " " << name << " at $" << fixed << setprecision(2)
+            << price << " (ID: " << orderId << ")" << endl;
+
+        matchOrders(name);
+        {
+            lock_guard<mutex> spreadLock(spreadMutex);
+            pendingSpreads.insert(name);
+        }
+        processPendingSpreads();
+
+        return orderId;
+    }
+
+    // Implied-in prices from the outright legs, and the implied-out prices each leg book
+    // would see from the spread's best resting orders combined with the other legs
+    void printImpliedPrices(const string& name) {
+        shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(name));
+        lock_guard<mutex> spreadLock(spreadMutex);
+
+        auto it = spreads.find(name);
+        if (it == spreads.end()) {
+            out << "Unknown spread: " << name << endl;
+            return;
+        }
+        const SpreadInstrument& spread = it->second;
+
+        out << "\nImplied Prices for " << name << ":" << endl;
+        out << "-------------------" << endl;
+        out << fixed << setprecision(2);
+        out << "Implied-in bid: ";
+        if (spread.hasImpliedBid()) out << "$" << fromPriceMicros(spread.impliedBidSum); else out << "none";
+        out << ", Implied-in ask: ";
+        if (spread.hasImpliedAsk()) out << "$" << fromPriceMicros(spread.impliedAskSum); else out << "none";
+        out << endl;
+
+        TopOfBook spreadTop = readTopOfBook(name);
+        for (const auto& leg : spread.legs) {
+            // Sums over the other legs: this leg's term taken back out
+            bool restAskValid = spread.missingAskTerms - (leg.hasAskTerm ? 0 : 1) == 0;
+            bool restBidValid = spread.missingBidTerms - (leg.hasBidTerm ? 0 : 1) == 0;
+            int64_t restAsk = spread.impliedAskSum - (leg.hasAskTerm ? leg.askTerm : 0);
+            int64_t restBid = spread.impliedBidSum - (leg.hasBidTerm ? leg.bidTerm : 0);
+
+            bool hasBid = false, hasAsk = false;
+            double impliedBid = 0, impliedAsk = 0;
+            if (leg.side == BUY) {
+                if (spreadTop.hasBid && restAskValid) {
+                    hasBid = true;
+                    impliedBid = fromPriceMicros(toPriceMicros(spreadTop.bid) - restAsk) / leg.ratio;
+                }
+                if (spreadTop.hasAsk && restBidValid) {
+                    hasAsk = true;
+                    impliedAsk = fromPriceMicros(toPriceMicros(spreadTop.ask) - restBid) / leg.ratio;
+                }
+            } else {
+                if (spreadTop.hasBid && restAskValid) {
+                    hasAsk = true;
+                    impliedAsk = fromPriceMicros(restAsk - toPriceMicros(spreadTop.bid)) / leg.ratio;
+                }
+                if (spreadTop.hasAsk && restBidValid) {
+                    hasBid = true;
+                    impliedBid = fromPriceMicros(restBid - toPriceMicros(spreadTop.ask)) / leg.ratio;
+                }
+            }
+
+            out << "Leg " << leg.symbol << " implied-out bid: ";
+            if (hasBid) out << "$" << impliedBid; else out << "none";
+            out << ", implied-out ask: ";
+            if (hasAsk) out << "$" << impliedAsk; else out << "none";
+            out << endl;
+        }
+    }
+
+    // Canonical, timestamp-free dump of trades and resting state for replay diffs: trades
+    // grouped by symbol in execution order, then every book and pending stop in priority
+    // order. Two engines that behave the same produce byte-identical output.
+    // Canonical state on the engine's output, e.g. into a gateway session's reply
+    void dumpState() {
+        writeCanonicalState(out);
+        out.flush();
+    }
+
+    void writeCanonicalState(ostream& os) {
+        vector<string> symbols = knownSymbols();
+
+        os << fixed << setprecision(4);
+        os << "market " << getMarketStatusString(circuitBreaker.getStatus()) << "\n";
+
+        vector<shared_ptr<Trade>> trades = tradeHistory;
+        stable_sort(trades.begin(), trades.end(),
+                    [](const shared_ptr<Trade>& a, const shared_ptr<Trade>& b) { return a->symbol < b->symbol; });
+        for (const auto& trade : trades) {
+            os << "trade " << trade->symbol << " " << trade->quantity << " @ " << trade->price
+               << " buy=" << trade->buyOrderId << " sell=" << trade->sellOrderId << "\n";
+        }
+
+        for (const auto& symbol : symbols) {
+            shared_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+
+            auto buyIt = buyOrders.find(symbol);
+            if (buyIt != buyOrders.end()) writeCanonicalSide(os, symbol, "BUY", buyIt->second);
+            auto sellIt = sellOrders.find(symbol);
+            if (sellIt != sellOrders.end()) writeCanonicalSide(os, symbol, "SELL", sellIt->second);
+
+            vector<DepthLevel> levels;
+            for (OrderType side : { BUY, SELL }) {
+                getDepth(symbol, side, DEPTH_CACHE_LEVELS, levels);
+                for (const auto& level : levels) {
+                    os << "depth " << symbol << " " << (side == BUY ? "BUY" : "SELL") << " " << level.price
+                       << " qty=" << level.quantity << " orders=" << level.orders << "\n";
+                }
+                size_t band = levelsInBand(symbol, side, 1.0);
+                if (band > 0) {
+                    os << "band " << symbol << " " << (side == BUY ? "BUY" : "SELL") << " " << band << "\n";
+                }
+            }
+
+            for (auto* stops : { &buyStops, &sellStops }) {
+                auto stopIt = stops->find(symbol);
+                if (stopIt == stops->end()) continue;
+                for (const auto& entry : stopIt->second) {
+                    const auto& order = entry.second;
+                    if (order->status == CANCELLED) continue;
+                    os << "stop " << symbol << " " << (order->type == BUY ? "BUY" : "SELL")
+                       << " " << order->stopPrice << " id=" << order->id
+                       << " qty=" << order->getRemainingQuantity() << " " << order->getVariantString() << "\n";
+                }
+            }
+
+            auto linksIt = orderLinks.find(symbol);
+            if (linksIt != orderLinks.end()) {
+                map<int, const LinkGroup*> groups;
+                for (const auto& entry : linksIt->second.groups) groups[entry.first] = &entry.second;
+                for (const auto& entry : groups) {
+                    const LinkGroup& group = *entry.second;
+                    os << "link " << symbol << " group=" << entry.first
+                       << (group.type == LINK_OCO ? " OCO" : " BRACKET") << (group.working ? " working" : " held");
+                    if (group.entry) os << " entry=" << group.entry->id;
+                    for (const auto& member : group.members) {
+                        os << " " << member->id << ":" << member->getRemainingQuantity() << ":"
+                           << member->getStatusString();
+                    }
+                    os << "\n";
+                }
+            }
+        }
+    }
+
+private:
+    // Execute market order (immediately match with best available prices)
+    void executeMarketOrder(shared_ptr<Order>& order) {
+        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
+
+        // Match against the opposite side at any price
+        sweepOpposite(order, false);
+
+        // Update market order status
+        updateOrderStatus(order);
+
+        // If market order couldn't be completely filled
+        if (order->status != FILLED) {
+            out << "Market " << (order->type == BUY ? "Buy" : "Sell") << " Order " << order->id
+                 << " partially filled: " << order->filled_quantity << " of " << order->quantity
+                 << " shares. Remaining quantity cancelled." << endl;
+
+            // Market orders can't rest in the book
+            order->status = PARTIALLY_FILLED;
+            publishStatus(*order);
+        }
+
+        onBookChanged(order->symbol);
+    }
+
+    // Execute IOC (Immediate or Cancel) order
+    void executeIOCOrder(shared_ptr<Order>& order) {
+        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
+
+        // Try to match as much as possible immediately at the limit price or better
+        sweepOpposite(order, true);
+
+        // Update IOC order status
+        updateOrderStatus(order);
+
+        // If IOC order couldn't be completely filled, cancel the remainder
+        if (order->status != FILLED) {
+            out << "IOC " << (order->type == BUY ? "Buy" : "Sell") << " Order " << order->id
+                 << " partially filled: " << order->filled_quantity << " of " << order->quantity
+                 << " shares. Remaining quantity cancelled." << endl;
+
+            // IOC orders that aren't fully filled are cancelled
+            if (order->status == PARTIALLY_FILLED) {
+                order->status = CANCELLED;
+                publishStatus(*order);
+            }
+        }
+
+        onBookChanged(order->symbol);
+    }
+
+    // Execute FOK (Fill or Kill) order - must be filled completely or cancelled
+    bool executeFOKOrder(shared_ptr<Order>& order) {
+        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
+
+        // First check if the order can be filled completely (hidden iceberg reserve counts)
+        bool canFillCompletely = availableQuantity(order) >= order->quantity;
+
+        // If can't fill completely, return false
+        if (!canFillCompletely) {
+            return false;
+        }
+
+        // If we can fill completely, execute the trades
+        sweepOpposite(order, true);
+
+        // Update FOK order status
+        updateOrderStatus(order);
+        onBookChanged(order->symbol);
+
+        // Should be completely filled
+        return order->status == FILLED;
+    }
+
+    // Whether a resting price level is marketable for an aggressive order
+    static bool priceAcceptable(const shared_ptr<Order>& order, double levelPrice) {
+        return order->type == BUY ? levelPrice <= order->price : levelPrice >= order->price;
+    }
+
+    // Quantity resting at prices the order would accept, stopping once it is covered.
+    // Scans the opposite tick ladder when it is usable instead of walking every order.
+    int availableQuantity(const shared_ptr<Order>& order) {
+        OrderType opposite = order->type == BUY ? SELL : BUY;
+        if (config.levelLadder) {
+            const LevelLadder* ladder = findLadder(order->symbol, opposite);
+            if (!ladder) {
+                return 0;
+            }
+            if (ladder->isUsable()) {
+                size_t end = order->variant == MARKET ? ladder->size() : ladder->endIndexFor(order->price);
+                int64_t total = LevelKernels::get().cumulative(ladder->data(), 0, end, order->quantity);
+                return static_cast<int>(min<int64_t>(total, INT32_MAX));
+            }
+        }
+
+        if (opposite == BUY) {
+            auto it = buyOrders.find(order->symbol);
+            return it == buyOrders.end() ? 0 : availableInBook(it->second, order);
+        }
+        auto it = sellOrders.find(order->symbol);
+        return it == sellOrders.end() ? 0 : availableInBook(it->second, order);
+    }
+
+    template <typename Book>
+    static int availableInBook(const Book& book, const shared_ptr<Order>& order) {
+        int availableQty = 0;
+        for (auto levelIt = book.begin();
+             levelIt != book.end() && priceAcceptable(order, levelIt->first);
+             ++levelIt) {
+
+            for (auto& resting : levelIt->second) {
+                if (resting->status != CANCELLED) {
+                    availableQty += resting->getRemainingQuantity();
+                }
+            }
+
+            if (availableQty >= order->quantity) {
+                break;
+            }
+        }
+        return availableQty;
+    }
+
+    // Sweep whichever side of its book the order trades against, if that side exists
+    void sweepOpposite(shared_ptr<Order>& order, bool useLimit, const char* label = nullptr) {
+        if (order->type == BUY) {
+            auto it = sellOrders.find(order->symbol);
+            if (it != sellOrders.end()) sweepWithPolicy(order, it->second, useLimit, label);
+        } else {
+            auto it = buyOrders.find(order->symbol);
+            if (it != buyOrders.end()) sweepWithPolicy(order, it->second, useLimit, label);
+        }
+    }
+
+    // Pick the sweep kernel instantiated for the symbol's allocation policy
+    template <typename Book>
+    void sweepWithPolicy(shared_ptr<Order>& order, Book& book, bool useLimit, const char* label) {
+        const AllocationRule* rule = allocationRuleFor(order->symbol);
+        if (rule && rule->policy == ALLOC_PRO_RATA) {
+            sweepBook<ProRataAllocation>(order, book, useLimit, label, rule);
+        } else if (rule && rule->policy == ALLOC_LMM) {
+            sweepBook<LmmAllocation>(order, book, useLimit, label, rule);
+        } else {
+            sweepBook<FifoAllocation>(order, book, useLimit, label, rule);
+        }
+    }
+
+    // Sweep the opposite side of the book for an aggressive order, best price first.
+    // MARKET orders take any price; IOC/FOK stop at their limit. The caller holds the
+    // symbol lock and settles the aggressor's status afterwards. A level-at-once policy
+    // allocates each level in one pass; FIFO takes the front order at a time.
+    template <typename Policy, typename Book>
+    void sweepBook(shared_ptr<Order>& order, Book& book, bool useLimit, const char* label,
+                   const AllocationRule* rule) {
+        int remainingQty = order->getRemainingQuantity();
+        string tag = " [" + (label ? string(label) : order->getVariantString()) + "]";
+
+        for (auto levelIt = book.begin();
+             levelIt != book.end() && remainingQty > 0 &&
+             (!useLimit || priceAcceptable(order, levelIt->first));
+             /* increment in loop */) {
+
+            double matchPrice = levelIt->first;
+            auto& ordersAtPrice = levelIt->second;
+
+            if constexpr (Policy::LEVEL_AT_ONCE) {
+                int executed = allocateLevel<Policy>(order, false, ordersAtPrice, matchPrice, remainingQty, *rule, tag);
+                remainingQty -= executed;
+                if (remainingQty > 0 && !ordersAtPrice.empty()) {
+                    // Nothing left to trade at this level but tombstones
+                    dropCancelled(ordersAtPrice);
+                }
+            } else {
+                while (remainingQty > 0 && !ordersAtPrice.empty()) {
+                    auto resting = ordersAtPrice.front();
+
+                    // Skip cancelled orders
+                    if (resting->status == CANCELLED) {
+                        ordersAtPrice.pop_front();
+                        continue;
+                    }
+
+                    // Determine match quantity - only the displayed slice of an iceberg can trade
+                    int matchQty = min(remainingQty, resting->getDisplayedQuantity());
+
+                    const auto& buyOrder = order->type == BUY ? order : resting;
+                    const auto& sellOrder = order->type == BUY ? resting : order;
+
+                    // Execute the trade
+                    auto trade = make_shared<Trade>(buyOrder->id, sellOrder->id, order->symbol, matchPrice, matchQty,
+                                                    clock.now(), buyOrder->account, sellOrder->account);
+                    recordTrade(trade);
+
+                    // Update quantities
+                    remainingQty -= matchQty;
+                    applyFill(resting, matchQty, matchPrice);
+                    fillAggressor(order, matchQty, matchPrice);
+
+                    out << "\nTrade Executed: " << matchQty << " " << order->symbol
+                         << " at $" << fixed << setprecision(2) << matchPrice
+                         << " (Buy: " << buyOrder->id << (order->type == BUY ? tag : "")
+                         << ", Sell: " << sellOrder->id << (order->type == SELL ? tag : "") << ")" << endl;
+
+                    // Remove filled orders, send refreshed iceberg slices to the back of the queue
+                    settleFrontOrder(ordersAtPrice, resting);
+                }
+            }
+
+            // Clean up empty price levels
+            if (ordersAtPrice.empty()) {
+                levelIt = book.erase(levelIt);
+            } else {
+                ++levelIt;
+            }
+        }
+    }
+
+    // Trade up to quantity of the aggressor against one price level under a level-at-once
+    // policy: one pass sums what the level shows, one allocates it, and the fills execute in
+    // the level's time order. Repeats while refreshed iceberg slices can take more. A resting
+    // aggressor (uncrossing) is filled like any resting order. Returns the quantity traded.
+    template <typename Policy>
+    int allocateLevel(shared_ptr<Order>& aggressor, bool aggressorResting, deque<shared_ptr<Order>>& ordersAtPrice,
+                      double tradePrice, int quantity, const AllocationRule& rule, const string& tag) {
+        // Per thread, since symbols match concurrently under their own locks
+        thread_local vector<int> allocationFills;
+        int executed = 0;
+        while (executed < quantity) {
+            int levelDisplayed = 0;
+            for (const auto& resting : ordersAtPrice) {
+                levelDisplayed += liveDisplayed(resting);
+            }
+            if (levelDisplayed == 0) break;
+
+            allocationFills.assign(ordersAtPrice.size(), 0);
+            Policy::allocate(ordersAtPrice, min(quantity - executed, levelDisplayed), levelDisplayed, rule, allocationFills);
+
+            for (size_t i = 0; i < ordersAtPrice.size(); ++i) {
+                // A fill earlier in the pass may have cancelled or reduced a linked order
+                int matchQty = min(allocationFills[i], liveDisplayed(ordersAtPrice[i]));
+                if (matchQty == 0) continue;
+
+                auto resting = ordersAtPrice[i];
+                const auto& buyOrder = aggressor->type == BUY ? aggressor : resting;
+                const auto& sellOrder = aggressor->type == BUY ? resting : aggressor;
+
+                auto trade = make_shared<Trade>(buyOrder->id, sellOrder->id, aggressor->symbol, tradePrice, matchQty,
+                                                clock.now(), buyOrder->account, sellOrder->account);
+                recordTrade(trade);
+
+                executed += matchQty;
+                if (aggressorResting) {
+                    applyFill(aggressor, matchQty, tradePrice);
+                    applyFill(resting, matchQty, tradePrice);
+                } else {
+                    applyFill(resting, matchQty, tradePrice);
+                    fillAggressor(aggressor, matchQty, tradePrice);
+                }
+
+                out << "\nTrade Executed: " << matchQty << " " << aggressor->symbol
+                     << " at $" << fixed << setprecision(2) << tradePrice
+                     << " (Buy: " << buyOrder->id << (aggressor->type == BUY ? tag : "")
+                     << ", Sell: " << sellOrder->id << (aggressor->type == SELL ? tag : "") << ")" << endl;
+            }
+
+            settleLevel(ordersAtPrice);
+        }
+        return executed;
+    }
+
+    // settleFrontOrder for a whole level after an allocation, keeping time order: filled
+    // orders leave, and icebergs whose visible slice is used up are topped up and go to the
+    // back. Cancelled orders stay where they are.
+    void settleLevel(deque<shared_ptr<Order>>& ordersAtPrice) {
+        vector<shared_ptr<Order>> refreshed;
+        for (size_t i = 0, count = ordersAtPrice.size(); i < count; ++i) {
+            auto order = ordersAtPrice.front();
+            ordersAtPrice.pop_front();
+            if (order->status == FILLED) continue;
+            if (order->status != CANCELLED && order->needsReplenish()) {
+                order->replenish();
+                refreshed.push_back(order);
+            } else {
+                ordersAtPrice.push_back(order);
+            }
+        }
+        for (auto& order : refreshed) {
+            ordersAtPrice.push_back(order);
+        }
+    }
+
+    // Remove the cancelled orders from a level
+    static void dropCancelled(deque<shared_ptr<Order>>& ordersAtPrice) {
+        ordersAtPrice.erase(remove_if(ordersAtPrice.begin(), ordersAtPrice.end(),
+                                      [](const shared_ptr<Order>& order) { return order->status == CANCELLED; }),
+                            ordersAtPrice.end());
+    }
+
+    // Fill the aggressor of a sweep; its caller settles the status once the sweep is done
+    void fillAggressor(shared_ptr<Order>& order, int quantity, double price) {
+        order->filled_quantity += quantity;
+        if (!order->spreadLeg) {
+            orderStatus.addFill(order->id, quantity, price);
+        }
+        if (order->linkGroup) {
+            onLinkedFill(order, quantity);
+        }
+    }
+
+    // Fill a resting order at the trade price
+    void applyFill(shared_ptr<Order>& order, int quantity, double price) {
+        order->filled_quantity += quantity;
+        orderStatus.addFill(order->id, quantity, price);
+        if (order->peakSize > 0) {
+            order->displayedQuantity -= quantity;
+        }
+        updateOrderStatus(order);
+        touchDepth(order->symbol, order->type, order->price);
+        ladderAdd(order->symbol, order->type, order->price, -quantity);
+        if (order->linkGroup) {
+            onLinkedFill(order, quantity);
+        }
+    }
+
+    // Append a resting order to the back of its price level. Caller holds the symbol lock.
+    void addToBook(const shared_ptr<Order>& order) {
+        if (order->type == BUY) {
+            buyOrders[order->symbol][order->price].push_back(order);
+        } else {
+            sellOrders[order->symbol][order->price].push_back(order);
+        }
+        order->resting = true;
+        touchDepth(order->symbol, order->type, order->price);
+        ladderAdd(order->symbol, order->type, order->price, order->getRemainingQuantity());
+    }
+
+    // Cancel an order in place; a resting one stays in its level as a tombstone that the
+    // matching loops skip. Caller holds the symbol lock.
+    void markCancelled(const shared_ptr<Order>& order) {
+        bool wasLive = order->status == ACTIVE || order->status == PARTIALLY_FILLED;
+        order->status = CANCELLED;
+        publishStatus(*order);
+        if (order->resting && wasLive) {
+            ++tombstoneCounts[order->symbol];
+            touchDepth(order->symbol, order->type, order->price);
+            ladderAdd(order->symbol, order->type, order->price, -order->getRemainingQuantity());
+        }
+        if (order->linkGroup && wasLive) {
+            onLinkedCancel(order);
+        }
+    }
+
+    // Take a live resting order out of its price level without leaving a tombstone, for
+    // re-insertion elsewhere. Caller holds the symbol lock.
+    void unlinkFromBook(const shared_ptr<Order>& order) {
+        if (order->type == BUY) {
+            unlinkFromLevel(buyOrders.find(order->symbol)->second, order);
+        } else {
+            unlinkFromLevel(sellOrders.find(order->symbol)->second, order);
+        }
+        order->resting = false;
+        touchDepth(order->symbol, order->type, order->price);
+        ladderAdd(order->symbol, order->type, order->price, -order->getRemainingQuantity());
+    }
+
+    template <typename Book>
+    static void unlinkFromLevel(Book& book, const shared_ptr<Order>& order) {
+        auto levelIt = book.find(order->price);
+        auto& ordersAtPrice = levelIt->second;
+        ordersAtPrice.erase(find(ordersAtPrice.begin(), ordersAtPrice.end(), order));
+        if (ordersAtPrice.empty()) {
+            book.erase(levelIt);
+        }
+    }
+
+    const LevelLadder* findLadder(const string& symbol, OrderType side) const {
+        const auto& ladders = side == BUY ? buyLadders : sellLadders;
+        auto it = ladders.find(symbol);
+        return it == ladders.end() ? nullptr : &it->second;
+    }
+
+    // Move a side's ladder by delta at price; nothing to keep when ladders are off
+    void ladderAdd(const string& symbol, OrderType side, double price, int64_t delta) {
+        if (!config.levelLadder) {
+            return;
+        }
+        auto& ladders = side == BUY ? buyLadders : sellLadders;
+        auto it = ladders.find(symbol);
+        if (it == ladders.end()) {
+            it = ladders.emplace(symbol, LevelLadder(side)).first;
+        }
+        it->second.add(price, delta);
+    }
+
+    // Number of price levels with live quantity within bandPercent of the touch
+    size_t levelsInBand(const string& symbol, OrderType side, double bandPercent) {
+        if (config.levelLadder) {
+            const LevelLadder* ladder = findLadder(symbol, side);
+            if (!ladder) {
+                return 0;
+            }
+            if (ladder->isUsable()) {
+                const LevelKernels& kernels = LevelKernels::get();
+                size_t best = kernels.firstNonEmpty(ladder->data(), 0, ladder->size());
+                if (best == ladder->size()) {
+                    return 0;
+                }
+                double touch = ladder->priceAt(best);
+                double limit = side == BUY ? touch * (1 - bandPercent / 100) : touch * (1 + bandPercent / 100);
+                size_t end = max(best + 1, ladder->endIndexFor(limit));
+                return kernels.countInBand(ladder->data(), best, end);
+            }
+        }
+
+        if (side == BUY) {
+            auto it = buyOrders.find(symbol);
+            return it == buyOrders.end() ? 0 : countLevelsWithin(it->second, bandPercent, -1);
+        }
+        auto it = sellOrders.find(symbol);
+        return it == sellOrders.end() ? 0 : countLevelsWithin(it->second, bandPercent, 1);
+    }
+
+    template <typename Book>
+    static size_t countLevelsWithin(const Book& book, double bandPercent, int direction) {
+        size_t count = 0;
+        double limit = 0;
+        for (const auto& priceLevelPair : book) {
+            int64_t live = 0;
+            for (const auto& order : priceLevelPair.second) {
+                if (order->status != CANCELLED) live += order->getRemainingQuantity();
+            }
+            if (live == 0) continue;
+            if (count == 0) {
+                limit = priceLevelPair.first * (1 + direction * bandPercent / 100);
+            } else if (direction > 0 ? priceLevelPair.first > limit + PRICE_EPSILON
+                                         : priceLevelPair.first < limit - PRICE_EPSILON) {
+                break;
+            }
+            ++count;
+        }
+        return count;
+    }
+
+    // A change at `price` only matters to the cached depth if it lands inside the cached
+    // window, or the window isn't full (then any new level could enter it)
+    void touchDepth(const string& symbol, OrderType side, double price) {
+        DepthCache* found;
+        {
+            lock_guard<mutex> mapLock(depthCachesMutex);
+            auto it = depthCaches.find(symbol);
+            if (it == depthCaches.end()) {
+                return;
+            }
+            found = &it->second;
+        }
+
+        DepthCache& cache = *found;
+        bool& valid = side == BUY ? cache.bidsValid : cache.asksValid;
+        if (!valid) {
+            return;
+        }
+
+        const vector<DepthLevel>& levels = side == BUY ? cache.bids : cache.asks;
+        if (levels.size() == DEPTH_CACHE_LEVELS) {
+            double worst = levels.back().price;
+            if (side == BUY ? price < worst : price > worst) {
+                return;
+            }
+        }
+        valid = false;
+    }
+
+    // Every symbol with a book or pending stops, sorted
+    vector<string> knownSymbols() const {
+        vector<string> symbols;
+        for (const auto& entry : buyOrders) symbols.push_back(entry.first);
+        for (const auto& entry : sellOrders) symbols.push_back(entry.first);
+        for (const auto& entry : buyStops) symbols.push_back(entry.first);
+        for (const auto& entry : sellStops) symbols.push_back(entry.first);
+        sort(symbols.begin(), symbols.end());
+        symbols.erase(unique(symbols.begin(), symbols.end()), symbols.end());
+        return symbols;
+    }
+
+    // A symbol the engine knows as an instrument of its own: it has a book, stops or instrument
+    // settings, and is not a spread
+    bool isOutrightSymbol(const string& symbol) {
+        {
+            lock_guard<mutex> spreadLock(spreadMutex);
+            if (spreads.find(symbol) != spreads.end()) return false;
+        }
+        if (referencePrices.count(symbol) || tickSizes.count(symbol)) return true;
+        vector<string> symbols = knownSymbols();
+        return binary_search(symbols.begin(), symbols.end(), symbol);
+    }
+
+    static bool isDead(const shared_ptr<Order>& order) {
+        return order->status == FILLED || order->status == CANCELLED;
+    }
+
+    // Finished orders, and unfilled remainders of orders that never rest
+    static bool isRetired(const Order& order) {
+        if (order.status == FILLED || order.status == CANCELLED) {
+            return true;
+        }
+        return !order.resting && (order.variant == MARKET || order.variant == IOC || order.variant == FOK);
+    }
+
+    // Compaction is amortized: a book is compacted once enough cancels have left
+    // tombstones in it since the last pass
+    void maybeCompact(const string& symbol) {
+        if (config.compactAfterCancels == 0) {
+            return;
+        }
+        auto it = tombstoneCounts.find(symbol);
+        if (it == tombstoneCounts.end() || it->second < config.compactAfterCancels) {
+            return;
+        }
+        compactSymbol(symbol);
+        pruneOrderMap();
+    }
+
+    // Drop dead orders left inside levels, then emptied levels, books, ladders and
+    // cancelled stops. Live orders keep their time priority.
+    size_t compactSymbol(const string& symbol) {
+        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+        size_t reclaimed = compactSide(buyOrders, buyLadders, symbol) + compactSide(sellOrders, sellLadders, symbol);
+
+        for (auto* stopsBySymbol : { &buyStops, &sellStops }) {
+            auto stopIt = stopsBySymbol->find(symbol);
+            if (stopIt == stopsBySymbol->end()) continue;
+            auto& stops = stopIt->second;
+            for (auto it = stops.begin(); it != stops.end();) {
+                if (it->second->status == CANCELLED) {
+                    it = stops.erase(it);
+                    ++reclaimed;
+                } else {
+                    ++it;
+                }
+            }
+            if (stops.empty()) {
+                stopsBySymbol->erase(stopIt);
+            }
+        }
+
+        tombstoneCounts.erase(symbol);
+        return reclaimed;
+    }
+
+    template <typename Books>
+    static size_t compactSide(Books& books, unordered_map<string, LevelLadder>& ladders, const string& symbol) {
+        auto bookIt = books.find(symbol);
+        if (bookIt == books.end()) {
+            return 0;
+        }
+
+        auto& book = bookIt->second;
+        size_t reclaimed = 0;
+        for (auto levelIt = book.begin(); levelIt != book.end();) {
+            auto& ordersAtPrice = levelIt->second;
+            size_t before = ordersAtPrice.size();
+            ordersAtPrice.erase(remove_if(ordersAtPrice.begin(), ordersAtPrice.end(), isDead), ordersAtPrice.end());
+            reclaimed += before - ordersAtPrice.size();
+
+            if (ordersAtPrice.empty()) {
+                levelIt = book.erase(levelIt);
+                continue;
+            }
+            if (ordersAtPrice.size() != before) {
+                ordersAtPrice.shrink_to_fit();
+            }
+            ++levelIt;
+        }
+
+        // An empty side also gets a fresh ladder, which re-anchors it at the next order
+        if (book.empty()) {
+            books.erase(bookIt);
+            ladders.erase(symbol);
+        }
+        return reclaimed;
+    }
+
+    size_t pruneOrderMap() {
+        lock_guard<mutex> idLock(orderIdMutex);
+        size_t retired = 0;
+        for (auto it = orderMap.begin(); it != orderMap.end();) {
+            if (isRetired(*it->second)) {
+                orderJournal.push_back(archiveRow(*it->second));
+                it = orderMap.erase(it);
+                ++retired;
+            } else {
+                ++it;
+            }
+        }
+        return retired;
+    }
+
+    // Rough heap footprint of one book side: map nodes, deque chunks and the orders themselves
+    static const size_t CONTROL_BLOCK_BYTES = 16;                        // make_shared control block
+    static const size_t ORDER_BYTES = sizeof(Order) + CONTROL_BLOCK_BYTES;  // object plus its control block
+    static const size_t TREE_NODE_OVERHEAD = 32;                         // std::map node links and colour
+    static const size_t DEQUE_CHUNK_BYTES = 512;                         // libstdc++ deque buffer size
+    static const size_t DEQUE_MAP_BYTES = 64;                            // a deque's chunk map, at its smallest
+
+    struct BookMemory {
+        size_t liveOrders = 0;
+        size_t deadOrders = 0;
+        size_t levels = 0;
+        size_t stops = 0;
+        size_t bytes = 0;
+    };
+
+    template <typename Book>
+    static void measureBook(const Book& book, BookMemory& memory) {
+        for (const auto& priceLevelPair : book) {
+            const auto& ordersAtPrice = priceLevelPair.second;
+            ++memory.levels;
+            size_t chunks = (ordersAtPrice.size() * sizeof(shared_ptr<Order>) + DEQUE_CHUNK_BYTES - 1) /
+                            DEQUE_CHUNK_BYTES;
+            memory.bytes += sizeof(typename Book::value_type) + TREE_NODE_OVERHEAD +
+                            max<size_t>(chunks, 1) * DEQUE_CHUNK_BYTES + DEQUE_MAP_BYTES;
+            for (const auto& order : ordersAtPrice) {
+                if (isDead(order)) ++memory.deadOrders;
+                else ++memory.liveOrders;
+                memory.bytes += ORDER_BYTES;
+            }
+        }
+    }
+
+    // Drop all books, orders, instruments and spreads before a snapshot load
+    void resetState() {
+        lock_guard<mutex> idLock(orderIdMutex);
+        lock_guard<mutex> spreadLock(spreadMutex);
+        buyOrders.clear();
+        sellOrders.clear();
+        buyStops.clear();
+        sellStops.clear();
+        orderMap.clear();
+        buyLadders.clear();
+        sellLadders.clear();
+        tombstoneCounts.clear();
+        {
+            lock_guard<mutex> mapLock(depthCachesMutex);
+            depthCaches.clear();
+        }
+        {
+            lock_guard<mutex> slotsLock(quoteSlotsMutex);
+            quoteSlots.clear();
+        }
+        orderLinks.clear();
+        allocationRules.clear();
+        orderStatus.clear();
+        referencePrices.clear();
+        priceBandPercentages.clear();
+        tickSizes.clear();
+        spreads.clear();
+        spreadLegIndex.clear();
+        legTops.clear();
+        pendingSpreads.clear();
+        tradeHistory.clear();
+        lastTrades.clear();
+        engineIndex.clear();
+        if (postTrade) {
+            postTrade->clear();
+        }
+        orderJournal.clear();
+        internedNames.clear();
+        internedIds.clear();
+        intern("");
+    }
+
+    template <typename Book>
+    static uint32_t writeSnapshotOrders(BufferWriter& w, const Book& book) {
+        uint32_t count = 0;
+        for (const auto& priceLevelPair : book) {
+            for (const auto& order : priceLevelPair.second) {
+                if (isDead(order)) continue;
+                writeSnapshotOrder(w, *order);
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    static void writeSnapshotOrder(BufferWriter& w, const Order& order) {
+        w.putRaw<int32_t>(order.id);
+        w.putRaw<uint8_t>(order.type);
+        w.putRaw<uint8_t>(order.variant);
+        w.putRaw<uint8_t>(order.status);
+        w.putRaw(order.price);
+        w.putRaw<int32_t>(order.quantity);
+        w.putRaw<int32_t>(order.filled_quantity);
+        w.putRaw<int64_t>(order.timestamp);
+        w.putRaw(order.stopPrice);
+        w.putRaw<int32_t>(order.peakSize);
+        w.putRaw<int32_t>(order.displayedQuantity);
+        w.putShortString(order.symbol);
+        w.putShortString(order.account);
+    }
+
+    static shared_ptr<Order> readSnapshotOrder(BufferReader& r) {
+        auto order = make_shared<Order>();
+        order->id = r.getRaw<int32_t>();
+        order->type = r.getEnum<OrderType>(BUY, SELL);
+        order->variant = r.getEnum<OrderVariant>(LIMIT, ICEBERG);
+        order->status = r.getEnum<OrderStatus>(ACTIVE, CANCELLED);
+        order->price = r.getRaw<double>();
+        order->quantity = r.getRaw<int32_t>();
+        order->filled_quantity = r.getRaw<int32_t>();
+        order->timestamp = r.getRaw<int64_t>();
+        order->stopPrice = r.getRaw<double>();
+        order->peakSize = r.getRaw<int32_t>();
+        order->displayedQuantity = r.getRaw<int32_t>();
+        order->symbol = r.getShortString();
+        order->account = r.getShortString();
+        return order;
+    }
+
+    // Mass-cancel the levels in [first, last); linked orders cancelled without markCancelled
+    // are collected for the link follow-up. Caller holds the symbol lock.
+    template <typename Book>
+    int cancelLevels(Book& book, typename Book::iterator first, typename Book::iterator last,
+                     const MassCancelFilter& filter, int& levelsDropped,
+                     vector<shared_ptr<Order>>& linkedCancels) {
+        int cancelled = 0;
+        while (first != last) {
+            auto& ordersAtPrice = first->second;
+            if (filter.account.empty()) {
+                // Everything here goes: settle the level's aggregates once and drop it
+                int64_t liveQuantity = 0;
+                for (const auto& order : ordersAtPrice) {
+                    if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
+                        liveQuantity += order->getRemainingQuantity();
+                        order->status = CANCELLED;
+                        publishStatus(*order);
+                        if (order->linkGroup) linkedCancels.push_back(order);
+                        ++cancelled;
+                    }
+                }
+                if (liveQuantity > 0) {
+                    const auto& front = ordersAtPrice.front();
+                    touchDepth(front->symbol, front->type, first->first);
+                    ladderAdd(front->symbol, front->type, first->first, -liveQuantity);
+                }
+                first = book.erase(first);
+                ++levelsDropped;
+                continue;
+            }
+
+            bool anyLive = false;
+            for (const auto& order : ordersAtPrice) {
+                if (order->status != ACTIVE && order->status != PARTIALLY_FILLED) continue;
+                if (filter.matchesOrder(*order)) {
+                    markCancelled(order);
+                    ++cancelled;
+                } else {
+                    anyLive = true;
+                }
+            }
+            if (!anyLive) {
+                first = book.erase(first);
+                ++levelsDropped;
+            } else {
+                ++first;
+            }
+        }
+        return cancelled;
+    }
+
+    // Aggregate the first maxLevels non-empty levels of a book side
+    template <typename Book>
+    static void collectDepth(const Book& book, size_t maxLevels, vector<DepthLevel>& levels) {
+        levels.clear();
+        for (auto levelIt = book.begin(); levelIt != book.end() && levels.size() < maxLevels; ++levelIt) {
+            DepthLevel level = { levelIt->first, 0, 0 };
+            for (const auto& order : levelIt->second) {
+                if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
+                    level.quantity += order->getDisplayedQuantity();
+                    ++level.orders;
+                }
+            }
+            if (level.quantity > 0) {
+                levels.push_back(level);
+            }
+        }
+    }
+
+    // Top maxLevels aggregated levels of one side. Queries within the cached depth are a
+    // copy of the cache, rebuilt only after a change touched it; deeper queries walk the
+    // book. Caller holds the symbol lock (shared is enough).
+    void getDepth(const string& symbol, OrderType side, size_t maxLevels, vector<DepthLevel>& levels) {
+        if (!config.depthCache || maxLevels > DEPTH_CACHE_LEVELS) {
+            collectDepthFromBook(symbol, side, maxLevels, levels);
+            return;
+        }
+
+        DepthCache* found;
+        {
+            lock_guard<mutex> mapLock(depthCachesMutex);
+            found = &depthCaches[symbol];
+        }
+
+        DepthCache& cache = *found;
+        lock_guard<mutex> cacheLock(cache.rebuildMutex);
+        bool& valid = side == BUY ? cache.bidsValid : cache.asksValid;
+        vector<DepthLevel>& cached = side == BUY ? cache.bids : cache.asks;
+        if (!valid) {
+            collectDepthFromBook(symbol, side, DEPTH_CACHE_LEVELS, cached);
+            valid = true;
+        }
+        levels.assign(cached.begin(), cached.begin() + min(maxLevels, cached.size()));
+    }
+
+    void collectDepthFromBook(const string& symbol, OrderType side, size_t maxLevels, vector<DepthLevel>& levels) {
+        levels.clear();
+        if (side == BUY) {
+            auto it = buyOrders.find(symbol);
+            if (it != buyOrders.end()) collectDepth(it->second, maxLevels, levels);
+        } else {
+            auto it = sellOrders.find(symbol);
+            if (it != sellOrders.end()) collectDepth(it->second, maxLevels, levels);
+        }
+    }
+
+    // Settle the order at the front of a price level after it traded: filled or cancelled
+    // orders leave the queue, and an iceberg whose visible slice is used up is topped up
+    // from its reserve and loses time priority, reusing the same Order object.
+    void settleFrontOrder(deque<shared_ptr<Order>>& ordersAtPrice, const shared_ptr<Order>& order) {
+        if (order->status == FILLED || order->status == CANCELLED) {
+            ordersAtPrice.pop_front();
+        } else if (order->needsReplenish()) {
+            order->replenish();
+            ordersAtPrice.pop_front();
+            ordersAtPrice.push_back(order);
+        }
+    }
+
+    template <typename Book>
+    static void writeCanonicalSide(ostream& os, const string& symbol, const char* side, const Book& book) {
+        for (const auto& priceLevelPair : book) {
+            for (const auto& order : priceLevelPair.second) {
+                if (order->status != ACTIVE && order->status != PARTIALLY_FILLED) continue;
+                os << "book " << symbol << " " << side << " " << priceLevelPair.first
+                   << " id=" << order->id << " shown=" << order->getDisplayedQuantity()
+                   << " left=" << order->getRemainingQuantity() << " " << order->getVariantString() << "\n";
+            }
+        }
+    }
+
+    // Same level encoding as writeBookSide, from pre-aggregated depth
+    static uint32_t writeDepthLevels(BufferWriter& w, const vector<DepthLevel>& levels, QueryFormat format) {
+        for (size_t i = 0; i < levels.size(); ++i) {
+            if (format == JSON_FORMAT) {
+                if (i > 0) w.put(',');
+                w.put("{\"price\":");
+                w.putNumber(levels[i].price);
+                w.put(",\"quantity\":");
+                w.putNumber(levels[i].quantity);
+                w.put(",\"orders\":");
+                w.putNumber(levels[i].orders);
+                w.put('}');
+            } else {
+                w.putRaw(levels[i].price);
+                w.putRaw<int64_t>(levels[i].quantity);
+                w.putRaw(levels[i].orders);
+            }
+        }
+        return levels.size();
+    }
+
+    // Writes one side of a book and returns the number of entries written
+    template <typename Book>
+    uint32_t writeBookSide(BufferWriter& w, const Book& book, BookView view, QueryFormat format) {
+        uint32_t count = 0;
+        for (const auto& priceLevelPair : book) {
+            double price = priceLevelPair.first;
+
+            if (view == LEVEL_VIEW) {
+                long long levelQty = 0;
+                uint32_t levelOrders = 0;
+                for (const auto& order : priceLevelPair.second) {
+                    if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
+                        levelQty += order->getDisplayedQuantity();
+                        ++levelOrders;
+                    }
+                }
+                if (levelOrders == 0) continue;
+
+                if (format == JSON_FORMAT) {
+                    if (count > 0) w.put(',');
+                    w.put("{\"price\":");
+                    w.putNumber(price);
+                    w.put(",\"quantity\":");
+                    w.putNumber(levelQty);
+                    w.put(",\"orders\":");
+                    w.putNumber(levelOrders);
+                    w.put('}');
+                } else {
+                    w.putRaw(price);
+                    w.putRaw<int64_t>(levelQty);
+                    w.putRaw(levelOrders);
+                }
+                ++count;
+                continue;
+            }
+
+            for (const auto& order : priceLevelPair.second) {
+                if (order->status != ACTIVE && order->status != PARTIALLY_FILLED) continue;
+
+                if (format == JSON_FORMAT) {
+                    if (count > 0) w.put(',');
+                    w.put("{\"price\":");
+                    w.putNumber(price);
+                    w.put(",\"quantity\":");
+                    w.putNumber(order->getDisplayedQuantity());
+                    w.put(",\"id\":");
+                    w.putNumber(order->id);
+                    w.put(",\"type\":");
+                    w.putString(order->getVariantString());
+                    w.put(",\"status\":");
+                    w.putString(order->getStatusString());
+                    w.put(",\"timestamp\":");
+                    w.putString(order->getTimestamp());
+                    w.put('}');
+                } else {
+                    w.putRaw(price);
+                    w.putRaw<int32_t>(order->getDisplayedQuantity());
+                    w.putRaw<int32_t>(order->id);
+                    w.putRaw<uint8_t>(order->variant);
+                    w.putRaw<uint8_t>(order->status);
+                    w.putRaw<int64_t>(order->timestamp);
+                }
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    static size_t beginFrame(BufferWriter& w, FrameType type) {
+        size_t header = w.size();
+        w.putRaw(FRAME_MAGIC);
+        w.putRaw<uint8_t>(type);
+        w.putRaw<uint8_t>(0);
+        w.putRaw<uint32_t>(0);  // payload length, patched by endFrame
+        return header;
+    }
+
+    static void endFrame(BufferWriter& w, size_t header) {
+        size_t payloadStart = header + 8;
+        w.patchRaw<uint32_t>(header + 4, static_cast<uint32_t>(w.size() - payloadStart));
+    }
+
+    // JSON documents are one line each; binary frames are self-delimiting
+    void emitQueryResult(BufferWriter& w, QueryFormat format) {
+        if (format == JSON_FORMAT) {
+            w.put('\n');
+        }
+        out.write(w.data(), w.size());
+        out.flush();
+    }
+
+    // Every fill goes through here so the last traded price stays current for stop triggers.
+    // Restored trades rebuild positions but are not sent to the drop copy again.
+    void recordTrade(const shared_ptr<Trade>& trade, bool restored = false) {
+        tradeHistory.push_back(trade);
+        lastTrades[trade->symbol] = trade;
+        engineIndex.onTrade(trade->symbol, trade->price);
+        if (postTrade) {
+            postTrade->enqueue(trade, restored);
+        }
+        if (fillLog) {
+            lock_guard<mutex> lock(fillLogMutex);
+            *fillLog << trade->getTimestamp() << ',' << trade->symbol << ',' << trade->price << ','
+                     << trade->quantity << ',' << trade->buyOrderId << ',' << trade->sellOrderId << '\n';
+        }
+    }
+
+    // Every book mutation ends here, with the symbol lock still held. Bracket exits released
+    // by the mutation go to work first; matching them ends here again.
+    void onBookChanged(const string& symbol) {
+        if (!orderLinks.empty() && releaseBracketExits(symbol)) {
+            matchOrdersLocked(symbol);
+            return;
+        }
+        publishSnapshot(symbol);
+        updateLegTop(symbol);
+    }
+
+    // Post-match work that needs locks of its own, run once the matching lock is released
+    void afterMatch(const string& symbol) {
+        processTriggeredStops(symbol);
+        processPendingSpreads();
+        evaluateIndex();
+        maybeCompact(symbol);
+    }
+
+    // Best displayed level on each side, skipping levels left holding only cancelled orders
+    TopOfBook readTopOfBook(const string& symbol) {
+        TopOfBook top;
+        auto buyIt = buyOrders.find(symbol);
+        if (buyIt != buyOrders.end()) {
+            top.hasBid = firstDisplayedLevel(buyIt->second, top.bid, top.bidQty);
+        }
+        auto sellIt = sellOrders.find(symbol);
+        if (sellIt != sellOrders.end()) {
+            top.hasAsk = firstDisplayedLevel(sellIt->second, top.ask, top.askQty);
+        }
+        return top;
+    }
+
+    template <typename Book>
+    static bool firstDisplayedLevel(const Book& book, double& price, int& quantity) {
+        for (const auto& priceLevelPair : book) {
+            int levelQty = 0;
+            for (const auto& order : priceLevelPair.second) {
+                if (order->status == ACTIVE || order->status == PARTIALLY_FILLED) {
+                    levelQty += order->getDisplayedQuantity();
+                }
+            }
+            if (levelQty > 0) {
+                price = priceLevelPair.first;
+                quantity = levelQty;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // If this symbol is a spread leg and its top of book moved, patch only this leg's
+    // terms in each spread that uses it and queue those spreads for implied matching
+    void updateLegTop(const string& symbol) {
+        lock_guard<mutex> spreadLock(spreadMutex);
+        auto indexIt = spreadLegIndex.find(symbol);
+        if (indexIt == spreadLegIndex.end()) {
+            return;
+        }
+
+        TopOfBook top = readTopOfBook(symbol);
+        TopOfBook& cached = legTops[symbol];
+        if (top.hasBid == cached.hasBid && top.hasAsk == cached.hasAsk &&
+            top.bid == cached.bid && top.ask == cached.ask &&
+            top.bidQty == cached.bidQty && top.askQty == cached.askQty) {
+            return;
+        }
+        cached = top;
+
+        for (const auto& entry : indexIt->second) {
+            SpreadInstrument& spread = spreads[entry.first];
+            patchLegTerms(spread, spread.legs[entry.second], top);
+            pendingSpreads.insert(entry.first);
+        }
+    }
+
+    static void patchTerm(int64_t& sum, int& missing, bool& hasTerm, int64_t& term,
+                          bool available, int64_t value) {
+        if (hasTerm) sum -= term; else --missing;
+        hasTerm = available;
+        term = available ? value : 0;
+        if (hasTerm) sum += term; else ++missing;
+    }
+
+    static void patchLegTerms(SpreadInstrument& spread, SpreadLeg& leg, const TopOfBook& top) {
+        if (leg.side == BUY) {
+            patchTerm(spread.impliedAskSum, spread.missingAskTerms, leg.hasAskTerm, leg.askTerm,
+                      top.hasAsk, leg.ratio * toPriceMicros(top.ask));
+            patchTerm(spread.impliedBidSum, spread.missingBidTerms, leg.hasBidTerm, leg.bidTerm,
+                      top.hasBid, leg.ratio * toPriceMicros(top.bid));
+        } else {
+            patchTerm(spread.impliedAskSum, spread.missingAskTerms, leg.hasAskTerm, leg.askTerm,
+                      top.hasBid, -leg.ratio * toPriceMicros(top.bid));
+            patchTerm(spread.impliedBidSum, spread.missingBidTerms, leg.hasBidTerm, leg.bidTerm,
+                      top.hasAsk, -leg.ratio * toPriceMicros(top.ask));
+        }
+    }
+
+    // Lock several symbols at once, always in name order so concurrent multi-symbol
+    // operations can't deadlock
+    vector<unique_lock<shared_mutex>> lockSymbols(vector<string> symbols) {
+        sort(symbols.begin(), symbols.end());
+        symbols.erase(unique(symbols.begin(), symbols.end()), symbols.end());
+        vector<unique_lock<shared_mutex>> locks;
+        for (const auto& symbol : symbols) {
+            locks.emplace_back(getOrCreateSymbolMutex(symbol));
+        }
+        return locks;
+    }
+
+    void processPendingSpreads() {
+        while (true) {
+            string name;
+            vector<string> legSymbols;
+            {
+                lock_guard<mutex> spreadLock(spreadMutex);
+                if (pendingSpreads.empty()) {
+                    return;
+                }
+                name = *pendingSpreads.begin();
+                pendingSpreads.erase(pendingSpreads.begin());
+                for (const auto& leg : spreads[name].legs) {
+                    legSymbols.push_back(leg.symbol);
+                }
+            }
+
+            if (matchSpreadAgainstLegs(name, legSymbols)) {
+                for (const auto& legSymbol : legSymbols) {
+                    processTriggeredStops(legSymbol);
+                }
+            }
+        }
+    }
+
+    // Match the spread's best resting orders against implied-in prices while they cross.
+    // The spread book and every leg book are locked together, so each implied fill trades
+    // all legs atomically. Returns whether anything traded.
+    bool matchSpreadAgainstLegs(const string& name, vector<string> symbols) {
+        symbols.push_back(name);
+        auto locks = lockSymbols(symbols);
+
+        bool traded = false;
+        while (true) {
+            auto buyIt = buyOrders.find(name);
+            auto sellIt = sellOrders.find(name);
+            shared_ptr<Order> bid = buyIt != buyOrders.end() ? frontActiveOrder(buyIt->second) : nullptr;
+            shared_ptr<Order> ask = sellIt != sellOrders.end() ? frontActiveOrder(sellIt->second) : nullptr;
+
+            int64_t impliedAsk = 0, impliedBid = 0;
+            bool hasImpliedAsk = false, hasImpliedBid = false;
+            {
+                lock_guard<mutex> spreadLock(spreadMutex);
+                const SpreadInstrument& spread = spreads[name];
+                hasImpliedAsk = spread.hasImpliedAsk();
+                hasImpliedBid = spread.hasImpliedBid();
+                impliedAsk = spread.impliedAskSum;
+                impliedBid = spread.impliedBidSum;
+            }
+
+            if (bid && hasImpliedAsk && toPriceMicros(bid->price) >= impliedAsk) {
+                if (!executeImpliedFill(name, bid, buyIt->second)) break;
+            } else if (ask && hasImpliedBid && toPriceMicros(ask->price) <= impliedBid) {
+                if (!executeImpliedFill(name, ask, sellIt->second)) break;
+            } else {
+                break;
+            }
+            traded = true;
+        }
+
+        if (traded) {
+            for (const auto& symbol : symbols) {
+                onBookChanged(symbol);
+            }
+        }
+        return traded;
+    }
+
+    // First live order at the best level, dropping cancelled ones and emptied levels
+    template <typename Book>
+    static shared_ptr<Order> frontActiveOrder(Book& book) {
+        while (!book.empty()) {
+            auto& ordersAtPrice = book.begin()->second;
+            while (!ordersAtPrice.empty() && ordersAtPrice.front()->status == CANCELLED) {
+                ordersAtPrice.pop_front();
+            }
+            if (!ordersAtPrice.empty()) {
+                return ordersAtPrice.front();
+            }
+            book.erase(book.begin());
+        }
+        return nullptr;
+    }
+
+    // One implied fill of a resting spread order against the top level of every leg.
+    // All leg symbols and the spread are locked by the caller.
+    template <typename Book>
+    bool executeImpliedFill(const string& name, shared_ptr<Order> spreadOrder, Book& spreadBook) {
+        vector<SpreadLeg> legs;
+        {
+            lock_guard<mutex> spreadLock(spreadMutex);
+            legs = spreads[name].legs;
+        }
+
+        // Spread units the top levels can supply, leg by leg
+        int quantity = spreadOrder->getDisplayedQuantity();
+        vector<TopOfBook> tops;
+        for (const auto& leg : legs) {
+            tops.push_back(readTopOfBook(leg.symbol));
+            OrderType legSide = spreadOrder->type == BUY ? leg.side : (leg.side == BUY ? SELL : BUY);
+            int available = legSide == BUY ? tops.back().askQty : tops.back().bidQty;
+            quantity = min(quantity, available / leg.ratio);
+        }
+        if (quantity <= 0) {
+            return false;
+        }
+
+        int64_t spreadPrice = 0;
+        for (size_t i = 0; i < legs.size(); ++i) {
+            const SpreadLeg& leg = legs[i];
+            OrderType legSide = spreadOrder->type == BUY ? leg.side : (leg.side == BUY ? SELL : BUY);
+            double legPrice = legSide == BUY ? tops[i].ask : tops[i].bid;
+            spreadPrice += (leg.side == BUY ? 1 : -1) * leg.ratio * toPriceMicros(legPrice);
+
+            // Leg child order carries the spread order's ID into the leg's trade history
+            auto legOrder = make_shared<Order>(spreadOrder->id, legSide, IOC, legPrice,
+                                               quantity * leg.ratio, leg.symbol, clock.now());
+            legOrder->account = spreadOrder->account;
+            legOrder->spreadLeg = true;
+            sweepOpposite(legOrder, true, "SPREAD");
+            updateLegTop(leg.symbol);
+        }
+
+        double tradePrice = fromPriceMicros(spreadPrice);
+        int buyId = spreadOrder->type == BUY ? spreadOrder->id : 0;
+        int sellId = spreadOrder->type == SELL ? spreadOrder->id : 0;
+        string buyAccount = buyId ? spreadOrder->account : string();
+        string sellAccount = sellId ? spreadOrder->account : string();
+        recordTrade(make_shared<Trade>(buyId, sellId, name, tradePrice, quantity, clock.now(), buyAccount, sellAccount));
+        applyFill(spreadOrder, quantity, tradePrice);
+
+        out << "\nImplied Trade Executed: " << quantity << " " << name
+            << " at $" << fixed << setprecision(2) << tradePrice
+            << " (" << (spreadOrder->type == BUY ? "Buy: " : "Sell: ") << spreadOrder->id << " vs legs)" << endl;
+
+        auto& ordersAtPrice = spreadBook.begin()->second;
+        settleFrontOrder(ordersAtPrice, spreadOrder);
+        if (ordersAtPrice.empty()) {
+            spreadBook.erase(spreadBook.begin());
+        }
+        return true;
+    }
+
+    // Stage the symbol's top levels and last trade for shared memory. Caller holds the symbol
+    // lock; the publisher's writer thread does the seqlock write after it is released.
+    void publishSnapshot(const string& symbol) {
+        if (!snapshotPublisher.isOpen()) {
+            return;
+        }
+
+        vector<DepthLevel> bids, asks;
+        getDepth(symbol, BUY, SNAPSHOT_DEPTH, bids);
+        getDepth(symbol, SELL, SNAPSHOT_DEPTH, asks);
+        auto lastIt = lastTrades.find(symbol);
+
+        snapshotPublisher.publishBook(symbol, bids, asks,
+                                      lastIt != lastTrades.end() ? lastIt->second.get() : nullptr,
+                                      clock.now());
+    }
+
+    bool isWithinPriceBand(const string& symbol, double price) {
+        if (referencePrices.find(symbol) == referencePrices.end()) {
+            return true;
+        }
+
+        double refPrice = referencePrices.at(symbol);
+        double bandPct = priceBandPercentages.at(symbol);
+        double upperLimit = refPrice * (1 + bandPct/100.0);
+        double lowerLimit = refPrice * (1 - bandPct/100.0);
+
+        if (price > upperLimit || price < lowerLimit) {
+            out << "Order rejected: Price " << price << " is outside the allowed band of "
+                 << lowerLimit << " to " << upperLimit << " for " << symbol << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Fire every stop crossed by the last traded price. Called once the sweep that moved
+    // the price has released the symbol lock; triggered orders can trade and move the price
+    // again, so keep collecting until nothing more is crossed. A halted market elects no
+    // stops (the only ones left are bracket exits its mass cancel released); they wait
+    // for trading to resume.
+    void processTriggeredStops(const string& symbol) {
+        if (circuitBreaker.getStatus() != NORMAL_TRADING) {
+            return;
+        }
+        while (true) {
+            vector<shared_ptr<Order>> triggered;
+            double lastPrice;
+            {
+                unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(symbol));
+
+                auto lastIt = lastTrades.find(symbol);
+                if (lastIt == lastTrades.end()) {
+                    return;
+                }
+                lastPrice = lastIt->second->price;
+
+                auto buyIt = buyStops.find(symbol);
+                if (buyIt != buyStops.end()) {
+                    auto& stops = buyIt->second;
+                    auto end = stops.upper_bound(lastPrice);
+                    for (auto it = stops.begin(); it != end; ++it) {
+                        triggered.push_back(it->second);
+                    }
+                    stops.erase(stops.begin(), end);
+                }
+
+                auto sellIt = sellStops.find(symbol);
+                if (sellIt != sellStops.end()) {
+                    auto& stops = sellIt->second;
+                    auto begin = stops.lower_bound(lastPrice);
+                    for (auto it = begin; it != stops.end(); ++it) {
+                        triggered.push_back(it->second);
+                    }
+                    stops.erase(begin, stops.end());
+                }
+            }
+
+            if (triggered.empty()) {
+                return;
+            }
+
+            // Stops crossed by the same print fire in time priority
+            sort(triggered.begin(), triggered.end(),
+                 [](const shared_ptr<Order>& a, const shared_ptr<Order>& b) { return a->id < b->id; });
+
+            for (auto& order : triggered) {
+                if (order->status == CANCELLED) {
+                    continue;
+                }
+                activateStopOrder(order, lastPrice);
+            }
+        }
+    }
+
+    void activateStopOrder(shared_ptr<Order>& order, double lastPrice) {
+        out << "Stop Order " << order->id << " triggered at $" << fixed << setprecision(2)
+             << lastPrice << " (stop $" << order->stopPrice << ")" << endl;
+
+        if (order->variant == STOP) {
+            order->variant = MARKET;
+            executeMarketOrder(order);
+            return;
+        }
+
+        // It enters the book now, behind everything already resting
+        order->variant = LIMIT;
+        order->timestamp = clock.now();
+        unique_lock<shared_mutex> lock(getOrCreateSymbolMutex(order->symbol));
+        addToBook(order);
+        matchOrdersLocked(order->symbol, order.get());
+    }
+
+    void printPendingStops(const string& symbol) {
+        vector<shared_ptr<Order>> pending;
+        auto buyIt = buyStops.find(symbol);
+        if (buyIt != buyStops.end()) {
+            for (const auto& entry : buyIt->second) {
+                pending.push_back(entry.second);
+            }
+        }
+        auto sellIt = sellStops.find(symbol);
+        if (sellIt != sellStops.end()) {
+            for (const auto& entry : sellIt->second) {
+                pending.push_back(entry.second);
+            }
+        }
+
+        bool headerPrinted = false;
+        for (const auto& order : pending) {
+            if (order->status == CANCELLED) {
+                continue;
+            }
+            if (!headerPrinted) {
+                out << "\nPending Stop Orders:" << endl;
+                headerPrinted = true;
+            }
+            out << "Stop: $" << fixed << setprecision(2) << order->stopPrice
+                 << ", Side: " << (order->type == BUY ? "BUY" : "SELL")
+                 << ", Qty: " << order->getRemainingQuantity()
+                 << ", ID: " << order->id
+                 << ", Type: " << order->getVariantString() << endl;
+        }
+    }
+
+    void updateOrderStatus(shared_ptr<Order>& order) {
+        if (order->filled_quantity >= order->quantity) {
+            order->status = FILLED;
+        } else if (order->filled_quantity > 0) {
+            order->status = PARTIALLY_FILLED;
+        }
+        publishStatus(*order);
+    }
+
+    // Make the order's current state visible to order_status; spread leg children have
+    // no record of their own
+    void publishStatus(const Order& order) {
+        if (!order.spreadLeg) {
+            orderStatus.publish(order.id, order.status, order.quantity, order.filled_quantity);
+        }
+    }
+
+    shared_mutex& getOrCreateSymbolMutex(const string& symbol) {
+        static mutex createMutex;
+
+        // First check without locking for performance
+        auto it = symbolMutexes.find(symbol);
+        if (it != symbolMutexes.end()) {
+            return it->second;
+        }
+
+        // If not found, lock and check again (double-checked locking pattern)
+        {
+            lock_guard<mutex> lock(createMutex);
+            // Check again after acquiring lock
+            it = symbolMutexes.find(symbol);
+            if (it != symbolMutexes.end()) {
+                return it->second;
+            }
+            // Create new mutex if still needed
+            return symbolMutexes[symbol];
+        }
+    }
+};
+
+// Whole-token number parsing for command arguments: no exceptions, no trailing text and,
+// for doubles, nothing infinite or NaN. The target is left alone on failure.
+bool parseNumber(const string& text, double& value) {
+    const char* begin = text.c_str();
+    char* end = nullptr;
+    double parsed = strtod(begin, &end);
+    if (text.empty() || end != begin + text.size() || !isfinite(parsed)) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+bool parseNumber(const string& text, int& value) {
+    int parsed = 0;
+    auto result = from_chars(text.data(), text.data() + text.size(), parsed);
+    if (text.empty() || result.ec != errc() || result.ptr != text.data() + text.size()) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+// Parse the rest of a place_order line:
+//   <BUY|SELL> <variant> <price> <quantity> <symbol> [stop=P] [peak=N] [account=A]
+bool parseOrderRequest(istringstream& iss, OrderRequest& request) {
+    string typeStr, variantStr;
+    iss >> typeStr >> variantStr >> request.price >> request.quantity >> request.symbol;
+
+    request.type = (typeStr == "BUY") ? BUY : SELL;
+
+    if (variantStr == "LIMIT") request.variant = LIMIT;
+    else if (variantStr == "MARKET") request.variant = MARKET;
+    else if (variantStr == "IOC") request.variant = IOC;
+    else if (variantStr == "FOK") request.variant = FOK;
+    else if (variantStr == "STOP") request.variant = STOP;
+    else if (variantStr == "STOP_LIMIT") request.variant = STOP_LIMIT;
+    else if (variantStr == "ICEBERG") request.variant = ICEBERG;
+    else {
+        cerr << "Invalid order variant: " << variantStr << endl;
+        return false;
+    }
+
+    // Optional key=value attributes after the symbol
+    request.stopPrice = request.price;
+    string option;
+    while (iss >> option) {
+        size_t eq = option.find('=');
+        string key = option.substr(0, eq);
+        string value = eq == string::npos ? "" : option.substr(eq + 1);
+        if (key == "stop") {
+            if (!parseNumber(value, request.stopPrice) || request.stopPrice <= 0) {
+                cerr << "Invalid stop price: " << value << endl;
+                return false;
+            }
+        } else if (key == "peak") {
+            if (!parseNumber(value, request.peakSize) || request.peakSize <= 0) {
+                cerr << "Invalid peak size: " << value << endl;
+                return false;
+            }
+        } else if (key == "account") {
+            request.account = value;
+        } else {
+            cerr << "Ignoring unknown order option: " << option << endl;
+        }
+    }
+    return true;
+}
+
+// Orders in parseOrderRequest syntax separated by '|', for the linked-order commands
+bool parseLinkedOrders(istringstream& iss, vector<OrderRequest>& requests) {
+    string rest;
+    getline(iss, rest);
+    size_t start = 0;
+    while (true) {
+        size_t bar = rest.find('|', start);
+        istringstream spec(rest.substr(start, bar == string::npos ? string::npos : bar - start));
+        OrderRequest request;
+        if (!parseOrderRequest(spec, request)) {
+            return false;
+        }
+        requests.push_back(request);
+        if (bar == string::npos) {
+            return true;
+        }
+        start = bar + 1;
+    }
+}
+
+// Parse and run one command line against the book. Returns false on "exit".
+bool executeCommand(OrderBook& orderBook, const string& line) {
+    istringstream iss(line);
+    string command;
+
+    iss >> command;
+
+    if (command.empty()) {
+        return true;
+    } else if (command == "exit") {
+        return false;
+    } else if (command == "place_order") {
+        StageScope parse(orderBook.stageProfiler(), LIMIT, STAGE_PARSE);
+        OrderRequest request;
+        bool parsed = parseOrderRequest(iss, request);
+        parse.setVariant(request.variant);
+        parse.finish(parsed);
+        if (!parsed) {
+            return true;
+        }
+
+        if (request.variant == STOP || request.variant == STOP_LIMIT) {
+            orderBook.placeStopOrder(request.type, request.variant, request.price, request.stopPrice,
+                                     request.quantity, request.symbol, request.account);
+        } else {
+            orderBook.placeOrder(request.type, request.variant, request.price, request.quantity,
+                                 request.symbol, request.peakSize, request.account);
+        }
+    } else if (command == "cancel_order") {
+        int orderId;
+        iss >> orderId;
+        orderBook.cancelOrder(orderId);
+    } else if (command == "mass_cancel") {
+        // mass_cancel [symbol=SYM] [side=BUY|SELL] [account=ACC] [min=PRICE] [max=PRICE]
+        MassCancelFilter filter;
+        string option;
+        while (iss >> option) {
+            size_t eq = option.find('=');
+            string key = option.substr(0, eq);
+            string value = eq == string::npos ? "" : option.substr(eq + 1);
+            if (key == "symbol") filter.symbol = value;
+            else if (key == "side") { filter.anySide = false; filter.side = value == "BUY" ? BUY : SELL; }
+            else if (key == "account") filter.account = value;
+            else if (key == "min" || key == "max") {
+                // A bad bound must not widen the cancel to every price
+                double& bound = key == "min" ? filter.minPrice : filter.maxPrice;
+                if (!parseNumber(value, bound) || bound < 0) {
+                    cerr << "Invalid mass cancel " << key << " price: " << value << endl;
+                    return true;
+                }
+            } else cerr << "Ignoring unknown mass cancel option: " << option << endl;
+        }
+        orderBook.massCancel(filter);
+    } else if (command == "mass_quote") {
+        // mass_quote ACCOUNT SYM BID_PX BID_QTY ASK_PX ASK_QTY [SYM BID_PX BID_QTY ASK_PX ASK_QTY ...]
+        string account;
+        iss >> account;
+        vector<string> fields;
+        string field;
+        while (iss >> field) {
+            fields.push_back(field);
+        }
+        // Whole groups of five only; a short or malformed trailing group fails the command
+        bool valid = !fields.empty() && fields.size() % 5 == 0;
+        vector<QuoteRequest> quotes;
+        for (size_t i = 0; valid && i < fields.size(); i += 5) {
+            QuoteRequest quote;
+            quote.symbol = fields[i];
+            valid = parseNumber(fields[i + 1], quote.bidPrice) && parseNumber(fields[i + 2], quote.bidQuantity) &&
+                    parseNumber(fields[i + 3], quote.askPrice) && parseNumber(fields[i + 4], quote.askQuantity);
+            quotes.push_back(quote);
+        }
+        if (account.empty() || !valid) {
+            cerr << "Usage: mass_quote ACCOUNT SYM BID_PX BID_QTY ASK_PX ASK_QTY [...]" << endl;
+        } else {
+            orderBook.massQuote(account, quotes);
+        }
+    } else if (command == "place_oco" || command == "place_bracket") {
+        // place_oco <order> | <order> [| <order> ...]
+        // place_bracket <entry order> | <exit order> [| <exit order> ...]
+        // Each order in place_order syntax
+        vector<OrderRequest> orders;
+        if (!parseLinkedOrders(iss, orders)) {
+            cerr << "Usage: " << command << " <BUY|SELL> <variant> <price> <quantity> <symbol> [stop=P] [peak=N]"
+                 << " [account=A] | ..." << endl;
+        } else if (command == "place_oco") {
+            orderBook.placeOCO(orders);
+        } else {
+            orderBook.placeBracket(orders.front(), vector<OrderRequest>(orders.begin() + 1, orders.end()));
+        }
+    } else if (command == "archive") {
+        string path;
+        iss >> path;
+        orderBook.writeArchive(path);
+    } else if (command == "print_positions") {
+        string account;
+        iss >> account;
+        orderBook.printPositions(account);
+    } else if (command == "print_profile") {
+        orderBook.printProfile();
+    } else if (command == "print_memory") {
+        string symbol;
+        iss >> symbol;
+        orderBook.printMemory(symbol);
+    } else if (command == "compact") {
+        orderBook.compactAll();
+    } else if (command == "print_orderbook") {
+        string symbol;
+        iss >> symbol;
+        orderBook.printOrderBook(symbol);
+    } else if (command == "print_trades") {
+        string symbol;
+        iss >> symbol;
+        orderBook.printTradeHistory(symbol);
+    } else if (command == "query_book") {
+        // query_book <symbol> [levels|orders] [json|binary] [max levels]
+        string symbol, viewStr = "levels", formatStr = "json";
+        size_t maxLevels = 0;
+        iss >> symbol >> viewStr >> formatStr >> maxLevels;
+        orderBook.queryOrderBook(symbol, viewStr == "orders" ? ORDER_VIEW : LEVEL_VIEW,
+                                 formatStr == "binary" ? BINARY_FORMAT : JSON_FORMAT, maxLevels);
+    } else if (command == "order_status") {
+        // order_status <order ID> [json|binary]
+        int orderId = 0;
+        string formatStr = "json";
+        iss >> orderId >> formatStr;
+        orderBook.queryOrderStatus(orderId, formatStr == "binary" ? BINARY_FORMAT : JSON_FORMAT);
+    } else if (command == "print_depth") {
+        string symbol;
+        size_t maxLevels = DEPTH_CACHE_LEVELS;
+        iss >> symbol >> maxLevels;
+        orderBook.printDepth(symbol, maxLevels);
+    } else if (command == "query_trades") {
+        string symbol, formatStr = "json";
+        iss >> symbol >> formatStr;
+        orderBook.queryTrades(symbol, formatStr == "binary" ? BINARY_FORMAT : JSON_FORMAT);
+    } else if (command == "query_status") {
+        string formatStr = "json";
+        iss >> formatStr;
+        orderBook.queryStatus(formatStr == "binary" ? BINARY_FORMAT : JSON_FORMAT);
+    } else if (command == "define_spread") {
+        // define_spread <name> <symbol>:<BUY|SELL>:<ratio> ...
+        string name, legSpec;
+        iss >> name;
+        vector<SpreadLeg> legs;
+        while (iss >> legSpec) {
+            size_t first = legSpec.find(':');
+            size_t second = legSpec.find(':', first + 1);
+            if (first == string::npos) {
+                cerr << "Invalid spread leg: " << legSpec << endl;
+                return true;
+            }
+            SpreadLeg leg;
+            leg.symbol = legSpec.substr(0, first);
+            string sideStr = legSpec.substr(first + 1, second - first - 1);
+            if (sideStr != "BUY" && sideStr != "SELL") {
+                cerr << "Invalid spread leg side: " << legSpec << endl;
+                return true;
+            }
+            leg.side = sideStr == "SELL" ? SELL : BUY;
+            leg.ratio = 1;
+            if (second != string::npos && (!parseNumber(legSpec.substr(second + 1), leg.ratio) || leg.ratio < 1)) {
+                cerr << "Invalid spread leg ratio: " << legSpec << endl;
+                return true;
+            }
+            legs.push_back(leg);
+        }
+        orderBook.defineSpread(name, legs);
+    } else if (command == "place_spread_order") {
+        // place_spread_order <BUY|SELL> <spread> <price> <quantity>
+        // Spread prices may be negative; only the quantity must be positive
+        string typeStr, name, priceStr, quantityStr;
+        double price = 0.0;
+        int quantity = 0;
+        iss >> typeStr >> name >> priceStr >> quantityStr;
+        if ((typeStr != "BUY" && typeStr != "SELL") || name.empty() || !parseNumber(priceStr, price) ||
+            !parseNumber(quantityStr, quantity) || quantity < 1) {
+            cerr << "Usage: place_spread_order <BUY|SELL> <spread> <price> <quantity>" << endl;
+            return true;
+        }
+        orderBook.placeSpreadOrder(typeStr == "BUY" ? BUY : SELL, name, price, quantity);
+    } else if (command == "print_implied") {
+        string name;
+        iss >> name;
+        orderBook.printImpliedPrices(name);
+    } else if (command == "dump_state") {
+        orderBook.dumpState();
+    } else if (command == "update_index") {
+        double indexValue;
+        iss >> indexValue;
+        orderBook.updateIndexValue(indexValue);
+    } else if (command == "set_price_band") {
+        // set_price_band <symbol> <reference price> <band percent>
+        string symbol;
+        double referencePrice = 0.0, bandPercentage = 0.0;
+        iss >> symbol >> referencePrice >> bandPercentage;
+        orderBook.setStockPriceBand(symbol, referencePrice, bandPercentage);
+    } else if (command == "set_tick_size") {
+        string symbol;
+        double tick = 0.0;
+        iss >> symbol >> tick;
+        orderBook.setTickSize(symbol, tick);
+    } else if (command == "set_allocation") {
+        // set_allocation <symbol> <FIFO|PRO_RATA|LMM> [lmm=ACCOUNT] [pct=N]
+        string symbol, policy, option;
+        AllocationRule rule;
+        iss >> symbol >> policy;
+        if (policy == "FIFO") rule.policy = ALLOC_FIFO;
+        else if (policy == "PRO_RATA") rule.policy = ALLOC_PRO_RATA;
+        else if (policy == "LMM") rule.policy = ALLOC_LMM;
+        else {
+            cerr << "Usage: set_allocation <symbol> <FIFO|PRO_RATA|LMM> [lmm=ACCOUNT] [pct=N]" << endl;
+            return true;
+        }
+        while (iss >> option) {
+            size_t eq = option.find('=');
+            string key = option.substr(0, eq);
+            string value = eq == string::npos ? "" : option.substr(eq + 1);
+            if (key == "lmm") rule.lmmAccount = value;
+            else if (key == "pct") {
+                if (!parseNumber(value, rule.lmmPercent) || rule.lmmPercent < 0 || rule.lmmPercent > 100) {
+                    cerr << "Invalid LMM percentage: " << value << endl;
+                    return true;
+                }
+            } else cerr << "Ignoring unknown allocation option: " << option << endl;
+        }
+        if (rule.policy == ALLOC_LMM && rule.lmmAccount.empty()) {
+            cerr << "set_allocation: LMM needs lmm=ACCOUNT" << endl;
+            return true;
+        }
+        orderBook.setAllocationPolicy(symbol, rule);
+    } else if (command == "set_index_constituent") {
+        // set_index_constituent <symbol> <weight or free-float shares> <base price>
+        string symbol;
+        double weight = 0.0, basePrice = 0.0;
+        iss >> symbol >> weight >> basePrice;
+        orderBook.setIndexConstituent(symbol, weight, basePrice);
+    } else if (command == "set_index_interval") {
+        // set_index_interval <milliseconds between breaker evaluations>
+        int64_t milliseconds = 0;
+        iss >> milliseconds;
+        orderBook.setIndexInterval(milliseconds);
+    } else if (command == "print_index") {
+        orderBook.printIndex();
+    } else if (command == "set_index_reference") {
+        double value = 0.0;
+        iss >> value;
+        orderBook.setIndexReference(value);
+    } else if (command == "save_snapshot") {
+        string path;
+        iss >> path;
+        orderBook.saveSnapshot(path);
+    } else if (command == "load_snapshot") {
+        string path;
+        iss >> path;
+        orderBook.loadSnapshot(path);
+    } else {
+        cerr << "Unknown command: " << command << endl;
+    }
+
+    return true;
+}
+
+// Feeds command lines to a book. With batching on, a run of resting limit/iceberg orders
+// for one symbol is held back and placed with placeOrderBatch; any other command flushes
+// the run first, so everything still takes effect in arrival order.
+class CommandRunner {
+private:
+    OrderBook& book;
+    bool deterministic;
+    size_t maxBatch;
+    vector<OrderRequest> pending;
+
+public:
+    CommandRunner(OrderBook& orderBook, const EngineConfig& config)
+        : book(orderBook), deterministic(config.deterministic), maxBatch(config.orderBatch) {}
+
+    // Returns false once the input asked to exit
+    bool submit(const string& line) {
+        if (deterministic) {
+            book.advanceClock(1000000);  // 1ms of logical time per command
+        }
+
+        OrderRequest request;
+        bool batchable = false;
+        if (maxBatch > 0) {
+            StageScope parse(book.stageProfiler(), LIMIT, STAGE_PARSE);
+            batchable = parseBatchable(line, request);
+            parse.setVariant(request.variant);
+            parse.finish(batchable);
+        }
+        if (batchable) {
+            if (!pending.empty() && pending.front().symbol != request.symbol) {
+                flush();
+            }
+            request.timestamp = book.currentTime();
+            pending.push_back(move(request));
+            if (pending.size() >= maxBatch) {
+                flush();
+            }
+            return true;
+        }
+
+        flush();
+        return executeCommand(book, line);
+    }
+
+    void flush() {
+        if (!pending.empty()) {
+            book.placeOrderBatch(pending);
+            pending.clear();
+        }
+    }
+
+    bool idle() const {
+        return pending.empty();
+    }
+
+private:
+    static bool parseBatchable(const string& line, OrderRequest& request) {
+        istringstream iss(line);
+        string command, side, variant;
+        iss >> command >> side >> variant;
+        if (command != "place_order" || (variant != "LIMIT" && variant != "ICEBERG")) {
+            return false;
+        }
+
+        istringstream order(line);
+        order >> command;
+        return parseOrderRequest(order, request);
+    }
+};
+
+// Commands handed from the IO thread to the matching thread; `last` ends the run
+struct InputLine {
+    string text;
+    bool last = false;
+};
+
+// Threaded command runner. This (IO) thread reads commands into a bounded queue; a
+// matching thread, pinned and bound to its local NUMA node before it builds the book,
+// executes them in arrival order. setUp runs on the matching thread against the new book.
+template <typename SetUp>
+int runThreaded(istream& input, const EngineConfig& config, SetUp setUp) {
+    if (config.ioCpu >= 0) {
+        pinCurrentThread(config.ioCpu, "IO");
+    }
+
+    SpscQueue<InputLine> queue(config.inputQueueCapacity, config.inputWait);
+    int status = 0;
+
+    thread matcher([&]() {
+        if (config.matchingCpu >= 0 && pinCurrentThread(config.matchingCpu, "matching")) {
+            bindMemoryToLocalNode();
+        }
+
+        OrderBook orderBook(config);
+        bool running = setUp(orderBook);
+        if (!running) {
+            status = 1;
+        }
+        bool ready = running;
+
+        // Keep draining after exit so the IO thread never blocks on a full queue.
+        // Whenever the queue runs dry the matcher places any batched orders and
+        // compacts books before waiting, so a burst becomes one batch.
+        CommandRunner runner(orderBook, config);
+        auto next = [&]() {
+            if (running && queue.empty()) {
+                runner.flush();
+                orderBook.compactIdle();
+            }
+            return queue.pop();
+        };
+        for (InputLine line = next(); !line.last; line = next()) {
+            if (!running) continue;
+            running = runner.submit(line.text);
+        }
+        runner.flush();
+        if (ready) {
+            orderBook.settleIndex();
+        }
+
+        if (ready && orderBook.stageProfiler()) {
+            orderBook.printProfile();
+        }
+        if (ready && config.deterministic) {
+            cout << "\n===== Canonical State =====" << endl;
+            orderBook.writeCanonicalState(cout);
+        }
+    });
 
-                double matchPrice = sellIt->first;
-                auto& ordersAtPrice = sellIt->second;
+    string text;
+    while (getline(input, text)) {
+        queue.push({ move(text), false });
+    }
+    queue.push({ string(), true });
 
-                for (auto orderIt = ordersAtPrice.begin();
-                     orderIt != ordersAtPrice.end() && remainingQty > 0;
-                     /* increment in loop */) {
+    matcher.join();
+    return status;
+}
 
-                    auto& sellOrder = *orderIt;
+// Discards everything written to it
+class NullStreamBuf : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char*, streamsize n) override { return n; }
+};
 
-                    // Skip cancelled orders
-                    if (sellOrder->status == CANCELLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                        continue;
-                    }
+// Appends everything written to it to a string
+class StringAppendBuf : public streambuf {
+private:
+    string& target;
 
-                    // Determine match quantity
-                    int matchQty = min(remainingQty, sellOrder->getRemainingQuantity());
+public:
+    explicit StringAppendBuf(string& output) : target(output) {}
 
-                    // Execute the trade
-                    auto trade = make_shared<Trade>(order->id, sellOrder->id, order->symbol, matchPrice, matchQty);
-                    tradeHistory.push_back(trade);
+protected:
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            target.push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
 
-                    // Update quantities
-                    remainingQty -= matchQty;
-                    order->filled_quantity += matchQty;
-                    sellOrder->filled_quantity += matchQty;
+    streamsize xsputn(const char* s, streamsize n) override {
+        target.append(s, n);
+        return n;
+    }
+};
 
-                    // Update order status
-                    updateOrderStatus(sellOrder);
+// File output written in whole blocks. The engine log ends every line with endl, and a
+// flush per line would cost a write syscall per event in a long replay; here sync() is a
+// no-op and data reaches the file when the block fills or the buffer is destroyed.
+class BlockFileBuf : public streambuf {
+private:
+    ofstream file;
+    vector<char> block;
 
-                    cout << "\nTrade Executed: " << matchQty << " " << order->symbol
-                         << " at $" << fixed << setprecision(2) << matchPrice
-                         << " (Buy: " << order->id << " [FOK], Sell: " << sellOrder->id << ")" << endl;
+public:
+    explicit BlockFileBuf(const string& path, size_t blockSize = 1 << 20)
+        : file(path, ios::binary), block(blockSize) {
+        setp(block.data(), block.data() + block.size());
+    }
 
-                    // Remove filled sell orders
-                    if (sellOrder->status == FILLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                    } else {
-                        ++orderIt;
-                    }
-                }
+    ~BlockFileBuf() override {
+        drain();
+    }
 
-                // Clean up empty price levels
-                if (ordersAtPrice.empty()) {
-                    sellIt = sellBook.erase(sellIt);
-                } else {
-                    ++sellIt;
-                }
+    bool is_open() const {
+        return file.is_open();
+    }
+
+protected:
+    int overflow(int c) override {
+        drain();
+        if (c != traits_type::eof()) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        return 0;
+    }
+
+private:
+    void drain() {
+        file.write(pbase(), pptr() - pbase());
+        setp(block.data(), block.data() + block.size());
+    }
+};
+
+// Seeded random order flow over a couple of symbols, exercising every order variant and
+// cancels, for differential runs
+vector<string> generateOrderFlow(unsigned seed, int count) {
+    mt19937 rng(seed);
+    const char* symbols[] = { "AAA", "BBB" };
+    const char* variants[] = { "LIMIT", "LIMIT", "LIMIT", "LIMIT", "LIMIT", "MARKET", "IOC", "FOK",
+                               "STOP", "STOP_LIMIT", "ICEBERG" };
+
+    // AAA allocates FIFO; BBB pro-rata or with a lead market maker, by seed
+    vector<string> flow;
+    flow.push_back(seed % 2 ? "set_allocation BBB PRO_RATA" : "set_allocation BBB LMM lmm=MM0 pct=40");
+    flow.push_back(seed % 3 ? "set_index_interval 0" : "set_index_interval 1");
+    int placed = 0;
+    for (int i = 0; i < count; ++i) {
+        // Halfway in, AAA joins the index at a base that an AAA fill at the bottom of the
+        // price range takes past the first breaker level, halting the rest of the flow
+        if (i == count / 2) {
+            flow.push_back("set_index_constituent AAA 1 106");
+        }
+        ostringstream line;
+        if (placed > 0 && rng() % 10 == 0) {
+            line << "cancel_order " << (1 + rng() % placed);
+        } else if (rng() % 25 == 0) {
+            line << "mass_quote MM" << rng() % 2 << fixed << setprecision(2);
+            for (const char* symbol : symbols) {
+                double bid = 95.0 + 0.5 * (rng() % 20);
+                line << " " << symbol << " " << bid << " " << rng() % 10 << " " << bid + 0.5 * (1 + rng() % 3)
+                     << " " << rng() % 10;
+            }
+        } else if (rng() % 30 == 0) {
+            // An OCO pair, or a bracket whose exits straddle its entry price
+            const char* symbol = symbols[rng() % 2];
+            bool buy = rng() % 2;
+            double price = 97.0 + 0.5 * (rng() % 13);
+            double offset = 0.5 * (1 + rng() % 4);
+            int quantity = 1 + rng() % 20;
+            const char* side = buy ? "BUY" : "SELL";
+            const char* exitSide = buy ? "SELL" : "BUY";
+            line << fixed << setprecision(2);
+            if (rng() % 2) {
+                line << "place_oco " << side << " LIMIT " << price - (buy ? offset : -offset) << " " << quantity
+                     << " " << symbol << " | " << side << " STOP " << price + (buy ? offset : -offset) << " "
+                     << quantity << " " << symbol;
+                placed += 2;
+            } else {
+                line << "place_bracket " << side << " LIMIT " << price << " " << quantity << " " << symbol
+                     << " | " << exitSide << " LIMIT " << price + (buy ? offset : -offset) << " " << quantity << " "
+                     << symbol << " | " << exitSide << " STOP " << price - (buy ? offset : -offset) << " "
+                     << quantity << " " << symbol;
+                placed += 3;
+            }
+        } else if (rng() % 100 == 0) {
+            line << "mass_cancel symbol=" << symbols[rng() % 2] << " side=" << (rng() % 2 ? "BUY" : "SELL")
+                 << " min=" << 95.0 + 0.5 * (rng() % 21);
+        } else {
+            const char* variant = variants[rng() % (sizeof(variants) / sizeof(variants[0]))];
+            const char* side = rng() % 2 ? "BUY" : "SELL";
+            double price = 95.0 + 0.5 * (rng() % 21);
+            int quantity = 1 + rng() % 20;
+            line << "place_order " << side << " " << variant << " " << fixed << setprecision(2)
+                 << price << " " << quantity << " " << symbols[rng() % 2];
+            if (strcmp(variant, "STOP_LIMIT") == 0) {
+                line << " stop=" << price + (side[0] == 'B' ? -0.5 : 0.5);
+            } else if (strcmp(variant, "ICEBERG") == 0) {
+                line << " peak=" << 1 + rng() % 5;
             }
-        } else { // SELL FOK order
-            auto& buyBook = buyOrders[order->symbol];
-            int remainingQty = order->quantity;
+            if (rng() % 4 == 0) {
+                line << " account=ACC" << rng() % 3;
+            }
+            ++placed;
+        }
+        flow.push_back(line.str());
+    }
+    return flow;
+}
 
-            // Go through buy orders from highest to lowest price
-            for (auto buyIt = buyBook.begin();
-                 buyIt != buyBook.end() && remainingQty > 0 && buyIt->first >= order->price;
-                 /* increment in loop */) {
+// Feed the same command flow to a reference book and to a candidate book and stop at the
+// first command after which their canonical state differs
+int runDifferential(const vector<string>& flow, const EngineConfig& candidateConfig) {
+    EngineConfig referenceConfig = EngineConfig::reference();
+    referenceConfig.deterministic = true;
+    EngineConfig testedConfig = candidateConfig;
+    testedConfig.deterministic = true;
+    // Compact far more often than a live engine would, so short flows exercise it
+    if (testedConfig.compactAfterCancels > 8) {
+        testedConfig.compactAfterCancels = 8;
+    }
+    if (testedConfig.orderBatch == 0) {
+        testedConfig.orderBatch = 16;
+    }
 
-                double matchPrice = buyIt->first;
-                auto& ordersAtPrice = buyIt->second;
+    OrderBook reference(referenceConfig);
+    OrderBook candidate(testedConfig);
+    NullStreamBuf sink;
+    reference.setOutput(&sink);
+    candidate.setOutput(&sink);
+    CommandRunner referenceRunner(reference, referenceConfig);
+    CommandRunner candidateRunner(candidate, testedConfig);
+
+    for (size_t i = 0; i < flow.size(); ++i) {
+        bool keepGoing = referenceRunner.submit(flow[i]);
+        candidateRunner.submit(flow[i]);
+        if (i + 1 == flow.size() || !keepGoing) {
+            candidateRunner.flush();
+        }
+        // A batch still being collected has not taken effect yet
+        if (!candidateRunner.idle()) {
+            continue;
+        }
 
-                for (auto orderIt = ordersAtPrice.begin();
-                     orderIt != ordersAtPrice.end() && remainingQty > 0;
-                     /* increment in loop */) {
+        ostringstream expected, actual;
+        reference.writeCanonicalState(expected);
+        candidate.writeCanonicalState(actual);
+        if (expected.str() != actual.str()) {
+            istringstream expectedLines(expected.str()), actualLines(actual.str());
+            string expectedLine, actualLine;
+            int lineNumber = 1;
+            while (true) {
+                bool moreExpected = static_cast<bool>(getline(expectedLines, expectedLine));
+                bool moreActual = static_cast<bool>(getline(actualLines, actualLine));
+                if (!moreExpected) expectedLine = "<end>";
+                if (!moreActual) actualLine = "<end>";
+                if (expectedLine != actualLine || (!moreExpected && !moreActual)) break;
+                ++lineNumber;
+            }
+            cout << "DIVERGENCE after command " << i + 1 << ": " << flow[i] << endl;
+            cout << "  state line " << lineNumber << endl;
+            cout << "  reference: " << expectedLine << endl;
+            cout << "  candidate: " << actualLine << endl;
+            return 1;
+        }
 
-                    auto& buyOrder = *orderIt;
+        if (!keepGoing) break;
+    }
 
-                    // Skip cancelled orders
-                    if (buyOrder->status == CANCELLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                        continue;
-                    }
+    cout << "No divergence over " << flow.size() << " commands" << endl;
+    return 0;
+}
 
-                    // Determine match quantity
-                    int matchQty = min(remainingQty, buyOrder->getRemainingQuantity());
+// Outcome of one backtest run over a recorded command file
+struct BacktestRun {
+    string input;
+    string name;  // Stem of the run's output files
+    bool ok = false;
+    size_t commands = 0;
+    int orders = 0;
+    map<string, TradeStats> symbols;
+    double seconds = 0.0;
+
+    TradeStats totals() const {
+        TradeStats total;
+        for (const auto& entry : symbols) total.add(entry.second);
+        return total;
+    }
+};
 
-                    // Execute the trade
-                    auto trade = make_shared<Trade>(buyOrder->id, order->id, order->symbol, matchPrice, matchQty);
-                    tradeHistory.push_back(trade);
+void writeTradeStats(ostream& os, const string& label, const TradeStats& stats) {
+    os << label << " trades=" << stats.trades << " volume=" << stats.volume << " notional="
+       << stats.notional << " vwap=" << stats.vwap() << endl;
+}
 
-                    // Update quantities
-                    remainingQty -= matchQty;
-                    order->filled_quantity += matchQty;
-                    buyOrder->filled_quantity += matchQty;
+// Replay one command file into its own deterministic book. The engine log (with the
+// final canonical state) goes to <name>.log, fills stream to <name>.fills.csv as they
+// happen and the run's counters go to <name>.stats.
+template <typename SetUp>
+void runBacktestFile(BacktestRun& run, const string& outputDir, const EngineConfig& config, SetUp setUp) {
+    auto started = chrono::steady_clock::now();
+    string stem = outputDir + "/" + run.name;
+
+    ifstream input(run.input);
+    BlockFileBuf logBuffer(stem + ".log");
+    ostream log(&logBuffer);
+    ofstream fills(stem + ".fills.csv");
+    if (!input.is_open() || !logBuffer.is_open() || !fills.is_open()) {
+        cerr << "Backtest " << run.name << ": cannot open " << (input.is_open() ? stem : run.input) << endl;
+        return;
+    }
 
-                    // Update order status
-                    updateOrderStatus(buyOrder);
+    OrderBook orderBook(config);
+    orderBook.setOutput(&logBuffer);
+    if (!setUp(orderBook)) {
+        return;
+    }
+    fills << "time,symbol,price,quantity,buy_id,sell_id\n";
+    orderBook.setFillLog(&fills);
+
+    CommandRunner runner(orderBook, config);
+    string line;
+    while (getline(input, line)) {
+        ++run.commands;
+        if (!runner.submit(line)) break;
+    }
+    runner.flush();
+    orderBook.settleIndex();
 
-                    cout << "\nTrade Executed: " << matchQty << " " << order->symbol
-                         << " at $" << fixed << setprecision(2) << matchPrice
-                         << " (Buy: " << buyOrder->id << ", Sell: " << order->id << " [FOK])" << endl;
+    if (orderBook.stageProfiler()) {
+        orderBook.printProfile();
+    }
+    log << "\n===== Canonical State =====" << endl;
+    orderBook.writeCanonicalState(log);
+
+    run.orders = orderBook.ordersCreated();
+    run.symbols = orderBook.summarizeTrades();
+    run.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    run.ok = true;
+
+    ofstream stats(stem + ".stats");
+    stats << fixed << setprecision(2);
+    stats << "input " << run.input << endl;
+    stats << "commands " << run.commands << endl;
+    stats << "orders " << run.orders << endl;
+    writeTradeStats(stats, "total", run.totals());
+    for (const auto& entry : run.symbols) {
+        writeTradeStats(stats, "symbol " + entry.first, entry.second);
+    }
+    stats << "seconds " << setprecision(3) << run.seconds << endl;
+}
 
-                    // Remove filled buy orders
-                    if (buyOrder->status == FILLED) {
-                        orderIt = ordersAtPrice.erase(orderIt);
-                    } else {
-                        ++orderIt;
+// Replay many recorded files (days, symbol partitions) side by side. Runs share nothing:
+// each has its own book and logical clock, so a run's log matches a --deterministic
+// replay of that file alone (less the startup banner) whatever the thread count. Workers take the next file as they
+// finish one; the per-run counters are merged into summary.txt once all runs are done.
+template <typename SetUp>
+int runBacktest(const vector<string>& files, const string& outputDir, unsigned jobs,
+                const EngineConfig& config, SetUp setUp) {
+    if (mkdir(outputDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Cannot create backtest output directory " << outputDir << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    vector<BacktestRun> runs(files.size());
+    map<string, int> stemCounts;
+    for (size_t i = 0; i < files.size(); ++i) {
+        string stem = files[i].substr(files[i].find_last_of('/') + 1);
+        size_t dot = stem.find_last_of('.');
+        if (dot != string::npos && dot > 0) stem.resize(dot);
+        int seen = stemCounts[stem]++;
+        runs[i].input = files[i];
+        runs[i].name = seen ? stem + "-" + to_string(seen) : stem;
+    }
+
+    if (jobs == 0) jobs = max(1u, thread::hardware_concurrency());
+    jobs = min<unsigned>(jobs, files.size());
+    cout << "Backtest: " << files.size() << " runs on " << jobs << " threads" << endl;
+
+    auto started = chrono::steady_clock::now();
+    atomic<size_t> nextRun(0);
+    vector<thread> workers;
+    for (unsigned w = 0; w < jobs; ++w) {
+        workers.emplace_back([&]() {
+            for (size_t i = nextRun++; i < runs.size(); i = nextRun++) {
+                runBacktestFile(runs[i], outputDir, config, setUp);
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    ofstream summary(outputDir + "/summary.txt");
+    ostringstream report;
+    report << fixed << setprecision(2);
+    map<string, TradeStats> symbols;
+    size_t commands = 0, failed = 0;
+    long long orders = 0;
+    double runSeconds = 0.0;
+    for (const auto& run : runs) {
+        if (!run.ok) {
+            report << "run " << run.name << " FAILED" << endl;
+            ++failed;
+            continue;
+        }
+        TradeStats total = run.totals();
+        report << "run " << run.name << " commands=" << run.commands << " orders=" << run.orders
+               << " trades=" << total.trades << " volume=" << total.volume
+               << " seconds=" << setprecision(3) << run.seconds << setprecision(2) << endl;
+        for (const auto& entry : run.symbols) symbols[entry.first].add(entry.second);
+        commands += run.commands;
+        orders += run.orders;
+        runSeconds += run.seconds;
+    }
+    TradeStats total;
+    for (const auto& entry : symbols) {
+        writeTradeStats(report, "symbol " + entry.first, entry.second);
+        total.add(entry.second);
+    }
+    report << "runs " << runs.size() - failed << " ok, " << failed << " failed" << endl;
+    report << "commands " << commands << " orders " << orders << endl;
+    writeTradeStats(report, "total", total);
+    report << setprecision(3) << "wall seconds " << wallSeconds << " (" << runSeconds
+           << " run seconds, " << setprecision(0) << (wallSeconds > 0 ? commands / wallSeconds : 0.0)
+           << " commands/s)" << endl;
+
+    summary << report.str();
+    cout << report.str();
+    return failed ? 1 : 0;
+}
+
+// Admission limits for each gateway session
+struct GatewayLimits {
+    double rate = 0.0;         // Commands per second a session may sustain (0 = unthrottled)
+    double burst = 0.0;        // Commands a session may send back to back (0 = one second's worth)
+    size_t queueDepth = 1024;  // Commands a session may have waiting; more are rejected
+};
+
+// Log2 histogram of latencies: bucket 0 counts under 1 us, bucket i [2^(i-1), 2^i) us,
+// and the last bucket everything longer
+class LatencyHistogram {
+private:
+    static const int BUCKETS = 24;
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total = 0;
+    int64_t maxNs = 0;
+
+    static int64_t bucketLimitUs(int bucket) {
+        return int64_t(1) << bucket;
+    }
+
+public:
+    void add(int64_t ns) {
+        int64_t us = ns / 1000;
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && us >= bucketLimitUs(bucket)) ++bucket;
+        ++counts[bucket];
+        ++total;
+        maxNs = max(maxNs, ns);
+    }
+
+    // Upper bound (us) of the bucket holding the given fraction of samples
+    int64_t percentileUs(double fraction) const {
+        uint64_t rank = static_cast<uint64_t>(ceil(fraction * total));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+            seen += counts[bucket];
+            if (seen >= rank && seen > 0) return bucketLimitUs(bucket);
+        }
+        return bucketLimitUs(BUCKETS - 1);
+    }
+
+    void print(ostream& os, const char* title) const {
+        os << title << ": " << total << " samples";
+        if (total == 0) {
+            os << "\n";
+            return;
+        }
+        os << ", p50 < " << percentileUs(0.5) << " us, p99 < " << percentileUs(0.99) << " us, max "
+           << maxNs / 1000 << " us\n";
+        for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+            if (counts[bucket] == 0) continue;
+            if (bucket == BUCKETS - 1) {
+                os << "  >= " << bucketLimitUs(bucket - 1) << " us: ";
+            } else {
+                os << "  < " << bucketLimitUs(bucket) << " us: ";
+            }
+            os << counts[bucket] << "\n";
+        }
+    }
+};
+
+// Command gateway on a local socket ("unix:/path", "host:port" or "port" on 127.0.0.1).
+// One thread multiplexes every session with epoll and runs the commands against the book,
+// with no thread per client. A request is one line. Each reply is framed as
+// "@<seq> <bytes>\n" followed by the engine output (and errors) for that command, where
+// seq numbers the session's requests from 1. A line is admitted if its session has room
+// in its queue and a token left in its bucket; otherwise it is rejected at once, so its
+// reply can overtake those of commands still queued (the sequence number pairs them).
+// Queued commands run round-robin, a quantum per session per loop pass, so a flooding
+// session only delays itself: each session's commands run in its own order, but sessions
+// interleave. Replies produced in one pass go out in one send per session; a session
+// whose unsent replies pile up is not read again until it drains.
+class Gateway {
+private:
+    struct PendingCommand {
+        uint64_t seq;
+        string line;
+        int64_t admittedNs;
+    };
+
+    struct Session {
+        uint64_t nextSeq = 1;
+        string input;
+        string output;
+        size_t outputSent = 0;
+        uint32_t events = 0;  // Current epoll interest
+        bool queued = false;  // In the flush list for this round
+        bool scheduled = false;  // In the run queue
+        bool closing = false;
+        deque<PendingCommand> pending;  // Admitted, waiting for the engine
+        double tokens = 0.0;
+        int64_t refilledNs = 0;
+        uint64_t executed = 0;
+        uint64_t throttled = 0;
+        uint64_t shed = 0;
+    };
+
+    static const size_t MAX_FRAME = 64 * 1024;
+    static const size_t MAX_UNSENT = 4 * 1024 * 1024;
+    static const size_t QUANTUM = 32;  // Commands per session per loop pass
+
+    OrderBook& book;
+    GatewayLimits limits;
+    int listenFd = -1;
+    int epollFd = -1;
+    int signalFd = -1;
+    string unixPath;
+    unordered_map<int, Session> sessions;
+    vector<int> flushList;
+    string reply;
+    StringAppendBuf capture;
+    uint64_t sessionsServed = 0;
+    uint64_t commands = 0;
+    deque<int> runQueue;  // Sessions with admitted commands, in service order
+    size_t queuedCommands = 0;
+    size_t peakQueued = 0;
+    uint64_t throttledCommands = 0;
+    uint64_t shedCommands = 0;
+    LatencyHistogram queueWait;
+
+    static int64_t monotonicNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // At least one whole token, or a rate under 1/s would never admit anything
+    double burstSize() const {
+        return limits.burst > 0 ? limits.burst : max(1.0, limits.rate);
+    }
+
+public:
+    Gateway(OrderBook& orderBook, const GatewayLimits& gatewayLimits = GatewayLimits())
+        : book(orderBook), limits(gatewayLimits), capture(reply) {
+        book.setOutput(&capture);
+    }
+
+    ~Gateway() {
+        for (const auto& entry : sessions) close(entry.first);
+        if (listenFd >= 0) close(listenFd);
+        if (epollFd >= 0) close(epollFd);
+        if (signalFd >= 0) close(signalFd);
+        if (!unixPath.empty()) unlink(unixPath.c_str());
+        book.setOutput(cout.rdbuf());
+    }
+
+    bool listen(const string& address) {
+        if (address.compare(0, 5, "unix:") == 0) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            string path = address.substr(5);
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+                cerr << "Gateway: bad socket path " << path << endl;
+                return false;
+            }
+            // Replace a stale socket from an earlier run, never any other kind of file
+            struct stat existing;
+            if (stat(path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+                unlink(path.c_str());
+            }
+            memcpy(addr.sun_path, path.c_str(), path.size());
+            listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                cerr << "Gateway: cannot bind " << path << ": " << strerror(errno) << endl;
+                return false;
+            }
+            unixPath = path;
+        } else {
+            size_t colon = address.rfind(':');
+            string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+            string port = colon == string::npos ? address : address.substr(colon + 1);
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(static_cast<uint16_t>(atoi(port.c_str())));
+            if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+                cerr << "Gateway: bad address " << address << endl;
+                return false;
+            }
+            listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int on = 1;
+            if (listenFd >= 0) setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                cerr << "Gateway: cannot bind " << address << ": " << strerror(errno) << endl;
+                return false;
+            }
+        }
+        if (::listen(listenFd, SOMAXCONN) != 0) {
+            cerr << "Gateway: listen failed: " << strerror(errno) << endl;
+            return false;
+        }
+
+        // SIGINT/SIGTERM arrive as events on the loop and end it cleanly
+        sigset_t stopSignals;
+        sigemptyset(&stopSignals);
+        sigaddset(&stopSignals, SIGINT);
+        sigaddset(&stopSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+        signalFd = signalfd(-1, &stopSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0 || signalFd < 0) {
+            cerr << "Gateway: epoll setup failed: " << strerror(errno) << endl;
+            return false;
+        }
+        watch(listenFd, EPOLLIN, EPOLL_CTL_ADD);
+        watch(signalFd, EPOLLIN, EPOLL_CTL_ADD);
+
+        cout << "Gateway listening on " << address << endl;
+        return true;
+    }
+
+    int run() {
+        epoll_event events[256];
+        bool stopping = false;
+        while (!stopping) {
+            // Only poll while commands are queued; compact books whenever the sessions go quiet
+            int ready = epoll_wait(epollFd, events, 256, runQueue.empty() ? 100 : 0);
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                cerr << "Gateway: epoll_wait failed: " << strerror(errno) << endl;
+                return 1;
+            }
+            if (ready == 0 && runQueue.empty()) {
+                book.compactIdle();
+                continue;
+            }
+
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd) {
+                    acceptSessions();
+                } else if (fd == signalFd) {
+                    stopping = true;
+                } else {
+                    auto it = sessions.find(fd);
+                    if (it == sessions.end()) continue;
+                    if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+                        readSession(fd, it->second);
+                    }
+                    if (events[i].events & EPOLLOUT) {
+                        queueFlush(fd, it->second);
                     }
                 }
+            }
+            serviceQueues();
+            flushSessions();
+        }
 
-                // Clean up empty price levels
-                if (ordersAtPrice.empty()) {
-                    buyIt = buyBook.erase(buyIt);
-                } else {
-                    ++buyIt;
+        // Last replies go out best-effort before the sockets close
+        for (auto& entry : sessions) {
+            queueFlush(entry.first, entry.second);
+        }
+        flushSessions();
+        cout << "Gateway stopped: " << sessionsServed << " sessions, " << commands << " commands, "
+             << throttledCommands << " throttled, " << shedCommands << " shed" << endl;
+        return 0;
+    }
+
+private:
+    void watch(int fd, uint32_t events, int op) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, op, fd, &event);
+    }
+
+    void acceptSessions() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                    cerr << "Gateway: accept failed: " << strerror(errno) << endl;
                 }
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
             }
+            if (unixPath.empty()) {
+                int on = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            }
+            Session& session = sessions[fd];
+            session.events = EPOLLIN | EPOLLRDHUP;
+            session.tokens = burstSize();
+            session.refilledNs = monotonicNs();
+            watch(fd, session.events, EPOLL_CTL_ADD);
+            ++sessionsServed;
         }
+    }
 
-        // Update FOK order status
-        updateOrderStatus(order);
+    // One read per wakeup keeps a busy session from starving the others
+    void readSession(int fd, Session& session) {
+        char buffer[64 * 1024];
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (n > 0) {
+            session.input.append(buffer, n);
+            size_t start = 0;
+            for (size_t end; !session.closing && (end = session.input.find('\n', start)) != string::npos;
+                 start = end + 1) {
+                admit(fd, session, session.input.substr(start, end - start));
+            }
+            session.input.erase(0, start);
+            if (session.input.size() > MAX_FRAME && !session.closing) {
+                appendReply(session, session.nextSeq++, "Request exceeds " + to_string(MAX_FRAME) + " bytes\n");
+                session.closing = true;
+            }
+        } else {
+            // Peer closed or failed: replies already queued still go out
+            session.closing = true;
+        }
+        queueFlush(fd, session);
+    }
 
-        // Should be completely filled
-        return order->status == FILLED;
+    // Queue a request line, or reject it now if the session's queue is full or it is over
+    // its rate. gateway_stats is answered at once and costs no token.
+    void admit(int fd, Session& session, string line) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        uint64_t seq = session.nextSeq++;
+        if (line == "gateway_stats") {
+            appendReply(session, seq, statsReport());
+            return;
+        }
+
+        // A shed command keeps its token
+        if (session.pending.size() >= limits.queueDepth) {
+            ++session.shed;
+            ++shedCommands;
+            appendReply(session, seq, "Rejected: session queue full\n");
+            return;
+        }
+        int64_t now = monotonicNs();
+        if (!takeToken(session, now)) {
+            ++session.throttled;
+            ++throttledCommands;
+            appendReply(session, seq, "Rejected: session rate limit exceeded\n");
+            return;
+        }
+
+        session.pending.push_back({ seq, move(line), now });
+        peakQueued = max(peakQueued, ++queuedCommands);
+        if (!session.scheduled) {
+            session.scheduled = true;
+            runQueue.push_back(fd);
+        }
     }
 
-    void updateOrderStatus(shared_ptr<Order>& order) {
-        if (order->filled_quantity >= order->quantity) {
-            order->status = FILLED;
-        } else if (order->filled_quantity > 0) {
-            order->status = PARTIALLY_FILLED;
+    bool takeToken(Session& session, int64_t now) {
+        if (limits.rate <= 0) {
+            return true;
+        }
+        session.tokens = min(burstSize(), session.tokens + (now - session.refilledNs) * limits.rate / 1e9);
+        session.refilledNs = now;
+        if (session.tokens < 1.0) {
+            return false;
         }
+        session.tokens -= 1.0;
+        return true;
     }
 
-    shared_mutex& getOrCreateSymbolMutex(const string& symbol) {
-        static mutex createMutex;
+    // One pass over the sessions with queued commands, up to QUANTUM each
+    void serviceQueues() {
+        for (size_t turns = runQueue.size(); turns > 0; --turns) {
+            int fd = runQueue.front();
+            runQueue.pop_front();
+            auto it = sessions.find(fd);
+            if (it == sessions.end() || !it->second.scheduled) continue;
+            Session& session = it->second;
+            session.scheduled = false;
+
+            for (size_t n = 0; n < QUANTUM && !session.pending.empty(); ++n) {
+                PendingCommand command = move(session.pending.front());
+                session.pending.pop_front();
+                --queuedCommands;
+                queueWait.add(monotonicNs() - command.admittedNs);
+                if (!dispatch(session, command.seq, command.line)) {
+                    // exit: what the session sent after it is dropped
+                    queuedCommands -= session.pending.size();
+                    session.pending.clear();
+                }
+            }
+            if (!session.pending.empty()) {
+                session.scheduled = true;
+                runQueue.push_back(fd);
+            }
+            queueFlush(fd, session);
+        }
+    }
 
-        // First check without locking for performance
-        auto it = symbolMutexes.find(symbol);
-        if (it != symbolMutexes.end()) {
-            return it->second;
+    // Commands that read or write server files; network clients must not name paths
+    static bool serverFileCommand(const string& line) {
+        istringstream iss(line);
+        string command;
+        iss >> command;
+        return command == "save_snapshot" || command == "load_snapshot" || command == "archive";
+    }
+
+    bool dispatch(Session& session, uint64_t seq, const string& line) {
+        // Engine errors go to cerr; capture them into the reply as well. A command that
+        // throws fails on its own instead of taking every session down with it.
+        reply.clear();
+        bool keepSession = true;
+        if (serverFileCommand(line)) {
+            reply = "Rejected: file commands are not available to gateway sessions\n";
+        } else {
+            streambuf* errors = cerr.rdbuf(&capture);
+            try {
+                keepSession = executeCommand(book, line);
+            } catch (const exception& e) {
+                cerr << "Command failed: " << e.what() << endl;
+            }
+            cerr.rdbuf(errors);
         }
+        ++commands;
+        ++session.executed;
 
-        // If not found, lock and check again (double-checked locking pattern)
-        {
-            lock_guard<mutex> lock(createMutex);
-            // Check again after acquiring lock
-            it = symbolMutexes.find(symbol);
-            if (it != symbolMutexes.end()) {
-                return it->second;
+        appendReply(session, seq, reply);
+        if (!keepSession) {
+            session.closing = true;
+        }
+        return keepSession;
+    }
+
+    string statsReport() const {
+        ostringstream report;
+        report << "Gateway: " << sessions.size() << " sessions, " << commands << " commands, " << queuedCommands
+               << " queued (peak " << peakQueued << "), " << throttledCommands << " throttled, " << shedCommands
+               << " shed\n";
+        report << "Limits: ";
+        if (limits.rate > 0) {
+            report << limits.rate << " commands/s per session, burst " << burstSize();
+        } else {
+            report << "no rate limit";
+        }
+        report << ", queue " << limits.queueDepth << "\n";
+        map<int, const Session*> ordered;
+        for (const auto& entry : sessions) ordered.emplace(entry.first, &entry.second);
+        for (const auto& entry : ordered) {
+            const Session& session = *entry.second;
+            report << "Session " << entry.first << ": " << session.pending.size() << " queued, " << session.executed
+                   << " executed, " << session.throttled << " throttled, " << session.shed << " shed\n";
+        }
+        queueWait.print(report, "Queue wait");
+        return report.str();
+    }
+
+    static void appendReply(Session& session, uint64_t seq, const string& payload) {
+        session.output += '@';
+        session.output += to_string(seq);
+        session.output += ' ';
+        session.output += to_string(payload.size());
+        session.output += '\n';
+        session.output += payload;
+    }
+
+    void queueFlush(int fd, Session& session) {
+        if (!session.queued) {
+            session.queued = true;
+            flushList.push_back(fd);
+        }
+    }
+
+    // Send each queued session's pending replies, then re-arm its epoll interest
+    void flushSessions() {
+        for (int fd : flushList) {
+            auto it = sessions.find(fd);
+            if (it == sessions.end()) continue;
+            Session& session = it->second;
+            session.queued = false;
+
+            bool failed = false;
+            while (session.outputSent < session.output.size()) {
+                ssize_t sent = send(fd, session.output.data() + session.outputSent,
+                                    session.output.size() - session.outputSent, MSG_NOSIGNAL);
+                if (sent < 0) {
+                    if (errno == EINTR) continue;
+                    failed = errno != EAGAIN && errno != EWOULDBLOCK;
+                    break;
+                }
+                session.outputSent += sent;
+            }
+            size_t unsent = session.output.size() - session.outputSent;
+            if (unsent == 0) {
+                session.output.clear();
+                session.outputSent = 0;
+            }
+
+            // A session that hung up still gets the commands it sent before that run
+            if (failed || (session.closing && unsent == 0 && session.pending.empty())) {
+                queuedCommands -= session.pending.size();
+                close(fd);
+                sessions.erase(it);
+                continue;
+            }
+
+            uint32_t wanted = unsent > 0 ? static_cast<uint32_t>(EPOLLOUT) : 0u;
+            if (!session.closing && unsent < MAX_UNSENT) {
+                wanted |= EPOLLIN | EPOLLRDHUP;
+            }
+            if (wanted != session.events) {
+                session.events = wanted;
+                watch(fd, wanted, EPOLL_CTL_MOD);
             }
-            // Create new mutex if still needed
-            return symbolMutexes[symbol];
         }
+        flushList.clear();
     }
 };
 
 int main(int argc, char* argv[]) {
-    OrderBook orderBook;
+    // Leading options:
+    //   --shm <name>                     publish book snapshots to shared memory
+    //   --read-snapshot <name> [symbol]  print another engine's snapshot and exit
+    //   --read-archive <file> [symbol]   print an end-of-day archive (or one symbol) and exit
+    //   --archive <file>                 write the session's orders and trades there at the end
+    //   --deterministic                  logical clock, canonical state dump at the end
+    //   --diff <seed> <count>            differential run over seeded random flow
+    //   --diff-file <file>               differential run over a recorded command file
+    //   --threaded                       read commands on an IO thread, match on another
+    //   --io-cpu <cpu>, --match-cpu <cpu> pin the runner threads (implies --threaded)
+    //   --wait spin|adaptive             input queue wait strategy (implies --threaded)
+    //   --batch <n>                      coalesce up to n resting orders per symbol
+    //   --snapshot <file>                start from a saved engine snapshot
+    //   --backtest <dir> <files...>      replay each file in its own book, outputs in dir
+    //   --jobs <n>                       backtest worker threads (default: all cores)
+    //   --listen <address>               serve sessions on unix:<path> or [host:]port
+    //   --session-rate <n>               gateway commands per second per session (default: no limit)
+    //   --session-burst <n>              commands a session may send at once, >= 1 (default: one second's)
+    //   --session-queue <n>              gateway commands a session may have waiting (default 1024)
+    //   --profile                        hardware counter profile per stage and order variant
+    //   --post-trade                     keep per-account positions on a post-trade thread
+    //   --drop-copy <file>               post-trade stage plus a drop-copy CSV of every fill
+    string shmName;
+    string snapshotPath;
+    string backtestDir;
+    unsigned backtestJobs = 0;
+    string listenAddress;
+    bool profile = false;
+    bool postTrade = false;
+    string dropCopyPath;
+    string archivePath;
+    bool deterministic = false;
+    bool threaded = false;
+    EngineConfig config;
+    GatewayLimits gatewayLimits;
+    int argIndex = 1;
+    while (argIndex < argc && strncmp(argv[argIndex], "--", 2) == 0) {
+        string option = argv[argIndex];
+        if (option == "--read-snapshot" && argIndex + 1 < argc) {
+            string symbol = argIndex + 2 < argc ? argv[argIndex + 2] : "";
+            return readSnapshot(argv[argIndex + 1], symbol);
+        } else if (option == "--read-archive" && argIndex + 1 < argc) {
+            string symbol = argIndex + 2 < argc ? argv[argIndex + 2] : "";
+            return readArchive(argv[argIndex + 1], symbol);
+        } else if (option == "--shm" && argIndex + 1 < argc) {
+            shmName = argv[argIndex + 1];
+            argIndex += 2;
+        } else if (option == "--deterministic") {
+            deterministic = true;
+            argIndex += 1;
+        } else if (option == "--archive" && argIndex + 1 < argc) {
+            archivePath = argv[argIndex + 1];
+            argIndex += 2;
+        } else if (option == "--profile") {
+            profile = true;
+            argIndex += 1;
+        } else if (option == "--post-trade") {
+            postTrade = true;
+            argIndex += 1;
+        } else if (option == "--drop-copy" && argIndex + 1 < argc) {
+            dropCopyPath = argv[argIndex + 1];
+            postTrade = true;
+            argIndex += 2;
+        } else if (option == "--threaded") {
+            threaded = true;
+            argIndex += 1;
+        } else if ((option == "--io-cpu" || option == "--match-cpu") && argIndex + 1 < argc) {
+            (option == "--io-cpu" ? config.ioCpu : config.matchingCpu) = stoi(argv[argIndex + 1]);
+            threaded = true;
+            argIndex += 2;
+        } else if (option == "--snapshot" && argIndex + 1 < argc) {
+            snapshotPath = argv[argIndex + 1];
+            argIndex += 2;
+        } else if (option == "--backtest" && argIndex + 1 < argc) {
+            backtestDir = argv[argIndex + 1];
+            argIndex += 2;
+        } else if (option == "--listen" && argIndex + 1 < argc) {
+            listenAddress = argv[argIndex + 1];
+            argIndex += 2;
+        } else if (option == "--session-rate" && argIndex + 1 < argc) {
+            if (!parseNumber(argv[argIndex + 1], gatewayLimits.rate) || gatewayLimits.rate < 0) {
+                cerr << "Invalid session rate (commands per second, 0 for no limit): " << argv[argIndex + 1]
+                     << endl;
+                return 1;
+            }
+            argIndex += 2;
+        } else if (option == "--session-burst" && argIndex + 1 < argc) {
+            if (!parseNumber(argv[argIndex + 1], gatewayLimits.burst) || gatewayLimits.burst < 1) {
+                cerr << "Invalid session burst (at least 1 command): " << argv[argIndex + 1] << endl;
+                return 1;
+            }
+            argIndex += 2;
+        } else if (option == "--session-queue" && argIndex + 1 < argc) {
+            int depth;
+            if (!parseNumber(argv[argIndex + 1], depth) || depth < 1) {
+                cerr << "Invalid session queue (at least 1 command): " << argv[argIndex + 1] << endl;
+                return 1;
+            }
+            gatewayLimits.queueDepth = depth;
+            argIndex += 2;
+        } else if (option == "--jobs" && argIndex + 1 < argc) {
+            backtestJobs = stoul(argv[argIndex + 1]);
+            argIndex += 2;
+        } else if (option == "--batch" && argIndex + 1 < argc) {
+            config.orderBatch = stoul(argv[argIndex + 1]);
+            argIndex += 2;
+        } else if (option == "--wait" && argIndex + 1 < argc) {
+            config.inputWait = strcmp(argv[argIndex + 1], "spin") == 0 ? BUSY_SPIN : SPIN_THEN_FUTEX;
+            threaded = true;
+            argIndex += 2;
+        } else if (option == "--diff" && argIndex + 2 < argc) {
+            setenv("TZ", "UTC", 1);
+            tzset();
+            return runDifferential(generateOrderFlow(stoul(argv[argIndex + 1]), stoi(argv[argIndex + 2])),
+                                   EngineConfig());
+        } else if (option == "--diff-file" && argIndex + 1 < argc) {
+            ifstream flowFile(argv[argIndex + 1]);
+            if (!flowFile.is_open()) {
+                cerr << "Failed to open command file: " << argv[argIndex + 1] << endl;
+                return 1;
+            }
+            vector<string> flow;
+            string line;
+            while (getline(flowFile, line)) flow.push_back(line);
+            setenv("TZ", "UTC", 1);
+            tzset();
+            return runDifferential(flow, EngineConfig());
+        } else {
+            cerr << "Unknown option: " << option << endl;
+            return 1;
+        }
+    }
+
+    // Backtest runs are always deterministic replays
+    if (!backtestDir.empty()) {
+        deterministic = true;
+    }
+
+    // Replays must not depend on the host timezone either
+    if (deterministic) {
+        setenv("TZ", "UTC", 1);
+        tzset();
+    }
 
-    cout << "Starting Stock Market Order Matching System with Circuit Breakers..." << endl;
+    config.deterministic = deterministic;
 
     // Set up stock-specific price bands (example)
-    orderBook.setStockPriceBand("RELIANCE", 2000.0, 5.0);  // 5% band
-    orderBook.setStockPriceBand("INFY", 1500.0, 10.0);     // 10% band
-    orderBook.setStockPriceBand("TATASTEEL", 800.0, 20.0); // 20% band
+    auto setPriceBands = [](OrderBook& orderBook) {
+        orderBook.setStockPriceBand("RELIANCE", 2000.0, 5.0);  // 5% band
+        orderBook.setStockPriceBand("INFY", 1500.0, 10.0);     // 10% band
+        orderBook.setStockPriceBand("TATASTEEL", 800.0, 20.0); // 20% band
+    };
+
+    auto setUpBook = [&](OrderBook& orderBook) {
+        cout << "Starting Stock Market Order Matching System with Circuit Breakers..." << endl;
+
+        setPriceBands(orderBook);
+        if (profile) {
+            orderBook.enableProfiling();
+        }
+        if (postTrade && !orderBook.enablePostTrade(dropCopyPath)) {
+            return false;
+        }
+
+        if (!shmName.empty() && !orderBook.enableSnapshots(shmName)) {
+            return false;
+        }
+        return snapshotPath.empty() || orderBook.loadSnapshot(snapshotPath);
+    };
+
+    if (!backtestDir.empty()) {
+        if (argIndex >= argc) {
+            cerr << "Backtest needs at least one command file" << endl;
+            return 1;
+        }
+        // Every run starts from the same instruments and optional snapshot; no shm, since
+        // the runs would overwrite each other's published state
+        auto setUpRun = [&](OrderBook& orderBook) {
+            setPriceBands(orderBook);
+            if (profile) {
+                orderBook.enableProfiling();
+            }
+            return snapshotPath.empty() || orderBook.loadSnapshot(snapshotPath);
+        };
+        return runBacktest(vector<string>(argv + argIndex, argv + argc), backtestDir, backtestJobs,
+                           config, setUpRun);
+    }
+
+    if (threaded) {
+        if (argIndex >= argc) {
+            cerr << "Threaded mode needs a command file" << endl;
+            return 1;
+        }
+        ifstream commandFile(argv[argIndex]);
+        if (!commandFile.is_open()) {
+            cerr << "Failed to open command file: " << argv[argIndex] << endl;
+            return 1;
+        }
+        return runThreaded(commandFile, config, setUpBook);
+    }
+
+    OrderBook orderBook(config);
+    if (!setUpBook(orderBook)) {
+        return 1;
+    }
+
+    if (!listenAddress.empty()) {
+        Gateway gateway(orderBook, gatewayLimits);
+        return gateway.listen(listenAddress) ? gateway.run() : 1;
+    }
 
     // Check if we're running from a command file
-    if (argc > 1) {
-        ifstream commandFile(argv[1]);
+    if (argIndex < argc) {
+        ifstream commandFile(argv[argIndex]);
         string line;
 
         if (!commandFile.is_open()) {
-            cerr << "Failed to open command file: " << argv[1] << endl;
+            cerr << "Failed to open command file: " << argv[argIndex] << endl;
             return 1;
         }
 
+        CommandRunner runner(orderBook, config);
         while (getline(commandFile, line)) {
-            istringstream iss(line);
-            string command;
-
-            iss >> command;
-
-            if (command == "exit") {
+            if (!runner.submit(line)) {
                 break;
-            } else if (command == "place_order") {
-                string typeStr, variantStr, symbolStr;
-                double price;
-                int quantity;
-
-                iss >> typeStr >> variantStr >> price >> quantity >> symbolStr;
-
-                OrderType type = (typeStr == "BUY") ? BUY : SELL;
-                OrderVariant variant;
-
-                if (variantStr == "LIMIT") variant = LIMIT;
-                else if (variantStr == "MARKET") variant = MARKET;
-                else if (variantStr == "IOC") variant = IOC;
-                else if (variantStr == "FOK") variant = FOK;
-                else {
-                    cerr << "Invalid order variant: " << variantStr << endl;
-                    continue;
-                }
-
-                orderBook.placeOrder(type, variant, price, quantity, symbolStr);
-            } else if (command == "cancel_order") {
-                int orderId;
-                iss >> orderId;
-                orderBook.cancelOrder(orderId);
-            } else if (command == "print_orderbook") {
-                string symbol;
-                iss >> symbol;
-                orderBook.printOrderBook(symbol);
-            } else if (command == "print_trades") {
-                string symbol;
-                iss >> symbol;
-                orderBook.printTradeHistory(symbol);
-            } else if (command == "update_index") {
-                double indexValue;
-                iss >> indexValue;
-                orderBook.updateIndexValue(indexValue, time(nullptr));
-            } else {
-                cerr << "Unknown command: " << command << endl;
             }
         }
+        runner.flush();
+        orderBook.settleIndex();
+
+        if (orderBook.stageProfiler()) {
+            orderBook.printProfile();
+        }
+        if (!archivePath.empty()) {
+            orderBook.writeArchive(archivePath);
+        }
+        if (deterministic) {
+            cout << "\n===== Canonical State =====" << endl;
+            orderBook.writeCanonicalState(cout);
+        }
 
         commandFile.close();
         return 0;
@@ -1252,10 +8097,11 @@ int main(int argc, char* argv[]) {
 
     // Create a time for 11:30 AM
     time_t currentTime = time(nullptr);
-    struct tm* timeinfo = localtime(&currentTime);
-    timeinfo->tm_hour = 11;
-    timeinfo->tm_min = 30;
-    time_t simulatedTime = mktime(timeinfo);
+    struct tm timeinfo;
+    localtime_r(&currentTime, &timeinfo);
+    timeinfo.tm_hour = 11;
+    timeinfo.tm_min = 30;
+    time_t simulatedTime = mktime(&timeinfo);
 
     // Trigger level 1 circuit breaker (12% drop from reference)
     orderBook.updateIndexValue(15400.0, simulatedTime); // ~12% drop from 17500
@@ -3,6 +3,8 @@ document.addEventListener('DOMContentLoaded', function() {
     // Handle the order variant change to toggle price field visibility
     const orderVariantSelect = document.getElementById('order_variant');
     const priceGroup = document.getElementById('price-group');
+    const stopPriceGroup = document.getElementById('stop-price-group');
+    const peakGroup = document.getElementById('peak-group');
 
     if (orderVariantSelect && priceGroup) {
         orderVariantSelect.addEventListener('change', function() {
@@ -13,6 +15,14 @@ document.addEventListener('DOMContentLoaded', function() {
                 priceGroup.style.display = 'block';
                 document.getElementById('price').setAttribute('required', 'required');
             }
+
+            // Stop-limit orders carry both a limit price and a separate trigger price
+            if (stopPriceGroup) {
+                stopPriceGroup.style.display = this.value === 'STOP_LIMIT' ? 'block' : 'none';
+            }
+            if (peakGroup) {
+                peakGroup.style.display = this.value === 'ICEBERG' ? 'block' : 'none';
+            }
         });
     }
 